@@ -0,0 +1,67 @@
+/**
+ * \file            boot_app.h
+ * \brief           Check of the application image before BOOTEN starts it. The host puts a header
+ *                  with the image length and CRC16 into the reserved vectors 7 .. 9 of the vector
+ *                  table. After a full digest of the image passes (CMD_VALIDATE or the first boot)
+ *                  a marker with the length and CRC is kept in the key-value log, so the next boots
+ *                  only read the header and the marker. Every main flash write or erase voids it.
+ * \copyright       DC Vostok Vladivostok 2023
+ */
+
+#ifndef BOOT_APP_H
+#define BOOT_APP_H
+
+#include "boot_conf.h"
+#include "boot_flash.h"
+#include "boot_kv.h"
+
+#define APP_HDR_OFFSET          0x1C /*!< Reserved vector 7, the header is left out of the digest */
+#define APP_HDR_BYTES           12
+#define APP_HDR_MAGIC           0x48505041UL /*!< "APPH" */
+#define APP_KV_KEY              (KV_KEY_TOTAL - 1) /*!< Key of the marker, refused by CMD_KV_SET */
+#define APP_MARK(hdr)           ((((hdr)->length >> 3) << 16) | ((hdr)->crc & 0xFFFF))
+
+/**
+ * \brief           Header of the application image
+ */
+typedef struct
+{
+    uint32_t length; /*!< Bytes from the start of main flash covered by the digest, multiple of 8 */
+    uint32_t crc;    /*!< CRC16 of the image without the header, its complement in the high half */
+} AppHeader_TypeDef;
+
+/**
+ * \brief           Read the header and check it together with the vector table: stack top in RAM,
+ *                  Thumb reset handler inside the image
+ * \param[out]      hdr: header of the image
+ * \return          1 if the header is plausible
+ */
+RAMFUNC uint32_t app_header(AppHeader_TypeDef* hdr);
+
+/**
+ * \brief           CRC16 of the image, crc_upd() must be ready (crc_init())
+ * \param[in]       hdr: header of the image
+ * \return          CRC16 of the length bytes without the header
+ */
+RAMFUNC uint16_t app_digest(const AppHeader_TypeDef* hdr);
+
+/**
+ * \brief           The marker in NVR was written for this header
+ * \param[in]       hdr: header of the image
+ * \return          1 if marked
+ */
+RAMFUNC uint32_t app_marked(const AppHeader_TypeDef* hdr);
+
+/**
+ * \brief           Write the marker of an image whose digest passed
+ * \param[in]       hdr: header of the image
+ */
+RAMFUNC void app_mark(const AppHeader_TypeDef* hdr);
+
+/**
+ * \brief           Void the marker before main flash is written or erased,
+ *                  nothing is programmed when there is none
+ */
+RAMFUNC void app_unmark();
+
+#endif //BOOT_APP_H
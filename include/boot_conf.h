@@ -18,7 +18,30 @@
 #define BOOT_VER_MINOR  0x0003
 #define BOOT_VER        ((BOOT_VER_MAJOR<<16)|BOOT_VER_MINOR)
 #define BOOT_NAME       "K1921VK035_BOOTLOADER"
+
+/**
+ * \brief           System clock. The PLL runs from the external crystal with BOOT_CLK_SRC = BOOT_CLK_OSE and
+ *                  from the internal 8 MHz OSICLK otherwise, or when the crystal does not start within
+ *                  BOOT_OSE_START_LOOPS. Both references give SYSCLK, flash wait states follow from it.
+ */
+#define BOOT_CLK_OSI    0 /*!< Internal 8 MHz OSICLK, CMD_GET_INFO reports the PLL reference */
+#define BOOT_CLK_OSE    1 /*!< External crystal */
+#ifndef BOOT_CLK_SRC
+#define BOOT_CLK_SRC    BOOT_CLK_OSI
+#endif
+#ifndef SYSCLK
 #define SYSCLK          100000000
+#endif
+#ifndef BOOT_OSE_HZ
+#define BOOT_OSE_HZ     16000000
+#endif
+#ifndef BOOT_OSE_PLL_N
+#define BOOT_OSE_PLL_N  (BOOT_OSE_HZ / 4000000) /*!< Reference divider, 4 MHz into the PLL */
+#endif
+#define BOOT_OSE_START_LOOPS (20000) /*!< Wait for the PLL lock on the crystal, about 10 ms at the 8 MHz reset clock */
+#define BOOT_OSI_HZ     8000000
+#define BOOT_PLL_M(ref_hz, n) ((SYSCLK * 2UL * (n)) / (ref_hz)) /*!< PLL multiplier, OD = 1 halves the output */
+#define BOOT_FLASH_LAT  ((SYSCLK - 1) / 30000000) /*!< Flash wait states less one, 30 MHz per state */
 
 /**
  * \note           BOOTEN pin used for activate bootloader 
@@ -26,6 +49,7 @@
 #define BOOTEN_PORT GPIOA /*!< Port of  BOOTEN pin */
 #define BOOTEN_PIN_POS (7) /*!< Pin num of BOOTEN pin */
 #define BOOTEN_PIN_MSK (1 << BOOTEN_PIN_POS) /*!< Pin num of BOOTEN pin */
+#define BOOTEN_SETTLE_LOOPS (16) /*!< Pull-up settling before BOOTEN is sampled, about 8 us at the 8 MHz reset clock */
 //Debug
 #define DBG_PORT        GPIOA
 #define DBG_PORT_EN     RCU_HCLKCFG_GPIOAEN_Msk
@@ -50,8 +74,61 @@
 #define UART_PINS_MSK       ((1<<UART_PIN_RX_POS) | (1<<UART_PIN_TX_POS))
 #define UART_RX_IRQHandler  UART0_RX_IRQHandler
 #define UART_RX_IRQn        UART0_RX_IRQn
+#define UART_RT_IRQHandler  UART0_IRQHandler /*!< Receive timeout, the vector is shared with UART errors */
+#define UART_RT_IRQn        UART0_IRQn
+#define UART_TX_IRQHandler  UART0_TX_IRQHandler /*!< Wakes the core to refill the TX FIFO */
+#define UART_TX_IRQn        UART0_TX_IRQn
 #define UART_TIMEOUT        (500)//ms
 
+/**
+ * \brief           RX FIFO interrupt levels. Inside the data of a frame the level is raised while
+ *                  more than UART_RX_BULK_BYTES bytes are still to come, the receive timeout
+ *                  (32 bit times without a byte) takes the bytes left below any level.
+ */
+#define UART_RX_IFLS        UART_IFLS_RXIFLSEL_Lvl18 /*!< Between frames: 2 of 16 bytes */
+#define UART_RX_IFLS_BULK   UART_IFLS_RXIFLSEL_Lvl34 /*!< Inside frame data: 12 of 16 bytes */
+#define UART_RX_BULK_BYTES  12
+
+/**
+ * \brief           RS-485 driver enable (DE) pin, driven high while the bootloader transmits
+ */
+#define UART_DE_PORT        GPIOB
+#define UART_DE_PIN_POS     9
+#define UART_DE_PIN_MSK     (1 << UART_DE_PIN_POS)
+
+/**
+ * \brief           RTS / CTS pins of flow control, both active low. UART0 has no modem lines,
+ *                  so RTS is driven from the RX FIFO fill (PACKET_FIFO_RTS_OFF / PACKET_FIFO_RTS_ON)
+ *                  and CTS is checked before every byte is put into the TX FIFO
+ */
+#define UART_RTS_PORT       GPIOB
+#define UART_RTS_PIN_POS    12
+#define UART_RTS_PIN_MSK    (1 << UART_RTS_PIN_POS)
+#define UART_CTS_PORT       GPIOB
+#define UART_CTS_PIN_POS    13
+#define UART_CTS_PIN_MSK    (1 << UART_CTS_PIN_POS)
+
+/**
+ * \brief           SPI slave for communicate with a host MCU, BOOT_TRANSPORT_SPI. Motorola mode 0,
+ *                  8-bit frames, SCK up to SYSCLK / 12. The host clocks SPIS_SYNC_BYTE until the
+ *                  device signature comes back, then keeps clocking 0x00 to read answers.
+ */
+#define SPIS_PORT           GPIOB
+#define SPIS_PIN_SS_POS     4
+#define SPIS_PIN_SCK_POS    5
+#define SPIS_PIN_RX_POS     6 /*!< MOSI */
+#define SPIS_PIN_TX_POS     7 /*!< MISO */
+#define SPIS_PINS_MSK       ((1<<SPIS_PIN_SS_POS) | (1<<SPIS_PIN_SCK_POS) | \
+                             (1<<SPIS_PIN_RX_POS) | (1<<SPIS_PIN_TX_POS))
+#define SPIS_RX_IRQHandler  SPI_RX_IRQHandler
+#define SPIS_RX_IRQn        SPI_RX_IRQn
+#define SPIS_RT_IRQHandler  SPI_IRQHandler /*!< Receive timeout, the vector is shared with RX overrun */
+#define SPIS_RT_IRQn        SPI_IRQn
+#define SPIS_TX_IRQHandler  SPI_TX_IRQHandler /*!< Wakes the core to refill the TX FIFO */
+#define SPIS_TX_IRQn        SPI_TX_IRQn
+#define SPIS_SYNC_BYTE      0x7F
+#define SPIS_TIMEOUT        (500)//ms
+
 /**
  * \brief           Timer for calculate uart speed
  */
@@ -64,13 +141,179 @@
 #define TIMEOUT_TMR TMR0
 #define TIMEOUT_TMR_EN_Msk RCU_PRSTCFG_TMR0EN_Msk
 
+/**
+ * \brief           RAM budget, checked against boot_arena in boot_mem.c and by K1921VK035_boot.ld
+ */
+#define BOOT_RAM_BYTES          (16*1024) /*!< RAM region of K1921VK035_boot.ld */
+#define BOOT_RAM_DATA_BYTES     (3*1024)  /*!< .data with ramfuncs, limited by the BFLASH image */
+#define BOOT_RAM_BSS_BYTES      512       /*!< variables outside the arena */
+#define BOOT_RAM_APP_BASE       0x20000000 /*!< start of RAM, the RAM application region is placed first */
+#ifdef __STACK_SIZE
+#define BOOT_STACK_BYTES        __STACK_SIZE
+#else
+#define BOOT_STACK_BYTES        0xc00     /*!< default of startup_K1921VK035.S */
+#endif
+
 /**
  * \brief           Packet parser values
  */
-#define PACKET_FIFO_BYTES       8192
+#ifndef PACKET_PAGES_MAX
+#define PACKET_PAGES_MAX        4 /*!< Pages per CMD_WRITE_PAGES / CMD_READ_PAGES packet, 1 without BOOT_USE_MULTI_PAGE
+                                       or with BOOT_USE_RAM_RUN */
+#endif
+#define PACKET_ERASE_PROGRESS   8 /*!< CMD_ERASE_RANGE answers MSG_BUSY after this many pages */
 #define PACKET_HOST_SIGN        0x5C81
 #define PACKET_DEVICE_SIGN      0x7EA3
 #define PACKET_EMPTY_DATA       0x55
-#define PACKET_TMP_DATA_BYTES   (1024+8)
+#define BOOT_BAUD_MAX           (SYSCLK / 16) /*!< UART with 16x oversampling */
+#define PACKET_HOST_ADDR_SIGN   0x5C82 /*!< Host packet with node address, BOOT_USE_MULTIDROP */
+#define PACKET_ADDR_BROADCAST   0xFFFF /*!< Node address of packets executed by all nodes without answer */
+
+/**
+ * \brief           Link to the host, boot_transport_uart.c or boot_transport_spi.c
+ */
+#define BOOT_TRANSPORT_UART     0 /*!< UART with auto-baud */
+#define BOOT_TRANSPORT_SPI      1 /*!< SPI slave clocked by a host MCU */
+#ifndef BOOT_TRANSPORT
+#define BOOT_TRANSPORT          BOOT_TRANSPORT_UART
+#endif
+
+/**
+ * \brief           Optional features, 1 - enabled, 0 - disabled. The defaults keep the command set
+ *                  of the original bootloader, the rest is opt-in per build (platformio.ini)
+ */
+#ifndef BOOT_USE_COBS
+#define BOOT_USE_COBS           0 /*!< COBS framing, selected by CMD_SET_FRAMING */
+#endif
+#ifndef BOOT_USE_ARQ
+#define BOOT_USE_ARQ            0 /*!< Selective repeat page transfer, CMD_ARQ_WRITE / CMD_ARQ_POLL */
+#endif
+#define ARQ_WINDOW              32 /*!< Frames in flight, bits of the received bitmap */
+#ifndef BOOT_USE_WRITE_SESSION
+#define BOOT_USE_WRITE_SESSION  0 /*!< Erase ahead of the written page, CMD_WRITE_SESSION */
+#endif
+#ifndef BOOT_USE_MULTIDROP
+#define BOOT_USE_MULTIDROP      0 /*!< Node addressed packets for several devices on one bus */
+#endif
+#ifndef BOOT_USE_UART_DE
+#define BOOT_USE_UART_DE        0 /*!< Drive UART_DE_PORT / UART_DE_PIN_POS while transmitting */
+#endif
+#ifndef BOOT_USE_FLOW_CTRL
+#define BOOT_USE_FLOW_CTRL      0 /*!< RTS / CTS flow control on UART_RTS_PORT / UART_CTS_PORT */
+#endif
+#ifndef BOOT_USE_JOURNAL
+#define BOOT_USE_JOURNAL        0 /*!< Journal of written pages in NVR for resumed sessions, CMD_GET_JOURNAL */
+#endif
+#ifndef BOOT_USE_KV
+#define BOOT_USE_KV             0 /*!< Key-value log in NVR, CMD_KV_GET / CMD_KV_SET and boot_kv.h */
+#endif
+#ifndef BOOT_USE_CFGWORD
+#define BOOT_USE_CFGWORD        1 /*!< CMD_GET_CFGWORD / CMD_SET_CFGWORD */
+#endif
+#ifndef BOOT_USE_MULTI_PAGE
+#define BOOT_USE_MULTI_PAGE     0 /*!< PACKET_PAGES_MAX pages per packet, CMD_WRITE_PAGES / CMD_READ_PAGES */
+#endif
+#ifndef BOOT_USE_PARTIAL_WRITE
+#define BOOT_USE_PARTIAL_WRITE  0 /*!< Writes inside a page through the page cache, CMD_WRITE_RANGE / CMD_FLUSH */
+#endif
+#ifndef BOOT_USE_PAGE_STATUS
+#define BOOT_USE_PAGE_STATUS    0 /*!< Bitmap of the programmed pages, CMD_PAGE_STATUS */
+#endif
+#ifndef BOOT_USE_ERASE_RANGE
+#define BOOT_USE_ERASE_RANGE    0 /*!< Erase of consecutive pages with progress, CMD_ERASE_RANGE */
+#endif
+#ifndef BOOT_USE_BATCH
+#define BOOT_USE_BATCH          0 /*!< Several commands in one packet with one status vector, CMD_BATCH */
+#endif
+#define BATCH_CMDS_MAX          32 /*!< Commands of one CMD_BATCH */
+#define BATCH_ANSWER_BYTES      64 /*!< Longest answer of a command allowed in CMD_BATCH, kept free of the list */
+#ifndef BOOT_USE_LINK_TEST
+#define BOOT_USE_LINK_TEST      0 /*!< Link error counters, CMD_ECHO / CMD_TEST_STREAM */
+#endif
+#ifndef BOOT_USE_APP_CHECK
+#define BOOT_USE_APP_CHECK      0 /*!< BOOTEN starts only an image whose header and CRC pass, CMD_VALIDATE */
+#endif
+#ifndef BOOT_CRC_TABLE
+//the table takes RAM of the RX FIFO and no flash, it is filled by packet_fifo_init()
+#define BOOT_CRC_TABLE          0 /*!< crc_upd(): 0 - bit by bit, 16 - nibble table, 256 - byte table */
+#endif
+#ifndef BOOT_FLASH_STANDALONE
+#define BOOT_FLASH_STANDALONE   0 /*!< boot_flash.c is built into an application, see boot_kv.h */
+#endif
+#ifndef BOOT_FLASH_MAPPED_READ
+//BFLASH takes 0x00000000 in place of main flash while the bootloader runs (K1921VK035_boot.ld),
+//so only an application can read main flash with loads
+#define BOOT_FLASH_MAPPED_READ  BOOT_FLASH_STANDALONE /*!< Main flash is read with loads instead of MFLASH commands */
+#endif
+#ifndef BOOT_USE_RAM_RUN
+#define BOOT_USE_RAM_RUN        0 /*!< Upload an application to RAM and run it, CMD_RAM_WRITE / CMD_RAM_RUN */
+#endif
+#if BOOT_USE_RAM_RUN
+#ifndef BOOT_RAM_APP_BYTES
+#define BOOT_RAM_APP_BYTES      8192 /*!< RAM application region at BOOT_RAM_APP_BASE, taken from the RX FIFO */
+#endif
+#else
+#define BOOT_RAM_APP_BYTES      0
+#endif
+
+//the page count is settled before the sizes derived from it,
+//the RAM application region leaves room for one page per packet
+#if !BOOT_USE_MULTI_PAGE || BOOT_USE_RAM_RUN
+#undef PACKET_PAGES_MAX
+#define PACKET_PAGES_MAX        1
+#endif
+
+/**
+ * \brief           Sizes derived from the page count and the RAM budget
+ */
+#define PACKET_TMP_DATA_BYTES   (PACKET_PAGES_MAX*1024+8)
+/*!< RAM left by the budget, the packet and the staging page, signed so an overrun stays negative */
+#define PACKET_FIFO_BUDGET      (BOOT_RAM_BYTES - BOOT_RAM_DATA_BYTES - BOOT_RAM_BSS_BYTES - BOOT_STACK_BYTES - \
+                                 BOOT_RAM_APP_BYTES - (PACKET_TMP_DATA_BYTES + 16) - 1024 - BOOT_CRC_TABLE * 2)
+#if PACKET_FIFO_BUDGET < 1024
+#error "No RAM left for the RX FIFO, reduce PACKET_PAGES_MAX, BOOT_RAM_APP_BYTES or __STACK_SIZE"
+#endif
+#define PACKET_FIFO_BYTES       (PACKET_FIFO_BUDGET & ~7) /*!< RX ring in the arena */
+#define PACKET_FIFO_RTS_OFF     (PACKET_FIFO_BYTES - 256) /*!< RTS is released, the rest takes bytes the host has in flight */
+#define PACKET_FIFO_RTS_ON      (PACKET_FIFO_BYTES / 2)   /*!< RTS is asserted again */
+
+#if (BOOT_CRC_TABLE != 0) && (BOOT_CRC_TABLE != 16) && (BOOT_CRC_TABLE != 256)
+#error "BOOT_CRC_TABLE must be 0, 16 or 256"
+#endif
+
+#if BOOT_USE_MULTIDROP && !BOOT_USE_PAGE_STATUS
+#error "BOOT_USE_MULTIDROP needs BOOT_USE_PAGE_STATUS, bus programming asks every node for it"
+#endif
+
+#if BOOT_USE_APP_CHECK && !BOOT_USE_KV
+#error "BOOT_USE_APP_CHECK needs BOOT_USE_KV, the marker of the validated image is kept in the key-value log"
+#endif
+
+#if (BOOT_TRANSPORT == BOOT_TRANSPORT_SPI) && (BOOT_USE_MULTIDROP || BOOT_USE_UART_DE || BOOT_USE_FLOW_CTRL)
+#error "BOOT_USE_MULTIDROP, BOOT_USE_UART_DE and BOOT_USE_FLOW_CTRL need BOOT_TRANSPORT_UART"
+#endif
+
+#if ((SYSCLK * 2UL) % BOOT_OSI_HZ) || \
+    ((BOOT_CLK_SRC == BOOT_CLK_OSE) && ((SYSCLK * 2UL * BOOT_OSE_PLL_N) % BOOT_OSE_HZ))
+#error "SYSCLK must be an exact PLL multiple of OSICLK and of BOOT_OSE_HZ / BOOT_OSE_PLL_N"
+#endif
+
+#if BOOT_USE_UART_DE
+    #define UART_DE_SET()   (UART_DE_PORT->DATAOUTSET = UART_DE_PIN_MSK)
+    #define UART_DE_CLR()   (UART_DE_PORT->DATAOUTCLR = UART_DE_PIN_MSK)
+#else
+    #define UART_DE_SET()   ((void)0)
+    #define UART_DE_CLR()   ((void)0)
+#endif
+
+#if BOOT_USE_FLOW_CTRL
+    #define UART_RTS_ASSERT()   (UART_RTS_PORT->DATAOUTCLR = UART_RTS_PIN_MSK)
+    #define UART_RTS_RELEASE()  (UART_RTS_PORT->DATAOUTSET = UART_RTS_PIN_MSK)
+    #define UART_CTS_ASSERTED() (!(UART_CTS_PORT->DATA & UART_CTS_PIN_MSK))
+#else
+    #define UART_RTS_ASSERT()   ((void)0)
+    #define UART_RTS_RELEASE()  ((void)0)
+    #define UART_CTS_ASSERTED() (1)
+#endif
 
 #endif //BOOT_CONF_H
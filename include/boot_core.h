@@ -11,13 +11,13 @@
 #include "bitbanding.h"
 
 
-// return 0 if start UART byte received
-// return -1 If a UART timeout has occurred
+// return 0 if start byte received
+// return -1 If a timeout has occurred
 
 /**
- * \brief           Try receive start byte from HOST and calculate UART speed
- * \return          0 if start UART byte received  
- *                  -1 If a UART timeout has occurred
+ * \brief           Try receive start byte from HOST, the UART transport calculates its speed
+ * \return          0 if start byte received  
+ *                  -1 If a timeout has occurred
  */
 int boot_init(); 
 
@@ -27,7 +27,9 @@ int boot_init();
 RAMFUNC void boot_exit();
 
 /**
- * \brief           Starts bootloader core loop and receives packets from HOST
+ * \brief           Starts bootloader core loop and receives packets from HOST.
+ *                  Sleeps between link events (a complete frame, room in the TX FIFO), a handler
+ *                  runs to completion and polls MFLASH busy for its program and erase steps
  */
 RAMFUNC void boot_core();
 
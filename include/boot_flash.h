@@ -19,6 +19,17 @@
 #define FLASH_NVR_PAGE_TOTAL        4UL
 #define FLASH_NVR_TOTAL_BYTES       (FLASH_NVR_PAGE_SIZE_BYTES*FLASH_NVR_PAGE_TOTAL)
 #define FLASH_NVR_CFGWORD_OFFSET    (3*FLASH_NVR_PAGE_SIZE_BYTES)
+#define FLASH_NVR_NODE_ADDR_OFFSET  (FLASH_NVR_CFGWORD_OFFSET + 8) /*!< Low 16 bits: multidrop node address */
+#define FLASH_KV_PAGE               (FLASH_PAGE_TOTAL - 2) /*!< Key-value log, this page and the next, see boot_kv.h */
+#define FLASH_JOURNAL_PAGE          (FLASH_PAGE_TOTAL - 3) /*!< Progress journal, see boot_journal.h */
+//the pages above the application hold only bookkeeping of the bootloader, never CFGWORD
+#if BOOT_USE_JOURNAL
+#define FLASH_APP_PAGE_TOTAL        FLASH_JOURNAL_PAGE /*!< Main flash pages the host can write and erase */
+#elif BOOT_USE_KV
+#define FLASH_APP_PAGE_TOTAL        FLASH_KV_PAGE
+#else
+#define FLASH_APP_PAGE_TOTAL        FLASH_PAGE_TOTAL
+#endif
 
 #define CFGWORD_FLASHWE_POS         3
 #define CFGWORD_NVRWE_POS           2
@@ -49,6 +60,17 @@ typedef enum {
  */ 
 RAMFUNC void flash_read(uint32_t addr, FlashType_TypeDef ftype, uint32_t* data);
 
+/**
+ * \brief           Read a block of 8-byte words from flash memory. Main flash is copied with
+ *                  loads when BOOT_FLASH_MAPPED_READ is set, otherwise the read commands are
+ *                  issued back to back.
+ * \param[in]       addr: flash memory address, multiple of 8
+ * \param[in]       ftype: Type of flash memory
+ * \param[out]      data: array with size len / 4
+ * \param[in]       len: number of bytes, multiple of 8
+ */
+RAMFUNC void flash_read_block(uint32_t addr, FlashType_TypeDef ftype, uint32_t* data, uint32_t len);
+
 /**
  * \brief           Write 2x32-bit data (8 byte) to flash memory
  * \param[in]       addr: flash memory address 
@@ -64,11 +86,42 @@ RAMFUNC void flash_write(uint32_t addr, FlashType_TypeDef ftype, const uint32_t*
  */
 RAMFUNC void flash_erase_page(uint32_t addr, FlashType_TypeDef ftype);
 
+/**
+ * \brief           Wait for the end of an erase or write, they run on after their call returns
+ */
+RAMFUNC void flash_wait();
+
 /**
  * \brief           Full erase of flash memory
  */
 RAMFUNC void flash_erase_full();
 
+/**
+ * \brief           Load a page into the RAM page cache for modification in place.
+ *                  A cached page of another address is committed first.
+ * \param[in]       addr: flash memory address inside the page
+ * \param[in]       ftype: Type of flash memory
+ * \return          Cached page, committed by flash_cache_flush()
+ */
+RAMFUNC uint32_t* flash_cache_page(uint32_t addr, FlashType_TypeDef ftype);
+
+/**
+ * \brief           Write bytes inside one page through the RAM page cache.
+ *                  The page is read into the cache on first use, a cached page
+ *                  of another address is committed first.
+ * \param[in]       addr: flash memory address
+ * \param[in]       ftype: Type of flash memory
+ * \param[in]       data: bytes to write
+ * \param[in]       len: number of bytes, must not cross the end of the page
+ */
+RAMFUNC void flash_cache_write(uint32_t addr, FlashType_TypeDef ftype, const uint8_t* data, uint32_t len);
+
+/**
+ * \brief           Commit the cached page if it was modified and empty the cache.
+ *                  Must be called before flash is read, written or erased directly.
+ */
+RAMFUNC void flash_cache_flush();
+
 /**
  * \brief           Disabling startup from boot memory after the next software reset
  */
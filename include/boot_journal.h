@@ -0,0 +1,50 @@
+/**
+ * \file            boot_journal.h
+ * \brief           Progress journal of page writes, lets the host resume an interrupted session.
+ *                  Entries are appended as single double words to main flash page FLASH_JOURNAL_PAGE
+ *                  without erasing, the page is erased only to compact a full journal. It holds
+ *                  nothing else, so a compaction cut by a power loss only drops entries and the
+ *                  host sends those pages again.
+ * \copyright       DC Vostok Vladivostok 2023
+ */
+
+#ifndef BOOT_JOURNAL_H
+#define BOOT_JOURNAL_H
+
+#include "boot_conf.h"
+#include "boot_flash.h"
+
+#define JOURNAL_ADDR            (FLASH_JOURNAL_PAGE * FLASH_PAGE_SIZE_BYTES)
+#define JOURNAL_ENTRY_TOTAL     (FLASH_PAGE_SIZE_BYTES / 8) /*!< Double words of the journal page */
+#define JOURNAL_TAG_MSK         0xFFFF0000UL
+#define JOURNAL_TAG_WRITTEN     0x4A570000UL /*!< Main flash page written, its CRC16 follows */
+#define JOURNAL_TAG_STALE       0x4A580000UL /*!< Main flash page erased or changed since it was written */
+#define JOURNAL_TAG_CLEAR       0x4A430000UL /*!< Session finished, older entries are void */
+
+/**
+ * \brief           Record a main flash page written from a correct packet
+ * \param[in]       page: page index
+ * \param[in]       crc: CRC16 of the page data
+ */
+RAMFUNC void journal_page_written(uint32_t page, uint16_t crc);
+
+/**
+ * \brief           Record that a main flash page no longer holds what was journaled,
+ *                  nothing is written when its last entry is not JOURNAL_TAG_WRITTEN
+ * \param[in]       page: page index
+ */
+RAMFUNC void journal_page_stale(uint32_t page);
+
+/**
+ * \brief           End the session, nothing is written when the journal is already empty
+ */
+RAMFUNC void journal_clear();
+
+/**
+ * \brief           Copy the entries of the current session
+ * \param[out]      data: two words per entry, JOURNAL_ENTRY_TOTAL entries at most
+ * \return          Number of entries
+ */
+RAMFUNC uint32_t journal_read(uint32_t* data);
+
+#endif //BOOT_JOURNAL_H
@@ -0,0 +1,43 @@
+/**
+ * \file            boot_kv.h
+ * \brief           Key-value log for settings that change often, such as calibration.
+ *                  The log takes the last two pages of main flash, FLASH_KV_PAGE and the next one,
+ *                  and lives in one of them at a time. A page starts with a header of magic and
+ *                  generation, the active page is the valid header of the higher generation.
+ *                  A write appends one 8-byte record after the header. A full log is compacted into
+ *                  the other page, whose header is programmed last: until then the old page stays
+ *                  active, so a reset during compaction loses nothing. NVR is never erased.
+ *                  A RAM index gives the record of every key.
+ *                  The application can link boot_kv.c and boot_flash.c built with
+ *                  BOOT_FLASH_STANDALONE to use the same log (test/test_firmware, env:vostok_uno_vn035_kv).
+ * \copyright       DC Vostok Vladivostok 2023
+ */
+
+#ifndef BOOT_KV_H
+#define BOOT_KV_H
+
+#include "boot_conf.h"
+#include "boot_flash.h"
+
+#define KV_KEY_TOTAL            32 /*!< Keys are 0 .. KV_KEY_TOTAL - 1 */
+#define KV_PAGE_ADDR(i)         ((FLASH_KV_PAGE + (i)) * FLASH_PAGE_SIZE_BYTES) /*!< Page 0 or 1 of the log */
+#define KV_HEADER_MAGIC         0x4C4F564BUL /*!< First word of a page header */
+#define KV_RECORD_TOTAL         (FLASH_PAGE_SIZE_BYTES / 8 - 1) /*!< Records of a page after its header */
+
+/**
+ * \brief           Read the value of a key
+ * \param[in]       key: key
+ * \param[out]      value: last written value
+ * \return          1 if the key was ever written, 0 otherwise
+ */
+RAMFUNC uint32_t kv_get(uint32_t key, uint32_t* value);
+
+/**
+ * \brief           Write the value of a key, nothing is programmed when it does not change
+ * \param[in]       key: key
+ * \param[in]       value: value
+ * \return          1 if written, 0 for a key out of range
+ */
+RAMFUNC uint32_t kv_set(uint32_t key, uint32_t value);
+
+#endif //BOOT_KV_H
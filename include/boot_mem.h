@@ -0,0 +1,38 @@
+/**
+ * \file            boot_mem.h
+ * \brief           RAM arena: all large buffers of the bootloader in one statically sized block.
+ *                  The sizes are checked against the RAM budget of boot_conf.h at compile time
+ *                  and by K1921VK035_boot.ld at link time.
+ * \copyright       DC Vostok Vladivostok 2023
+ */
+
+#ifndef BOOT_MEM_H
+#define BOOT_MEM_H
+
+#include "boot_conf.h"
+#include "boot_flash.h"
+#include "boot_packet.h"
+
+/**
+ * \brief           Named regions of the arena
+ */
+typedef struct
+{
+    volatile uint8_t rx_ring[PACKET_FIFO_BYTES]; /*!< UART RX FIFO, written from the interrupt */
+    Packet_TypeDef frame;                        /*!< Packet being handled, the answer is built in place */
+    uint32_t stage[FLASH_PAGE_SIZE_BYTES / 4];   /*!< Page staging buffer of the flash cache */
+#if BOOT_CRC_TABLE
+    uint16_t crc_table[BOOT_CRC_TABLE];          /*!< Lookup table of crc_upd(), filled by crc_init() */
+#endif
+} BootArena_TypeDef;
+
+extern BootArena_TypeDef boot_arena;
+
+#if BOOT_USE_RAM_RUN
+/**
+ * \brief           RAM application region at BOOT_RAM_APP_BASE, outside of the arena
+ */
+extern uint32_t boot_ram_app[BOOT_RAM_APP_BYTES / 4];
+#endif
+
+#endif //BOOT_MEM_H
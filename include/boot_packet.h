@@ -19,6 +19,12 @@
 #define CMD_WRITE_PAGE_OPT_NVR_MSK      (1<<CMD_WRITE_PAGE_OPT_NVR_POS)
 #define CMD_READ_PAGE_OPT_NVR_POS       CMD_WRITE_PAGE_OPT_NVR_POS
 #define CMD_READ_PAGE_OPT_NVR_MSK       CMD_WRITE_PAGE_OPT_NVR_MSK
+//Command page status options
+#define CMD_PAGE_STATUS_OPT_CLEAR_POS   0
+#define CMD_PAGE_STATUS_OPT_CLEAR_MSK   (1<<CMD_PAGE_STATUS_OPT_CLEAR_POS)
+//Command ARQ poll options, bits 1-15 are a tag echoed to the host
+#define CMD_ARQ_POLL_OPT_RESET_POS      0
+#define CMD_ARQ_POLL_OPT_RESET_MSK      (1<<CMD_ARQ_POLL_OPT_RESET_POS)
 // clang-format on
 
 /**
@@ -26,12 +32,32 @@
  */
 typedef enum {
     CMD_GET_INFO = 0x35,    /*!< Get info about CHIPID, CPUID, BOOT_VER, and BOOT_NAME */
+    CMD_GET_INFO_EXT = 0x36, /*!< Get capabilities: packet and FIFO sizes, baud, flash geometry, commands */
     CMD_GET_CFGWORD = 0x3A, /*!< Get config word CFGWORD */
     CMD_SET_CFGWORD = 0x65, /*!< Set config word CFGWORD */
     CMD_WRITE_PAGE = 0x9A, /*!< Write page of flash memory */
+    CMD_WRITE_PAGES = 0x9C, /*!< Write up to PACKET_PAGES_MAX consecutive pages */
+    CMD_WRITE_RANGE = 0x99, /*!< Write bytes inside one page through the page cache */
+    CMD_FLUSH = 0x66,      /*!< Commit the page cache to flash */
+    CMD_PAGE_STATUS = 0x56, /*!< Get the bitmap of pages programmed from correct packets */
     CMD_READ_PAGE = 0xA5,  /*!< Read page of flash memory */
+    CMD_READ_PAGES = 0xAC, /*!< Read up to PACKET_PAGES_MAX consecutive pages */
     CMD_ERASE_FULL = 0xC5, /*!< full erase of flash memory*/
     CMD_ERASE_PAGE = 0xCA, /*!< Page erase of flash memory*/
+    CMD_ERASE_RANGE = 0xCC, /*!< Erase consecutive pages with one packet, MSG_BUSY reports progress */
+    CMD_SET_FRAMING = 0x3C, /*!< Switch framing of the following packets, see PacketFraming_TypeDef */
+    CMD_ARQ_WRITE = 0x96,  /*!< Write page of flash memory with sequence number, not answered */
+    CMD_ARQ_POLL = 0x69,   /*!< Slide the ARQ window and get the bitmap of programmed frames */
+    CMD_WRITE_SESSION = 0x95, /*!< Open a range whose next page is erased while the current one arrives */
+    CMD_GET_JOURNAL = 0x39, /*!< Get the journal of pages written in the current session */
+    CMD_KV_GET = 0x53,     /*!< Read a value of the NVR key-value log */
+    CMD_KV_SET = 0x6A,     /*!< Append a value to the NVR key-value log */
+    CMD_RAM_WRITE = 0x93,  /*!< Write bytes of a RAM application */
+    CMD_RAM_RUN = 0xF3,    /*!< Check the CRC of the RAM application and jump to it */
+    CMD_VALIDATE = 0xA9,   /*!< Check the digest of the application image and mark it as validated */
+    CMD_BATCH = 0x59,      /*!< Run a list of commands, stop at the first failure, answer a status per command */
+    CMD_ECHO = 0xA6,       /*!< Answer the data of the packet */
+    CMD_TEST_STREAM = 0xAA, /*!< Send frames of a known pattern, then the link error counters */
     CMD_NONE = 0x00, 
     CMD_EXIT = 0xF5,       /*!< Exit from bootloader*/
     CMD_MSG = 0xFA,        /*!< Message packet */
@@ -47,9 +73,19 @@ typedef enum {
     MSG_ERR_CRC,
     MSG_READY,
     MSG_OK,
-    MSG_FAIL
+    MSG_FAIL,
+    MSG_ERR_LEN,    /*!< Data length does not match the command */
+    MSG_BUSY        /*!< Command in progress, the final answer follows */
 } MsgCode_TypeDef;
 
+/**
+ * \brief           Packet framing on the wire
+ */
+typedef enum {
+    PACKET_FRAMING_SIGN = 0, /*!< Packet starts with PACKET_HOST_SIGN / PACKET_DEVICE_SIGN */
+    PACKET_FRAMING_COBS = 1  /*!< COBS encoded packet without signature, enclosed in 0x00 delimiters */
+} PacketFraming_TypeDef;
+
 /**
  * \brief           Packet struct
  */
@@ -58,6 +94,7 @@ typedef struct
     CmdCode_TypeDef cmd_code;
     uint16_t data_n;
     uint16_t crc;
+    uint16_t addr; /*!< node address of a received packet, BOOT_USE_MULTIDROP */
     union { /*!< reserved bytes */
         uint8_t tmp_data8[PACKET_TMP_DATA_BYTES];
         uint16_t tmp_data16[PACKET_TMP_DATA_BYTES / 2];
@@ -66,50 +103,100 @@ typedef struct
 } Packet_TypeDef;
 
 /**
- * \brief           Init fifo
+ * \brief           Link error counters since start, BOOT_USE_LINK_TEST
  */
-RAMFUNC void packet_fifo_init();
+typedef struct
+{
+    uint32_t frames;     /*!< Correct frames */
+    uint32_t crc_errors; /*!< Frames with a CRC mismatch */
+    uint32_t hdr_errors; /*!< Frames with a damaged header */
+    uint32_t lost;       /*!< Frames dropped by the receiver: RX FIFO full or a broken COBS frame */
+} PacketStats_TypeDef;
+
+extern volatile PacketStats_TypeDef packet_stats;
 
 /**
- * \brief           Reading byte from packet fifo
- * 
- * \return          Byte of data 
+ * \brief           Init fifo
  */
-RAMFUNC uint8_t packet_fifo_read();
+RAMFUNC void packet_fifo_init();
 
 /**
- * \brief           Wrapper for reading 32-bit values from packet fifo
+ * \brief           Take the oldest frame parsed and checked by the RX interrupt.
+ *                  Data is stored in tmp_data, data_n is checked against its size.
+ *                  Nothing is taken while an answer is being sent from the packet.
  * 
- * \return          32-bit data 
- */
-RAMFUNC uint32_t packet_fifo_read_u32();
+ * \param[out]      rx_packet: Read packet
+ * \return          MSG_NONE if no frame is complete yet,
+ *                  MSG_OK if packet is correct,
+ *                  MSG_ERR_CRC if CRC does not match,
+ *                  MSG_ERR_CMD if header is damaged (cmd_code is set to CMD_NONE)
+ */ 
+RAMFUNC MsgCode_TypeDef packet_poll(Packet_TypeDef* rx_packet);
 
 /**
- * \brief           Wrapper for reading 16-bit values from packet fifo
- * 
- * \return          16-bit data 
+ * \brief           Sleep until the link has something for packet_poll(): a complete frame,
+ *                  or room in the TX FIFO while an answer is being sent
  */
-RAMFUNC uint16_t packet_fifo_read_u16();
+RAMFUNC void packet_wait();
 
 /**
- * \brief           Find and read packet from FIFO.  
- * 
- * \param[out]      rx_packet: Read packet
- */ 
-RAMFUNC void packet_receive(Packet_TypeDef* cmd);
+ * \brief           Select framing for the following packets in both directions
+ * \param[in]       framing: Framing of packets
+ */
+RAMFUNC void packet_set_framing(PacketFraming_TypeDef framing);
 
 /**
- * \brief           Transmit packet
+ * \brief           Start transmitting packet, the rest is sent by packet_poll() as the TX FIFO empties.
+ *                  The packet must not change until it is sent.
  * \param[in]       tx_packet: Transmit packet
  */ 
 RAMFUNC void packet_transmit(Packet_TypeDef* tx_packet);
 
+/**
+ * \brief           Send the rest of the current packet and wait for its last stop bit
+ */
+RAMFUNC void packet_transmit_flush();
+
 /**
  * \brief           Checking the status of sending the current package
  * \param[in]       data: Byte of data
  */ 
 RAMFUNC uint32_t packet_transmit_status_busy();
 
+/**
+ * \brief           Parse a received byte, called from the RX interrupt of the transport
+ * \param[in]       data: Byte of data
+ */
+RAMFUNC void packet_rx_byte(uint8_t data);
+
+/**
+ * \brief           Bytes still to come in the data of the frame being received
+ * \return          0 outside frame data
+ */
+RAMFUNC uint32_t packet_rx_left();
+
+/**
+ * \brief           Bytes in the RX ring, complete frames and the frame being received
+ */
+RAMFUNC uint32_t packet_fifo_fill();
+
+/**
+ * \brief           An answer is being sent, its bytes are taken with packet_tx_next()
+ * \return          1 if active
+ */
+RAMFUNC uint32_t packet_tx_active();
+
+/**
+ * \brief           Next byte of the answer on the wire, only while packet_tx_active()
+ */
+RAMFUNC uint8_t packet_tx_next();
+
+/**
+ * \brief           Fill the lookup table of crc_upd(), nothing to do without BOOT_CRC_TABLE.
+ *                  Called by packet_fifo_init()
+ */
+RAMFUNC void crc_init();
+
 /**
  * \brief           Update CRC16 value
  * 
@@ -0,0 +1,61 @@
+/**
+ * \file            boot_transport.h
+ * \brief           Link to the host under boot_packet.c, one backend is built as selected by
+ *                  BOOT_TRANSPORT: boot_transport_uart.c or boot_transport_spi.c.
+ *                  The RX interrupt of the backend feeds every byte to packet_rx_byte(),
+ *                  the answer is pulled with packet_tx_next() while packet_tx_active().
+ * \copyright       DC Vostok Vladivostok 2023
+ */
+
+#ifndef BOOT_TRANSPORT_H
+#define BOOT_TRANSPORT_H
+
+#include "boot_conf.h"
+
+/**
+ * \brief           Pins, clock and interrupts of the link, the receiver is off until transport_sync()
+ */
+void transport_init();
+
+/**
+ * \brief           Wait for the first byte of the host and answer it with the device signature,
+ *                  the UART measures the baudrate on it
+ * \return          0 if the host is there
+ *                  -1 on timeout
+ */
+int transport_sync();
+
+/**
+ * \brief           Start of an answer, called before the first byte
+ */
+RAMFUNC void transport_tx_start();
+
+/**
+ * \brief           Move bytes of the answer into the TX FIFO while it has room,
+ *                  the TX interrupt is armed when it is full
+ */
+RAMFUNC void transport_tx_pump();
+
+/**
+ * \brief           Bytes are still in the TX FIFO or on the wire
+ * \return          1 if busy
+ */
+RAMFUNC uint32_t transport_tx_busy();
+
+/**
+ * \brief           The answer waits for the TX interrupt, packet_wait() may sleep
+ * \return          1 if the TX interrupt is armed
+ */
+RAMFUNC uint32_t transport_tx_waiting();
+
+/**
+ * \brief           Frames were taken from the RX ring, a paused host may send again
+ */
+RAMFUNC void transport_rx_resume();
+
+/**
+ * \brief           Disable the interrupts of the link before another program takes it
+ */
+RAMFUNC void transport_stop();
+
+#endif //BOOT_TRANSPORT_H
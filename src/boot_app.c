@@ -0,0 +1,69 @@
+/**
+ * \file            boot_app.c
+ * \brief           Check of the application image before BOOTEN starts it.
+ * \copyright       DC Vostok Vladivostok 2023
+ */
+#include "boot_app.h"
+#include "boot_packet.h"
+
+#if BOOT_USE_APP_CHECK
+
+//-- Public functions ----------------------------------------------------------
+uint32_t app_header(AppHeader_TypeDef* hdr)
+{
+    uint32_t vtor[12];
+    uint32_t sp;
+    uint32_t pc;
+
+    //vectors 0 .. 11, the header takes the reserved ones
+    flash_read_block(0, FLASH_MAIN, vtor, sizeof(vtor));
+    hdr->length = vtor[APP_HDR_OFFSET / 4 + 1];
+    hdr->crc = vtor[APP_HDR_OFFSET / 4 + 2];
+    sp = vtor[0];
+    pc = vtor[1];
+
+    return (vtor[APP_HDR_OFFSET / 4] == APP_HDR_MAGIC) &&
+           (hdr->length >= sizeof(vtor)) && (hdr->length <= FLASH_APP_PAGE_TOTAL * FLASH_PAGE_SIZE_BYTES) && !(hdr->length & 7) &&
+           ((hdr->crc >> 16) == (~hdr->crc & 0xFFFF)) &&
+           (sp > BOOT_RAM_APP_BASE) && (sp <= BOOT_RAM_APP_BASE + BOOT_RAM_BYTES) &&
+           (pc & 1) && (pc < hdr->length);
+}
+
+uint16_t app_digest(const AppHeader_TypeDef* hdr)
+{
+    uint32_t data[2];
+    const uint8_t* data8 = (const uint8_t*)data;
+    uint16_t crc = 0;
+
+    for (uint32_t addr = 0; addr < hdr->length; addr += 8) {
+        flash_read(addr, FLASH_MAIN, data);
+        for (uint32_t i = 0; i < 8; i++) {
+            if ((addr + i - APP_HDR_OFFSET) >= APP_HDR_BYTES)
+                crc = crc_upd(crc, data8[i]);
+        }
+    }
+    return crc;
+}
+
+uint32_t app_marked(const AppHeader_TypeDef* hdr)
+{
+    uint32_t mark;
+
+    return kv_get(APP_KV_KEY, &mark) && (mark == APP_MARK(hdr));
+}
+
+void app_mark(const AppHeader_TypeDef* hdr)
+{
+    //bookkeeping of the bootloader like the journal, written whatever CFGWORD allows the host
+    kv_set(APP_KV_KEY, APP_MARK(hdr));
+}
+
+void app_unmark()
+{
+    uint32_t mark;
+
+    if (kv_get(APP_KV_KEY, &mark) && mark)
+        kv_set(APP_KV_KEY, 0);
+}
+
+#endif
@@ -8,81 +8,187 @@
 #include "boot_core.h"
 #include "boot_flash.h"
 #include "boot_packet.h"
+#include "boot_mem.h"
+#include "boot_journal.h"
+#include "boot_kv.h"
+#include "boot_app.h"
+#include "boot_transport.h"
 #include <string.h>
 
+//-- Command set ---------------------------------------------------------------
+/**
+ * \brief           Commands of this build as X(code, handler), the optional ones by the
+ *                  BOOT_USE_* flags of boot_conf.h. Expanded into the handler prototypes,
+ *                  boot_cmds[] and the cases of boot_core().
+ */
+#if BOOT_USE_CFGWORD
+#define BOOT_CMDS_CFGWORD(X)        X(CMD_GET_CFGWORD, get_cfgword_cmd) X(CMD_SET_CFGWORD, set_cfgword_cmd)
+#else
+#define BOOT_CMDS_CFGWORD(X)
+#endif
+#if BOOT_USE_MULTI_PAGE
+#define BOOT_CMDS_MULTI_PAGE(X)     X(CMD_WRITE_PAGES, write_pages_cmd) X(CMD_READ_PAGES, read_page_cmd)
+#else
+#define BOOT_CMDS_MULTI_PAGE(X)
+#endif
+#if BOOT_USE_PARTIAL_WRITE
+#define BOOT_CMDS_PARTIAL_WRITE(X)  X(CMD_WRITE_RANGE, write_range_cmd) X(CMD_FLUSH, flush_cmd)
+#else
+#define BOOT_CMDS_PARTIAL_WRITE(X)
+#endif
+#if BOOT_USE_PAGE_STATUS
+#define BOOT_CMDS_PAGE_STATUS(X)    X(CMD_PAGE_STATUS, page_status_cmd)
+#else
+#define BOOT_CMDS_PAGE_STATUS(X)
+#endif
+#if BOOT_USE_WRITE_SESSION
+#define BOOT_CMDS_WRITE_SESSION(X)  X(CMD_WRITE_SESSION, write_session_cmd)
+#else
+#define BOOT_CMDS_WRITE_SESSION(X)
+#endif
+#if BOOT_USE_ARQ
+#define BOOT_CMDS_ARQ(X)            X(CMD_ARQ_WRITE, arq_write_cmd) X(CMD_ARQ_POLL, arq_poll_cmd)
+#else
+#define BOOT_CMDS_ARQ(X)
+#endif
+#if BOOT_USE_JOURNAL
+#define BOOT_CMDS_JOURNAL(X)        X(CMD_GET_JOURNAL, get_journal_cmd)
+#else
+#define BOOT_CMDS_JOURNAL(X)
+#endif
+#if BOOT_USE_KV
+#define BOOT_CMDS_KV(X)             X(CMD_KV_GET, kv_get_cmd) X(CMD_KV_SET, kv_set_cmd)
+#else
+#define BOOT_CMDS_KV(X)
+#endif
+#if BOOT_USE_ERASE_RANGE
+#define BOOT_CMDS_ERASE_RANGE(X)    X(CMD_ERASE_RANGE, erase_range_cmd)
+#else
+#define BOOT_CMDS_ERASE_RANGE(X)
+#endif
+#if BOOT_USE_APP_CHECK
+#define BOOT_CMDS_APP_CHECK(X)      X(CMD_VALIDATE, validate_cmd)
+#else
+#define BOOT_CMDS_APP_CHECK(X)
+#endif
+#if BOOT_USE_BATCH
+#define BOOT_CMDS_BATCH(X)          X(CMD_BATCH, batch_cmd)
+#else
+#define BOOT_CMDS_BATCH(X)
+#endif
+#if BOOT_USE_LINK_TEST
+#define BOOT_CMDS_LINK_TEST(X)      X(CMD_ECHO, echo_cmd) X(CMD_TEST_STREAM, test_stream_cmd)
+#else
+#define BOOT_CMDS_LINK_TEST(X)
+#endif
+#if BOOT_USE_RAM_RUN
+#define BOOT_CMDS_RAM_RUN(X)        X(CMD_RAM_WRITE, ram_write_cmd) X(CMD_RAM_RUN, ram_run_cmd)
+#else
+#define BOOT_CMDS_RAM_RUN(X)
+#endif
+
+//commands cmd_dispatch() runs, CMD_BATCH runs them as well and stays out of the list,
+//so the call graph has no cycle and the worst case stack has a bound (tools/footprint.py)
+#define BOOT_CMDS_DISPATCH(X)                                               \
+    X(CMD_GET_INFO, get_info_cmd)                                           \
+    X(CMD_GET_INFO_EXT, get_info_ext_cmd)                                   \
+    BOOT_CMDS_CFGWORD(X)                                                    \
+    X(CMD_SET_FRAMING, set_framing_cmd)                                     \
+    X(CMD_WRITE_PAGE, write_page_cmd)                                       \
+    BOOT_CMDS_MULTI_PAGE(X)                                                 \
+    BOOT_CMDS_PARTIAL_WRITE(X)                                              \
+    BOOT_CMDS_PAGE_STATUS(X)                                                \
+    BOOT_CMDS_WRITE_SESSION(X)                                              \
+    BOOT_CMDS_ARQ(X)                                                        \
+    BOOT_CMDS_JOURNAL(X)                                                    \
+    BOOT_CMDS_KV(X)                                                         \
+    X(CMD_READ_PAGE, read_page_cmd)                                         \
+    X(CMD_ERASE_FULL, erase_cmd)                                            \
+    X(CMD_ERASE_PAGE, erase_cmd)                                            \
+    BOOT_CMDS_ERASE_RANGE(X)                                                \
+    BOOT_CMDS_APP_CHECK(X)                                                  \
+    BOOT_CMDS_LINK_TEST(X)                                                  \
+    BOOT_CMDS_RAM_RUN(X)                                                    \
+    X(CMD_EXIT, exit_cmd)
+
+#define BOOT_CMDS(X)                                                        \
+    BOOT_CMDS_DISPATCH(X)                                                   \
+    BOOT_CMDS_BATCH(X)
+
+#define BOOT_CMD_PROTO(code, handler)   static RAMFUNC void handler(Packet_TypeDef* packet);
+#define BOOT_CMD_CODE(code, handler)    code,
+#define BOOT_CMD_CASE(code, handler)    case code: handler(packet); break;
+
 //-- Private function prototypes -----------------------------------------------
+static RAMFUNC void cmd_dispatch(Packet_TypeDef* packet);
 static RAMFUNC void msg_cmd(Packet_TypeDef* packet);
-static RAMFUNC void get_info_cmd(Packet_TypeDef* packet);
-static RAMFUNC void get_cfgword_cmd(Packet_TypeDef* packet);
-static RAMFUNC void set_cfgword_cmd(Packet_TypeDef* packet);
-static RAMFUNC void read_page_cmd(Packet_TypeDef* packet);
-static RAMFUNC void write_page_cmd(Packet_TypeDef* packet);
-static RAMFUNC void erase_cmd(Packet_TypeDef* packet);
-static RAMFUNC void exit_cmd(Packet_TypeDef* packet);
-
-int wait_uart_rx(uint32_t value){
-    uint32_t timeout_start;
-    BIT_BAND_PER(TIMEOUT_TMR->CTRL, TMR_CTRL_ON_Msk) = 0;
-    TIMEOUT_TMR->LOAD = 0xffffffffu;
-    TIMEOUT_TMR->VALUE = TIMEOUT_TMR->LOAD;
-    BIT_BAND_PER(TIMEOUT_TMR->CTRL, TMR_CTRL_ON_Msk) = 1;
-    timeout_start = TIMEOUT_TMR->VALUE;
-    // while (((UART_PORT->DATA >> UART_PIN_RX_POS) & 1) != value ) {
-    while (BIT_BAND_PER(UART_PORT->DATA,(1 << UART_PIN_RX_POS)) != value ) {
-        if(timeout_start - TIMEOUT_TMR->VALUE > (SYSCLK/1000 * UART_TIMEOUT)){
-            return -1;
-        }
-    };
-    return 0;
-}
-int boot_init()
+static RAMFUNC uint32_t check_data_n(Packet_TypeDef* packet, uint16_t data_n);
+static RAMFUNC uint32_t modify_enabled(uint32_t addr, FlashType_TypeDef flash_type);
+static RAMFUNC void page_erase(uint32_t addr, FlashType_TypeDef flash_type);
+static RAMFUNC MsgCode_TypeDef page_write(uint32_t rx_data, uint32_t* page_data);
+#if BOOT_USE_MULTIDROP
+static RAMFUNC void node_addr_init();
+#endif
+#if BOOT_USE_RAM_RUN
+static RAMFUNC __attribute__((noreturn)) void ram_jump(const uint32_t* vtor);
+#endif
+BOOT_CMDS(BOOT_CMD_PROTO)
+
+#if BOOT_USE_PAGE_STATUS
+/**
+ * \brief           Pages programmed from correct packets since the last clear, bit per page
+ */
+static struct
 {
-    uint32_t ticks_counted;
-    uint32_t baud_i;
-    uint32_t baud_f;
-    
-    DBG_PRINT(0x01);
-
-    //Waiting for the start bit - 0
+    uint32_t main[FLASH_PAGE_TOTAL / 32];
+    uint32_t nvr;
+} page_status;
+#endif
 
-    if(wait_uart_rx(0) < 0){
-        return -1;
-    }
-    //turn on timer
-    UART_TMR->LOAD = 0xffffffffu;
-    UART_TMR->VALUE = UART_TMR->LOAD;
-    BIT_BAND_PER(UART_TMR->CTRL, TMR_CTRL_ON_Msk) = 1;
-    //We are waiting for the start of a group of seven 1 (0x7F)
-    if(wait_uart_rx(1) < 0){
-        return -1;
-    }
-    
-    ticks_counted = UART_TMR->VALUE;
-    //Waiting for bit - 0
-    if(wait_uart_rx(0) < 0){
-        return -1;
-    }
+/**
+ * \brief           Commands of this build, reported by CMD_GET_INFO_EXT
+ */
+static const uint8_t boot_cmds[] = {BOOT_CMDS(BOOT_CMD_CODE)};
 
-    ticks_counted -= UART_TMR->VALUE;
-    UART_TMR->CTRL_bit.ON = 0;
-    //calculate baudrate
-    baud_i = ticks_counted / (16 * 7);
-    baud_f = (uint32_t)((ticks_counted / (16.0f * 7.0f) - baud_i) * 64 + 0.5f);
+#if BOOT_USE_WRITE_SESSION
+/**
+ * \brief           Pages of CMD_WRITE_SESSION. The page above the written ones is erased
+ *                  while the packet of the next page arrives.
+ */
+static struct
+{
+    uint32_t start;
+    uint32_t end;   /*!< 0 - no session */
+    uint32_t next;  /*!< above every page written in the session */
+    uint32_t ahead; /*!< erased and not written yet, ~0 - none */
+    FlashType_TypeDef ftype;
+} session;
+#endif
+
+#if BOOT_USE_MULTIDROP
+static uint16_t node_addr;
+static uint32_t node_silent; /*!< broadcast packet is executed, answers are dropped */
+#endif
+
+#if BOOT_USE_BATCH
+static uint32_t batch_active; /*!< commands of CMD_BATCH are executed, their answers are dropped */
+#endif
+
+#if BOOT_USE_ARQ
+/**
+ * \brief           Selective repeat window: bit N of bits is set when frame base + N is programmed
+ */
+static struct
+{
+    uint16_t base;
+    uint32_t bits;
+} arq;
+#endif
 
-    //Waiting for stop bit - 1
-    if(wait_uart_rx(1) < 0){
-        return -1;
-    }
-    //turn on UART
-    UART->IBRD = baud_i;
-    UART->FBRD = baud_f;
-    UART->LCRH = (1 << UART_LCRH_FEN_Pos) | (3 << UART_LCRH_WLEN_Pos);
-    UART->CR = (1 << UART_CR_RXE_Pos) | (1 << UART_CR_TXE_Pos) | (1 << UART_CR_UARTEN_Pos);
-    //transmit the device signature with bytes swapped
-    UART->DR = (PACKET_DEVICE_SIGN & 0xFF00) >> 8;
-    UART->DR = PACKET_DEVICE_SIGN & 0x00FF;
-    
-    return 0;
+int boot_init()
+{
+    DBG_PRINT(0x01);
+    return transport_sync();
 }
 
 void boot_exit()
@@ -98,61 +204,99 @@ void boot_exit()
 
 __attribute__((noreturn)) void boot_core()
 {
-    Packet_TypeDef packet;
+    Packet_TypeDef* packet = &boot_arena.frame;
+    MsgCode_TypeDef status;
 
     DBG_PRINT(0x02);
     packet_fifo_init();
+#if BOOT_USE_MULTIDROP
+    node_addr_init();
+#else
     //send a message about readiness to accept commands
-    packet.cmd_code = CMD_NONE;
-    packet.tmp_data8[0] = MSG_READY;
-    msg_cmd(&packet);
+    packet->cmd_code = CMD_NONE;
+    packet->tmp_data8[0] = MSG_READY;
+    msg_cmd(packet);
+#endif
 
     while (1) {
-        packet_receive(&packet);
+        //sleep until the link brings bytes or takes the next part of the answer,
+        //flash is not an event: the handler below runs to completion
+        status = packet_poll(packet);
+        if (status == MSG_NONE) {
+            packet_wait();
+            continue;
+        }
         DBG_PRINT(0x03);
-        DBG_PRINT(packet.cmd_code);
-        switch (packet.cmd_code) {
-        // Get commands
-        case CMD_GET_INFO:
-            get_info_cmd(&packet);
-            break;
-        case CMD_GET_CFGWORD:
-            get_cfgword_cmd(&packet);
-            break;
-        // Set commands
-        case CMD_SET_CFGWORD:
-           set_cfgword_cmd(&packet);
-           break;
-        // Write commands
-        case CMD_WRITE_PAGE:
-            write_page_cmd(&packet);
-            break;
-        // Read commands
-        case CMD_READ_PAGE:
-            read_page_cmd(&packet);
-            break;
-        // Erase commands
-        case CMD_ERASE_FULL:
-            erase_cmd(&packet);
-            break;
-        case CMD_ERASE_PAGE:
-            erase_cmd(&packet);
-            break;
-        // Exit
-        case CMD_EXIT:
-            exit_cmd(&packet);
-            break;
-        case CMD_NONE:
-            msg_cmd(&packet);
-            break;
-        default:
-            break;
+        DBG_PRINT(packet->cmd_code);
+#if BOOT_USE_MULTIDROP
+        //the address of a damaged packet can not be trusted, so it is never answered
+        if (status != MSG_OK)
+            continue;
+        if ((packet->addr != node_addr) && (packet->addr != PACKET_ADDR_BROADCAST))
+            continue;
+        node_silent = (packet->addr == PACKET_ADDR_BROADCAST);
+#endif
+        //damaged packets are answered here, handlers get only correct packets
+        if (status != MSG_OK) {
+            packet->tmp_data8[0] = status;
+            packet->data_n = 4;
+            msg_cmd(packet);
+            continue;
+        }
+#if BOOT_USE_BATCH
+        if (packet->cmd_code == CMD_BATCH) {
+            batch_cmd(packet);
+            continue;
         }
+#endif
+        cmd_dispatch(packet);
+    }
+}
+
+void cmd_dispatch(Packet_TypeDef* packet)
+{
+    switch (packet->cmd_code) {
+    //a case per command of BOOT_CMDS_DISPATCH
+    BOOT_CMDS_DISPATCH(BOOT_CMD_CASE)
+    case CMD_NONE:
+        packet->tmp_data8[0] = MSG_OK;
+        msg_cmd(packet);
+        break;
+    default:
+        packet->tmp_data8[0] = MSG_ERR_CMD;
+        packet->data_n = 4;
+        msg_cmd(packet);
+        break;
     }
 }
 
+#if BOOT_USE_MULTIDROP
+void node_addr_init()
+{
+    uint32_t data[2];
+
+    //node address from NVR, CHIPID if it was never set
+    flash_read(FLASH_NVR_NODE_ADDR_OFFSET, FLASH_NVR, data);
+    node_addr = (uint16_t)data[0];
+    if (node_addr == PACKET_ADDR_BROADCAST)
+        node_addr = (uint16_t)SIU->CHIPID;
+}
+#endif
+
 void msg_cmd(Packet_TypeDef* packet)
 {
+#if BOOT_USE_MULTIDROP
+    if (node_silent)
+        return;
+#endif
+#if BOOT_USE_BATCH
+    //only the progress of a long command goes out, as progress of the batch
+    if (batch_active) {
+        if (packet->tmp_data8[0] != MSG_BUSY)
+            return;
+        packet->cmd_code = CMD_BATCH;
+    }
+#endif
     if (packet->cmd_code == CMD_NONE)
         packet->data_n = 4;
     packet->tmp_data8[1] = packet->cmd_code;
@@ -163,44 +307,76 @@ void msg_cmd(Packet_TypeDef* packet)
     packet_transmit(packet);
 }
 
+uint32_t check_data_n(Packet_TypeDef* packet, uint16_t data_n)
+{
+    if (packet->data_n == data_n)
+        return 1;
+
+    packet->tmp_data8[0] = MSG_ERR_LEN;
+    packet->data_n = 4;
+    msg_cmd(packet);
+    return 0;
+}
+
 void get_info_cmd(Packet_TypeDef* packet)
 {
-    uint16_t rx_crc;
+    if (!check_data_n(packet, 0))
+        return;
+
+    packet->tmp_data8[0] = MSG_OK;
+    packet->tmp_data32[1] = SIU->CHIPID;
+    packet->tmp_data32[2] = SCB->CPUID;
+    packet->tmp_data32[3] = BOOT_VER;
+    size_t boot_name_len = sizeof(BOOT_NAME) + 1;
+    memcpy(&(packet->tmp_data32[4]), BOOT_NAME, boot_name_len);
+    //reference of the PLL, OSICLK when the crystal did not start
+    packet->tmp_data8[16 + boot_name_len] =
+        (RCU->PLLCFG_bit.REFSRC == RCU_PLLCFG_REFSRC_OSECLK) ? BOOT_CLK_OSE : BOOT_CLK_OSI;
+    packet->data_n = 16 + boot_name_len + 1;
 
-    rx_crc = packet_fifo_read_u16();
+    msg_cmd(packet);
+}
 
-    if (packet->crc != rx_crc) {
-        packet->tmp_data8[0] = MSG_ERR_CRC;
-        packet->data_n = 4;
-    } else {
-        packet->tmp_data8[0] = MSG_OK;
-        packet->tmp_data32[1] = SIU->CHIPID;
-        packet->tmp_data32[2] = SCB->CPUID;
-        packet->tmp_data32[3] = BOOT_VER;
-        size_t boot_name_len = sizeof(BOOT_NAME) + 1;
-        memcpy(&(packet->tmp_data32[4]), BOOT_NAME, boot_name_len);
-        packet->data_n = 16 + boot_name_len;
-    }
+void get_info_ext_cmd(Packet_TypeDef* packet)
+{
+    uint32_t i;
+
+    if (!check_data_n(packet, 0))
+        return;
+
+    packet->tmp_data8[0] = MSG_OK;
+    packet->tmp_data32[1] = BOOT_VER;
+    packet->tmp_data32[2] = PACKET_TMP_DATA_BYTES;
+    packet->tmp_data32[3] = PACKET_FIFO_BYTES;
+    packet->tmp_data32[4] = BOOT_BAUD_MAX;
+    packet->tmp_data32[5] = FLASH_PAGE_SIZE_BYTES;
+    packet->tmp_data32[6] = FLASH_APP_PAGE_TOTAL;
+    packet->tmp_data32[7] = FLASH_NVR_PAGE_TOTAL;
+    packet->tmp_data32[8] = PACKET_PAGES_MAX;
+    //bit per PacketFraming_TypeDef
+    packet->tmp_data32[9] = (1 << PACKET_FRAMING_SIGN) | (BOOT_USE_COBS << PACKET_FRAMING_COBS);
+    //count and codes of the supported commands
+    packet->tmp_data8[40] = sizeof(boot_cmds);
+    for (i = 0; i < sizeof(boot_cmds); i++)
+        packet->tmp_data8[41 + i] = boot_cmds[i];
+    packet->data_n = 41 + sizeof(boot_cmds);
 
     msg_cmd(packet);
 }
 
+#if BOOT_USE_CFGWORD
 void get_cfgword_cmd(Packet_TypeDef* packet)
 {
-    uint16_t rx_crc;
     uint32_t data[2];
 
-    rx_crc = packet_fifo_read_u16();
+    if (!check_data_n(packet, 0))
+        return;
 
-    if (packet->crc != rx_crc) {
-        packet->tmp_data8[0] = MSG_ERR_CRC;
-        packet->data_n = 4;
-    } else {
-        packet->tmp_data8[0] = MSG_OK;
-        flash_read(FLASH_NVR_CFGWORD_OFFSET, FLASH_NVR, data);
-        packet->tmp_data32[1] = data[0];
-        packet->data_n = 8;
-    }
+    flash_cache_flush();
+    packet->tmp_data8[0] = MSG_OK;
+    flash_read(FLASH_NVR_CFGWORD_OFFSET, FLASH_NVR, data);
+    packet->tmp_data32[1] = data[0];
+    packet->data_n = 8;
 
     msg_cmd(packet);
 }
@@ -208,133 +384,522 @@ void get_cfgword_cmd(Packet_TypeDef* packet)
 void set_cfgword_cmd(Packet_TypeDef* packet)
 {
     uint32_t cfgword;
-    uint16_t rx_crc;
-    uint16_t calc_crc;
-    uint32_t page_arr[FLASH_NVR_PAGE_SIZE_BYTES / 8][2];
     uint32_t data[2];
     uint32_t modify_en;
 
+    if (!check_data_n(packet, 4))
+        return;
+
+    flash_cache_flush();
     flash_read(FLASH_NVR_CFGWORD_OFFSET, FLASH_NVR, data);
     modify_en = (data[0] & CFGWORD_NVRWE_MSK) >> CFGWORD_NVRWE_POS;
 
-    cfgword = packet_fifo_read_u32();
-    calc_crc = crc_upd_u32(packet->crc, cfgword);
-
-    rx_crc = packet_fifo_read_u16();
+    cfgword = packet->tmp_data32[0];
 
     packet->data_n = 8;
-    if (calc_crc != rx_crc)
-        packet->tmp_data8[0] = MSG_ERR_CRC;
-    else if (!modify_en)
+    if (!modify_en)
         packet->tmp_data8[0] = MSG_FAIL;
     else {
-        //read the whole page
-        for (uint32_t i = 0; i < FLASH_NVR_PAGE_SIZE_BYTES / 8; i++) {
-            flash_read(FLASH_NVR_CFGWORD_OFFSET + i * 8, FLASH_NVR, (uint32_t*)page_arr[i]);
-        }
-        //modify the CFGWORD, erase and write back
-        page_arr[0][0] = cfgword;
-        flash_erase_page(FLASH_NVR_CFGWORD_OFFSET, FLASH_NVR);
-        for (uint32_t i = 0; i < FLASH_NVR_PAGE_SIZE_BYTES / 8; i++) {
-            if ((page_arr[i][0] != 0xFFFFFFFF) || (page_arr[i][1] != 0xFFFFFFFF))
-                flash_write(FLASH_NVR_CFGWORD_OFFSET + i * 8, FLASH_NVR, (uint32_t*)page_arr[i]);
-        }
-        // //verfi
-        // packet->tmp_data8[0] = MSG_OK;
-        // for (uint32_t i = 0; i < FLASH_NVR_PAGE_SIZE_BYTES / 8; i++) {
-        //     flash_read(FLASH_NVR_CFGWORD_OFFSET + i * 8, FLASH_NVR, data);
-        //     if ((page_arr[i][0] != data[0]) || (page_arr[i][1] != data[1]))
-        //         packet->tmp_data8[0] = MSG_FAIL;
-        // }
+        //read-modify-erase-write of the page goes through the page cache
+        flash_cache_write(FLASH_NVR_CFGWORD_OFFSET, FLASH_NVR, (uint8_t*)&cfgword, 4);
+        flash_cache_flush();
+        packet->tmp_data8[0] = MSG_OK;
     }
 
     packet->tmp_data32[1] = cfgword;
 
     msg_cmd(packet);
 }
+#endif
 
-void write_page_cmd(Packet_TypeDef* packet)
+void set_framing_cmd(Packet_TypeDef* packet)
 {
-    uint32_t rx_data;
-    uint8_t cfg;
-    uint32_t addr;
-    uint32_t addr_i;
-    uint32_t flash_type;
-    uint32_t erase_option;
-    uint32_t data[2];
-    uint16_t rx_crc;
-    uint16_t calc_crc;
-    uint32_t modify_en;
+    uint8_t framing;
 
-    //read the address, determine the required flash type and page number, then erase it if necessary
-    rx_data = packet_fifo_read_u32();
+    if (!check_data_n(packet, 1))
+        return;
 
-    cfg = (uint8_t)(rx_data >> 24);
+    framing = packet->tmp_data8[0];
 
-    //determine the type of flash and whether it can be written
-    flash_type = (FlashType_TypeDef)((cfg & CMD_WRITE_PAGE_OPT_NVR_MSK) >> CMD_WRITE_PAGE_OPT_NVR_POS);
+    packet->data_n = 8;
+    if ((framing == PACKET_FRAMING_SIGN) || (BOOT_USE_COBS && (framing == PACKET_FRAMING_COBS)))
+        packet->tmp_data8[0] = MSG_OK;
+    else
+        packet->tmp_data8[0] = MSG_FAIL;
+    packet->tmp_data32[1] = framing;
+
+    //the answer still goes in the current framing
+    msg_cmd(packet);
+    if (packet->tmp_data8[0] == MSG_OK)
+        packet_set_framing((PacketFraming_TypeDef)framing);
+}
+
+uint32_t modify_enabled(uint32_t addr, FlashType_TypeDef flash_type)
+{
+    uint32_t data[2];
+    uint32_t modify_en;
+
+    //determine whether the type of flash can be written
     flash_read(FLASH_NVR_CFGWORD_OFFSET, FLASH_NVR, data);
     if (flash_type == FLASH_MAIN)
         modify_en = (data[0] & CFGWORD_FLASHWE_MSK) >> CFGWORD_FLASHWE_POS;
     else
         modify_en = (data[0] & CFGWORD_NVRWE_MSK) >> CFGWORD_NVRWE_POS;
 
+    //bootloader modification protection
+    modify_en &= !((flash_type == FLASH_NVR) && (addr < (FLASH_PAGE_SIZE_BYTES * 3)));
+    //page inside the flash, below the pages of the bootloader in main flash
+    modify_en &= (addr < ((flash_type == FLASH_MAIN) ? (FLASH_APP_PAGE_TOTAL * FLASH_PAGE_SIZE_BYTES) :
+                                                        FLASH_NVR_TOTAL_BYTES));
+
+    return modify_en;
+}
+
+void page_erase(uint32_t addr, FlashType_TypeDef flash_type)
+{
+    //the journal and the application mark go first, the erase runs on after the return
+#if BOOT_USE_JOURNAL
+    if (flash_type == FLASH_MAIN)
+        journal_page_stale(addr >> FLASH_PAGE_SIZE_BYTES_LOG2);
+#endif
+#if BOOT_USE_APP_CHECK
+    if (flash_type == FLASH_MAIN)
+        app_unmark();
+#endif
+    flash_erase_page(addr, flash_type);
+}
+
+MsgCode_TypeDef page_write(uint32_t rx_data, uint32_t* page_data)
+{
+    uint8_t cfg;
+    uint32_t addr;
+    uint32_t addr_i;
+    FlashType_TypeDef flash_type;
+    uint32_t erase_option;
+#if BOOT_USE_WRITE_SESSION
+    uint32_t in_session;
+#endif
+
+    //read the address, determine the required flash type and page number, then erase it if necessary
+    cfg = (uint8_t)(rx_data >> 24);
+    flash_type = (FlashType_TypeDef)((cfg & CMD_WRITE_PAGE_OPT_NVR_MSK) >> CMD_WRITE_PAGE_OPT_NVR_POS);
+
     //should erase before writing
     erase_option = (cfg & CMD_WRITE_PAGE_OPT_ERASE_MSK) >> CMD_WRITE_PAGE_OPT_ERASE_POS;
 
     addr = rx_data & ~(FLASH_PAGE_SIZE_BYTES - 1) & 0x00FFFFFF;
 
-    //bootloader modification protection
-    modify_en &= !((flash_type == FLASH_NVR) && (addr < (FLASH_PAGE_SIZE_BYTES * 3)));
-
-    if (erase_option && modify_en)
+    flash_cache_flush();
+    if (!modify_enabled(addr, flash_type))
+        return MSG_FAIL;
+
+#if BOOT_USE_WRITE_SESSION
+    //a page of the session is erased unless it was erased ahead
+    in_session = (flash_type == session.ftype) && (addr >= session.start) && (addr < session.end);
+    if (in_session)
+        erase_option = (addr != session.ahead);
+#endif
+#if BOOT_USE_APP_CHECK
+    if (flash_type == FLASH_MAIN)
+        app_unmark();
+#endif
+    if (erase_option)
         flash_erase_page(addr, flash_type);
-    calc_crc = crc_upd_u32(packet->crc, rx_data);
-
-    //read 8 bytes of data and write the whole page
+    //write the whole page, 8 bytes at a time
     addr_i = addr;
     for (uint32_t i = 0; i < FLASH_PAGE_SIZE_BYTES / 8; i++) {
-        data[0] = packet_fifo_read_u32();
-        data[1] = packet_fifo_read_u32();
-        if (modify_en)
-            flash_write(addr_i, flash_type, data);
-        calc_crc = crc_upd_u32(calc_crc, data[0]);
-        calc_crc = crc_upd_u32(calc_crc, data[1]);
+        flash_write(addr_i, flash_type, &page_data[i * 2]);
         addr_i += 8;
     }
 
-    rx_crc = packet_fifo_read_u16();
+    addr >>= FLASH_PAGE_SIZE_BYTES_LOG2;
+#if BOOT_USE_PAGE_STATUS
+    if (flash_type == FLASH_MAIN)
+        page_status.main[addr / 32] |= 1u << (addr % 32);
+    else
+        page_status.nvr |= 1u << addr;
+#endif
+#if BOOT_USE_JOURNAL
+    //the host compares the CRC with its image to skip the page when it resumes
+    if (flash_type == FLASH_MAIN) {
+        uint16_t crc = 0;
+        const uint8_t* data8 = (const uint8_t*)page_data;
+        for (uint32_t i = 0; i < FLASH_PAGE_SIZE_BYTES; i++)
+            crc = crc_upd(crc, data8[i]);
+        journal_page_written(addr, crc);
+    }
+#endif
+#if BOOT_USE_WRITE_SESSION
+    //erased last, flash writes wait for the end of the erase
+    if (in_session) {
+        addr <<= FLASH_PAGE_SIZE_BYTES_LOG2;
+        if (addr == session.ahead)
+            session.ahead = ~0u;
+        if (addr >= session.next) {
+            session.next = addr + FLASH_PAGE_SIZE_BYTES;
+            if ((session.next < session.end) && (session.ahead == ~0u)) {
+                session.ahead = session.next;
+                page_erase(session.ahead, flash_type);
+            }
+        }
+    }
+#endif
+    return MSG_OK;
+}
+
+void write_page_cmd(Packet_TypeDef* packet)
+{
+    uint32_t rx_data;
+
+    if (!check_data_n(packet, 4 + FLASH_PAGE_SIZE_BYTES))
+        return;
+
+    rx_data = packet->tmp_data32[0];
+
+    packet->data_n = 8;
+    packet->tmp_data8[0] = page_write(rx_data, &packet->tmp_data32[1]);
+    packet->tmp_data32[1] = rx_data;
+
+    msg_cmd(packet);
+}
+
+#if BOOT_USE_MULTI_PAGE
+void write_pages_cmd(Packet_TypeDef* packet)
+{
+    uint32_t rx_data;
+    uint32_t count;
+    uint32_t i;
+    MsgCode_TypeDef status;
+
+    //address word and whole pages, data_n is already limited by PACKET_TMP_DATA_BYTES
+    count = (packet->data_n - 4) >> FLASH_PAGE_SIZE_BYTES_LOG2;
+    if ((count == 0) || (packet->data_n != 4 + (count << FLASH_PAGE_SIZE_BYTES_LOG2))) {
+        packet->tmp_data8[0] = MSG_ERR_LEN;
+        packet->data_n = 4;
+        msg_cmd(packet);
+        return;
+    }
+
+    rx_data = packet->tmp_data32[0];
+
+    //stop at the first page that can not be written
+    status = MSG_OK;
+    for (i = 0; i < count; i++) {
+        status = page_write(rx_data + (i << FLASH_PAGE_SIZE_BYTES_LOG2),
+                            &packet->tmp_data32[1 + i * (FLASH_PAGE_SIZE_BYTES / 4)]);
+        if (status != MSG_OK)
+            break;
+    }
+
+    packet->tmp_data8[0] = status;
+    packet->tmp_data32[1] = rx_data;
+    packet->tmp_data32[2] = i;
+    packet->data_n = 12;
+
+    msg_cmd(packet);
+}
+#endif
+
+#if BOOT_USE_PARTIAL_WRITE
+void write_range_cmd(Packet_TypeDef* packet)
+{
+    uint32_t rx_data;
+    uint8_t cfg;
+    uint32_t addr;
+    uint32_t len;
+    FlashType_TypeDef flash_type;
+
+    rx_data = packet->tmp_data32[0];
+    cfg = (uint8_t)(rx_data >> 24);
+    flash_type = (FlashType_TypeDef)((cfg & CMD_WRITE_PAGE_OPT_NVR_MSK) >> CMD_WRITE_PAGE_OPT_NVR_POS);
+    addr = rx_data & 0x00FFFFFF;
+
+    //at least one byte and not past the end of the page
+    len = packet->data_n - 4;
+    if ((packet->data_n <= 4) || (len > FLASH_PAGE_SIZE_BYTES - (addr & (FLASH_PAGE_SIZE_BYTES - 1)))) {
+        packet->tmp_data8[0] = MSG_ERR_LEN;
+        packet->data_n = 4;
+        msg_cmd(packet);
+        return;
+    }
 
     packet->data_n = 8;
-    if (calc_crc != rx_crc)
-        packet->tmp_data8[0] = MSG_ERR_CRC;
-    else if (!modify_en)
+    if (!modify_enabled(addr & ~(FLASH_PAGE_SIZE_BYTES - 1), flash_type))
+        packet->tmp_data8[0] = MSG_FAIL;
+    else {
+#if BOOT_USE_JOURNAL
+        if (flash_type == FLASH_MAIN)
+            journal_page_stale(addr >> FLASH_PAGE_SIZE_BYTES_LOG2);
+#endif
+#if BOOT_USE_APP_CHECK
+        if (flash_type == FLASH_MAIN)
+            app_unmark();
+#endif
+        //merged in RAM, committed when another page is written, on CMD_FLUSH or CMD_EXIT
+        flash_cache_write(addr, flash_type, &packet->tmp_data8[4], len);
+        packet->tmp_data8[0] = MSG_OK;
+    }
+
+    packet->tmp_data32[1] = rx_data;
+
+    msg_cmd(packet);
+}
+#endif
+
+#if BOOT_USE_WRITE_SESSION
+void write_session_cmd(Packet_TypeDef* packet)
+{
+    uint32_t rx_data;
+    uint32_t count;
+    uint8_t cfg;
+    uint32_t addr;
+    FlashType_TypeDef flash_type;
+
+    if (!check_data_n(packet, 8))
+        return;
+
+    rx_data = packet->tmp_data32[0];
+    count = packet->tmp_data32[1];
+    cfg = (uint8_t)(rx_data >> 24);
+    flash_type = (FlashType_TypeDef)((cfg & CMD_WRITE_PAGE_OPT_NVR_MSK) >> CMD_WRITE_PAGE_OPT_NVR_POS);
+    addr = rx_data & ~(FLASH_PAGE_SIZE_BYTES - 1) & 0x00FFFFFF;
+
+    //a new session replaces the previous one, count 0 only closes it
+    flash_cache_flush();
+    session.end = 0;
+    session.ahead = ~0u;
+    packet->tmp_data8[0] = MSG_OK;
+    if (count) {
+        //the protected pages are below the first page, the end of the flash above the last one
+        if ((count > FLASH_PAGE_TOTAL) || !modify_enabled(addr, flash_type) ||
+            !modify_enabled(addr + ((count - 1) << FLASH_PAGE_SIZE_BYTES_LOG2), flash_type))
+            packet->tmp_data8[0] = MSG_FAIL;
+        else {
+            session.start = addr;
+            session.end = addr + (count << FLASH_PAGE_SIZE_BYTES_LOG2);
+            session.next = addr;
+            session.ftype = flash_type;
+            //the first page is erased while its packet arrives
+            session.ahead = addr;
+            page_erase(addr, flash_type);
+        }
+    }
+
+    packet->tmp_data32[1] = rx_data;
+    packet->tmp_data32[2] = count;
+    packet->data_n = 12;
+
+    msg_cmd(packet);
+}
+#endif
+
+#if BOOT_USE_PARTIAL_WRITE
+void flush_cmd(Packet_TypeDef* packet)
+{
+    if (!check_data_n(packet, 0))
+        return;
+
+    flash_cache_flush();
+    packet->data_n = 4;
+    packet->tmp_data8[0] = MSG_OK;
+
+    msg_cmd(packet);
+}
+#endif
+
+#if BOOT_USE_PAGE_STATUS
+void page_status_cmd(Packet_TypeDef* packet)
+{
+    uint32_t opt;
+
+    if (!check_data_n(packet, 4))
+        return;
+
+    opt = packet->tmp_data32[0];
+
+    packet->tmp_data8[0] = MSG_OK;
+#if BOOT_USE_MULTIDROP
+    packet->tmp_data32[1] = node_addr;
+#else
+    packet->tmp_data32[1] = PACKET_ADDR_BROADCAST;
+#endif
+    packet->tmp_data32[2] = page_status.main[0];
+    packet->tmp_data32[3] = page_status.main[1];
+    packet->tmp_data32[4] = page_status.nvr;
+    packet->data_n = 20;
+
+    if (opt & CMD_PAGE_STATUS_OPT_CLEAR_MSK) {
+        page_status.main[0] = 0;
+        page_status.main[1] = 0;
+        page_status.nvr = 0;
+    }
+
+    msg_cmd(packet);
+}
+#endif
+
+#if BOOT_USE_JOURNAL
+void get_journal_cmd(Packet_TypeDef* packet)
+{
+    uint32_t n;
+
+    if (!check_data_n(packet, 0))
+        return;
+
+    flash_cache_flush();
+    n = journal_read(&packet->tmp_data32[2]);
+
+    packet->tmp_data8[0] = MSG_OK;
+    packet->tmp_data32[1] = n;
+    packet->data_n = 8 + n * 8;
+
+    msg_cmd(packet);
+}
+#endif
+
+#if BOOT_USE_KV
+void kv_get_cmd(Packet_TypeDef* packet)
+{
+    uint32_t key;
+    uint32_t value = 0xFFFFFFFF;
+    uint32_t data[2];
+
+    if (!check_data_n(packet, 4))
+        return;
+
+    key = packet->tmp_data32[0];
+
+    //values are as readable as the rest of main flash
+    flash_cache_flush();
+    flash_read(FLASH_NVR_CFGWORD_OFFSET, FLASH_NVR, data);
+    if (!(data[0] & CFGWORD_FLASHRE_MSK) || !kv_get(key, &value))
+        packet->tmp_data8[0] = MSG_FAIL;
+    else
+        packet->tmp_data8[0] = MSG_OK;
+
+    packet->tmp_data32[1] = key;
+    packet->tmp_data32[2] = value;
+    packet->data_n = 12;
+
+    msg_cmd(packet);
+}
+
+void kv_set_cmd(Packet_TypeDef* packet)
+{
+    uint32_t key;
+    uint32_t value;
+
+    if (!check_data_n(packet, 8))
+        return;
+
+    key = packet->tmp_data32[0];
+    value = packet->tmp_data32[1];
+
+    //values are as writable as the application
+    if (!modify_enabled(0, FLASH_MAIN) || (BOOT_USE_APP_CHECK && (key == APP_KV_KEY)) ||
+        !kv_set(key, value))
         packet->tmp_data8[0] = MSG_FAIL;
     else
         packet->tmp_data8[0] = MSG_OK;
 
+    packet->tmp_data32[1] = key;
+    packet->data_n = 8;
+
+    msg_cmd(packet);
+}
+#endif
+
+#if BOOT_USE_ARQ
+void arq_write_cmd(Packet_TypeDef* packet)
+{
+    uint16_t seq;
+    uint16_t offset;
+    uint32_t rx_data;
+
+    //streamed frames are not answered, a wrong length is seen as a missing frame
+    if (packet->data_n != 4 + FLASH_PAGE_SIZE_BYTES + 2)
+        return;
+
+    rx_data = packet->tmp_data32[0];
+    seq = packet->tmp_data16[(4 + FLASH_PAGE_SIZE_BYTES) / 2];
+    offset = seq - arq.base;
+
+    //outside of the window or already programmed (the host resent it before the poll)
+    if ((offset >= ARQ_WINDOW) || (arq.bits & (1u << offset)))
+        return;
+
+    if (page_write(rx_data, &packet->tmp_data32[1]) != MSG_OK) {
+        //the host has to stop streaming, the seq is not marked as received
+        packet->tmp_data8[0] = MSG_FAIL;
+        packet->tmp_data32[1] = seq;
+        packet->data_n = 8;
+        msg_cmd(packet);
+        return;
+    }
+    arq.bits |= 1u << offset;
+}
+
+void arq_poll_cmd(Packet_TypeDef* packet)
+{
+    uint32_t rx_data;
+    uint16_t base;
+    uint16_t shift;
+
+    if (!check_data_n(packet, 4))
+        return;
+
+    //base of the window in the low half, options and the host tag in the high half
+    rx_data = packet->tmp_data32[0];
+    base = (uint16_t)rx_data;
+    if ((rx_data >> 16) & CMD_ARQ_POLL_OPT_RESET_MSK) {
+        arq.base = base;
+        arq.bits = 0;
+    } else {
+        //slide the window, the host moves the base only over received frames
+        shift = base - arq.base;
+        arq.bits = (shift < ARQ_WINDOW) ? (arq.bits >> shift) : 0;
+        arq.base = base;
+    }
+
+    packet->tmp_data8[0] = MSG_OK;
     packet->tmp_data32[1] = rx_data;
+    packet->tmp_data32[2] = arq.bits;
+    packet->data_n = 12;
 
     msg_cmd(packet);
 }
+#endif
 
 void read_page_cmd(Packet_TypeDef* packet)
 {
     uint32_t rx_data;
     uint8_t cfg;
     uint32_t addr;
-    uint32_t addr_i;
+    uint32_t count;
     uint32_t flash_type;
     uint32_t data[2];
-    uint16_t rx_crc;
-    uint16_t calc_crc;
     uint32_t read_en;
 
+    //CMD_READ_PAGES has the page count after the address word
+    count = 1;
+    if (BOOT_USE_MULTI_PAGE && (packet->cmd_code == CMD_READ_PAGES)) {
+        if (!check_data_n(packet, 8))
+            return;
+        count = packet->tmp_data32[1];
+        if ((count == 0) || (count > PACKET_PAGES_MAX)) {
+            packet->tmp_data8[0] = MSG_ERR_LEN;
+            packet->data_n = 4;
+            msg_cmd(packet);
+            return;
+        }
+    } else if (!check_data_n(packet, 4))
+        return;
 
+    flash_cache_flush();
     flash_read(FLASH_NVR_CFGWORD_OFFSET, FLASH_NVR, data);
 
-    //read the address, determine the required flash type and page number, then erase it if necessary
-    rx_data = packet_fifo_read_u32();
+    //read the address, determine the required flash type and page number
+    rx_data = packet->tmp_data32[0];
 
     cfg = (uint8_t)(rx_data >> 24);
     flash_type = (FlashType_TypeDef)((cfg & CMD_READ_PAGE_OPT_NVR_MSK) >> CMD_READ_PAGE_OPT_NVR_POS);
@@ -349,25 +914,17 @@ void read_page_cmd(Packet_TypeDef* packet)
     addr = rx_data & ~(FLASH_PAGE_SIZE_BYTES - 1) & 0x00FFFFFF;
     //bootloader read protection
     read_en &= !((flash_type == FLASH_NVR) && (addr < (FLASH_PAGE_SIZE_BYTES * 3)));
-
-    calc_crc = crc_upd_u32(packet->crc, rx_data);
-    rx_crc = packet_fifo_read_u16();
+    //all pages inside the flash
+    read_en &= ((addr + (count << FLASH_PAGE_SIZE_BYTES_LOG2)) <=
+                ((flash_type == FLASH_MAIN) ? FLASH_TOTAL_BYTES : FLASH_NVR_TOTAL_BYTES));
 
     packet->data_n = 8;
-    if (calc_crc != rx_crc)
-        packet->tmp_data8[0] = MSG_ERR_CRC;
-    else if (!read_en)
+    if (!read_en)
         packet->tmp_data8[0] = MSG_FAIL;
     else {
-        addr_i = addr;
-        for (uint32_t i = 0; i < FLASH_PAGE_SIZE_BYTES / 8; i++) {
-            flash_read(addr_i, flash_type, data);
-            packet->tmp_data32[2 + i * 2] = data[0];
-            packet->tmp_data32[2 + i * 2 + 1] = data[1];
-            addr_i += 8;
-        }
+        flash_read_block(addr, flash_type, &packet->tmp_data32[2], count << FLASH_PAGE_SIZE_BYTES_LOG2);
         packet->tmp_data8[0] = MSG_OK;
-        packet->data_n += FLASH_PAGE_SIZE_BYTES;
+        packet->data_n += count << FLASH_PAGE_SIZE_BYTES_LOG2;
     }
 
     packet->tmp_data32[1] = rx_data;
@@ -380,41 +937,39 @@ void erase_cmd(Packet_TypeDef* packet)
     uint32_t rx_data;
     uint8_t cfg;
     uint32_t addr;
-    uint32_t flash_type;
-    uint16_t rx_crc;
-    uint16_t calc_crc;
-    uint32_t data[2];
-    uint32_t modify_en;
+    FlashType_TypeDef flash_type;
+
+    if (!check_data_n(packet, 4))
+        return;
 
-    rx_data = packet_fifo_read_u32();
+    rx_data = packet->tmp_data32[0];
     cfg = (uint8_t)(rx_data >> 24);
 
     //determine the type of flash and whether the host can erase it
     flash_type = (FlashType_TypeDef)((cfg & CMD_WRITE_PAGE_OPT_NVR_MSK) >> CMD_WRITE_PAGE_OPT_NVR_POS);
-    flash_read(FLASH_NVR_CFGWORD_OFFSET, FLASH_NVR, data);
-    if (flash_type == FLASH_MAIN)
-        modify_en = (data[0] & CFGWORD_FLASHWE_MSK) >> CFGWORD_FLASHWE_POS;
-    else
-        modify_en = (data[0] & CFGWORD_NVRWE_MSK) >> CFGWORD_NVRWE_POS;
-
     addr = rx_data & ~(FLASH_PAGE_SIZE_BYTES - 1) & 0x00FFFFFF;
 
-    //bootloader erasure protection
-    modify_en &= !((flash_type == FLASH_NVR) && (addr < (FLASH_PAGE_SIZE_BYTES * 3)));
-
-    calc_crc = crc_upd_u32(packet->crc, rx_data);
-    rx_crc = packet_fifo_read_u16();
-
+    flash_cache_flush();
     packet->data_n = 8;
-    if (calc_crc != rx_crc)
-        packet->tmp_data8[0] = MSG_ERR_CRC;
-    else if (!modify_en)
+    if (!modify_enabled(addr, flash_type))
         packet->tmp_data8[0] = MSG_FAIL;
     else {
         if(packet->cmd_code == CMD_ERASE_FULL){
+#if BOOT_USE_APP_CHECK
+            app_unmark();
+#endif
+#if BOOT_USE_KV
+            //the key-value log above the application is kept, the pages below it are erased one by one
+            for (uint32_t i = 0; i < FLASH_KV_PAGE; i++)
+                flash_erase_page(i << FLASH_PAGE_SIZE_BYTES_LOG2, FLASH_MAIN);
+#else
             flash_erase_full();
+#endif
+#if BOOT_USE_JOURNAL
+            journal_clear();
+#endif
         }else{
-            flash_erase_page(addr, flash_type);
+            page_erase(addr, flash_type);
         }
         
         packet->tmp_data8[0] = MSG_OK;
@@ -425,23 +980,348 @@ void erase_cmd(Packet_TypeDef* packet)
     msg_cmd(packet);
 }
 
+#if BOOT_USE_ERASE_RANGE
+void erase_range_cmd(Packet_TypeDef* packet)
+{
+    uint32_t rx_data;
+    uint32_t count;
+    uint8_t cfg;
+    uint32_t addr;
+    FlashType_TypeDef flash_type;
+    uint32_t i;
+
+    if (!check_data_n(packet, 8))
+        return;
+
+    rx_data = packet->tmp_data32[0];
+    count = packet->tmp_data32[1];
+    cfg = (uint8_t)(rx_data >> 24);
+    flash_type = (FlashType_TypeDef)((cfg & CMD_WRITE_PAGE_OPT_NVR_MSK) >> CMD_WRITE_PAGE_OPT_NVR_POS);
+    addr = rx_data & ~(FLASH_PAGE_SIZE_BYTES - 1) & 0x00FFFFFF;
+
+    flash_cache_flush();
+    //the protected pages are below the first page, the end of the flash above the last one
+    if ((count == 0) || (count > FLASH_PAGE_TOTAL) || !modify_enabled(addr, flash_type) ||
+        !modify_enabled(addr + ((count - 1) << FLASH_PAGE_SIZE_BYTES_LOG2), flash_type)) {
+        packet->tmp_data8[0] = MSG_FAIL;
+        count = 0;
+    } else
+        packet->tmp_data8[0] = MSG_OK;
+
+    for (i = 0; i < count; i++) {
+        //each erase waits for the previous one, the host gets progress while a page is erased
+        page_erase(addr + (i << FLASH_PAGE_SIZE_BYTES_LOG2), flash_type);
+        if (i && !(i % PACKET_ERASE_PROGRESS)) {
+            packet->cmd_code = CMD_ERASE_RANGE;
+            packet->tmp_data8[0] = MSG_BUSY;
+            packet->tmp_data32[1] = rx_data;
+            packet->tmp_data32[2] = i;
+            packet->data_n = 12;
+            msg_cmd(packet);
+            packet_transmit_flush();
+            packet->tmp_data8[0] = MSG_OK;
+        }
+    }
+    flash_wait();
+
+    packet->cmd_code = CMD_ERASE_RANGE;
+    packet->tmp_data32[1] = rx_data;
+    packet->tmp_data32[2] = count;
+    packet->data_n = 12;
+
+    msg_cmd(packet);
+}
+#endif
+
+#if BOOT_USE_APP_CHECK
+void validate_cmd(Packet_TypeDef* packet)
+{
+    AppHeader_TypeDef hdr;
+    uint16_t crc = 0;
+
+    if (!check_data_n(packet, 0))
+        return;
+
+    //the image is checked as it is in flash, pending partial writes go first
+    flash_cache_flush();
+    packet->tmp_data8[0] = MSG_FAIL;
+    if (app_header(&hdr)) {
+        crc = app_digest(&hdr);
+        if (crc == (uint16_t)hdr.crc) {
+            app_mark(&hdr);
+            packet->tmp_data8[0] = MSG_OK;
+        }
+    }
+
+    packet->tmp_data32[1] = hdr.length;
+    packet->tmp_data32[2] = crc;
+    packet->data_n = 12;
+
+    msg_cmd(packet);
+}
+#endif
+
+#if BOOT_USE_BATCH
+void batch_cmd(Packet_TypeDef* packet)
+{
+    uint8_t status[BATCH_CMDS_MAX];
+    uint32_t n = 0;
+    uint32_t pos;
+    uint32_t data_n;
+    uint8_t cmd;
+
+    //commands are cmd:u8 | data_n:u16 | data, their answers are built at the start of the packet
+    if (packet->data_n > PACKET_TMP_DATA_BYTES - BATCH_ANSWER_BYTES) {
+        packet->tmp_data8[0] = MSG_ERR_LEN;
+        packet->data_n = 4;
+        msg_cmd(packet);
+        return;
+    }
+    //the list is moved to the end, behind the longest answer
+    pos = PACKET_TMP_DATA_BYTES - packet->data_n;
+    memmove(&packet->tmp_data8[pos], packet->tmp_data8, packet->data_n);
+
+    batch_active = 1;
+    while ((pos < PACKET_TMP_DATA_BYTES) && (n < BATCH_CMDS_MAX)) {
+        if (PACKET_TMP_DATA_BYTES - pos < 3) {
+            status[n++] = MSG_ERR_LEN;
+            break;
+        }
+        cmd = packet->tmp_data8[pos];
+        data_n = packet->tmp_data8[pos + 1] | (packet->tmp_data8[pos + 2] << 8);
+        pos += 3;
+        if (data_n > PACKET_TMP_DATA_BYTES - pos) {
+            status[n++] = MSG_ERR_LEN;
+            break;
+        }
+        //no answer, a longer answer or a change of the link
+        switch (cmd) {
+        case CMD_BATCH:
+        case CMD_EXIT:
+        case CMD_SET_FRAMING:
+        case CMD_GET_INFO_EXT:
+        case CMD_READ_PAGE:
+        case CMD_READ_PAGES:
+        case CMD_GET_JOURNAL:
+        case CMD_ARQ_WRITE:
+        case CMD_RAM_RUN:
+        case CMD_ECHO:
+        case CMD_TEST_STREAM:
+            status[n] = MSG_ERR_CMD;
+            break;
+        default:
+            //data of the command 4-byte aligned at the start, as received
+            memmove(packet->tmp_data8, &packet->tmp_data8[pos], data_n);
+            packet->cmd_code = (CmdCode_TypeDef)cmd;
+            packet->data_n = data_n;
+            cmd_dispatch(packet);
+            status[n] = packet->tmp_data8[0];
+            break;
+        }
+        pos += data_n;
+        if (status[n++] != MSG_OK)
+            break;
+    }
+    batch_active = 0;
+
+    //MSG_OK only when every command ran and passed
+    packet->cmd_code = CMD_BATCH;
+    packet->tmp_data8[0] = ((pos == PACKET_TMP_DATA_BYTES) && (!n || (status[n - 1] == MSG_OK))) ? MSG_OK : MSG_FAIL;
+    memcpy(&packet->tmp_data8[4], status, n);
+    packet->data_n = 4 + n;
+
+    msg_cmd(packet);
+}
+#endif
+
+#if BOOT_USE_LINK_TEST
+void echo_cmd(Packet_TypeDef* packet)
+{
+    //the status takes 4 bytes in front of the data
+    if (packet->data_n > PACKET_TMP_DATA_BYTES - 4) {
+        packet->tmp_data8[0] = MSG_ERR_LEN;
+        packet->data_n = 4;
+        msg_cmd(packet);
+        return;
+    }
+
+    memmove(&packet->tmp_data8[4], packet->tmp_data8, packet->data_n);
+    packet->tmp_data8[0] = MSG_OK;
+    packet->data_n += 4;
+
+    msg_cmd(packet);
+}
+
+void test_stream_cmd(Packet_TypeDef* packet)
+{
+    uint32_t count;
+    uint32_t bytes;
+    uint32_t state;
+    uint32_t i;
+    uint32_t j;
+
+    if (!check_data_n(packet, 8))
+        return;
+
+    //count:u16 | bytes:u16 | seed:u32, the pattern is xorshift32 from the seed
+    count = packet->tmp_data16[0];
+    bytes = packet->tmp_data16[1];
+    state = packet->tmp_data32[1];
+    if ((bytes & 3) || (bytes > PACKET_TMP_DATA_BYTES - 8)) {
+        packet->tmp_data8[0] = MSG_ERR_LEN;
+        packet->data_n = 4;
+        msg_cmd(packet);
+        return;
+    }
+
+    //the frames go out as progress, each one is sent before the next is built
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < bytes / 4; j++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            packet->tmp_data32[2 + j] = state;
+        }
+        packet->cmd_code = CMD_TEST_STREAM;
+        packet->tmp_data8[0] = MSG_BUSY;
+        packet->tmp_data32[1] = i;
+        packet->data_n = 8 + bytes;
+        msg_cmd(packet);
+        packet_transmit_flush();
+    }
+
+    packet->cmd_code = CMD_TEST_STREAM;
+    packet->tmp_data8[0] = MSG_OK;
+    packet->tmp_data32[1] = packet_stats.frames;
+    packet->tmp_data32[2] = packet_stats.crc_errors;
+    packet->tmp_data32[3] = packet_stats.hdr_errors;
+    packet->tmp_data32[4] = packet_stats.lost;
+    packet->data_n = 20;
+
+    msg_cmd(packet);
+}
+#endif
+
 void exit_cmd(Packet_TypeDef* packet)
 {
+    if (!check_data_n(packet, 0))
+        return;
+
+    //pending partial writes must reach flash before the application starts
+    flash_cache_flush();
+#if BOOT_USE_JOURNAL
+    //the session is complete, nothing to resume
+    journal_clear();
+#endif
+    packet->data_n = 4;
+    packet->tmp_data8[0] = MSG_OK;
+
+    msg_cmd(packet);
+    packet_transmit_flush();
+
+    boot_exit();
+}
+
+#if BOOT_USE_RAM_RUN
+void ram_write_cmd(Packet_TypeDef* packet)
+{
+    uint32_t offset;
+    uint32_t len;
+    uint8_t* app = (uint8_t*)boot_ram_app;
+
+    if (packet->data_n <= 4) {
+        packet->tmp_data8[0] = MSG_ERR_LEN;
+        packet->data_n = 4;
+        msg_cmd(packet);
+        return;
+    }
+
+    //offset inside the region and bytes
+    offset = packet->tmp_data32[0];
+    len = packet->data_n - 4;
+
+    packet->data_n = 8;
+    if ((offset > BOOT_RAM_APP_BYTES) || (len > BOOT_RAM_APP_BYTES - offset))
+        packet->tmp_data8[0] = MSG_FAIL;
+    else {
+        for (uint32_t i = 0; i < len; i++)
+            app[offset + i] = packet->tmp_data8[4 + i];
+        packet->tmp_data8[0] = MSG_OK;
+    }
+
+    packet->tmp_data32[1] = offset;
+
+    msg_cmd(packet);
+}
+
+void ram_run_cmd(Packet_TypeDef* packet)
+{
+    uint32_t size;
     uint16_t rx_crc;
-    uint16_t calc_crc;
+    uint16_t crc;
+    uint32_t sp;
+    uint32_t pc;
+    MsgCode_TypeDef status;
+    const uint8_t* app = (const uint8_t*)boot_ram_app;
+
+    if (!check_data_n(packet, 8))
+        return;
+
+    //image size and its CRC16, same polynomial as packets
+    size = packet->tmp_data32[0];
+    rx_crc = (uint16_t)packet->tmp_data32[1];
+
+    crc = 0;
+    if (size <= BOOT_RAM_APP_BYTES) {
+        for (uint32_t i = 0; i < size; i++)
+            crc = crc_upd(crc, app[i]);
+    }
 
-    calc_crc = packet->crc;
-    rx_crc = packet_fifo_read_u16();
+    //the image starts with its vector table: stack top in RAM, Thumb reset handler inside the image
+    sp = boot_ram_app[0];
+    pc = boot_ram_app[1];
 
-    packet->data_n = 4;
-    if (calc_crc != rx_crc)
-        packet->tmp_data8[0] = MSG_ERR_CRC;
+    if ((size < 8) || (size > BOOT_RAM_APP_BYTES) || (crc != rx_crc) ||
+        (sp <= BOOT_RAM_APP_BASE) || (sp > BOOT_RAM_APP_BASE + BOOT_RAM_BYTES) ||
+        !(pc & 1) || (pc < BOOT_RAM_APP_BASE) || (pc >= BOOT_RAM_APP_BASE + size))
+        status = MSG_FAIL;
     else
-        packet->tmp_data8[0] = MSG_OK;
+        status = MSG_OK;
+
+    //pending partial writes must reach flash before the application starts
+    if (status == MSG_OK) {
+        flash_cache_flush();
+#if BOOT_USE_JOURNAL
+        journal_clear();
+#endif
+    }
+
+    packet->data_n = 12;
+    packet->tmp_data8[0] = status;
+    packet->tmp_data32[1] = size;
+    packet->tmp_data32[2] = crc;
 
     msg_cmd(packet);
-    while (packet_transmit_status_busy()) {
-    };
+    if (status != MSG_OK)
+        return;
 
-    boot_exit();
+    packet_transmit_flush();
+    ram_jump(boot_ram_app);
+}
+
+void ram_jump(const uint32_t* vtor)
+{
+    //the application gets the link without the bootloader interrupts
+    transport_stop();
+    SCB->VTOR = (uint32_t)vtor;
+    __DSB();
+    __ISB();
+    //no stack is used after MSP is switched
+    __asm volatile("msr msp, %0\n"
+                   "bx %1\n"
+                   :
+                   : "r"(vtor[0]), "r"(vtor[1]));
+    while (1) {
+    };
 }
+#endif
@@ -4,6 +4,25 @@
  * \copyright       DC Vostok Vladivostok 2023
  */
 #include "boot_flash.h"
+#if BOOT_FLASH_STANDALONE
+//built into an application, there is no bootloader arena
+static uint32_t flash_cache_data[FLASH_PAGE_SIZE_BYTES / 4];
+#else
+#include "boot_mem.h"
+#define flash_cache_data boot_arena.stage
+#endif
+
+/**
+ * \brief           One page write-back cache for writes smaller than a page,
+ *                  the page is staged in flash_cache_data
+ */
+static struct
+{
+    uint32_t valid;
+    uint32_t dirty;
+    uint32_t addr;
+    FlashType_TypeDef ftype;
+} flash_cache;
 
 //-- Private functions ---------------------------------------------------------
 static RAMFUNC void flash_cmd(uint32_t addr, FlashType_TypeDef ftype, uint32_t* data, FlashCmd_TypeDef cmd)
@@ -28,9 +47,46 @@ static RAMFUNC void flash_cmd(uint32_t addr, FlashType_TypeDef ftype, uint32_t*
 
 void flash_read(uint32_t addr, FlashType_TypeDef ftype, uint32_t* data)
 {
+#if BOOT_FLASH_MAPPED_READ
+    if (ftype == FLASH_MAIN) {
+        data[0] = ((const volatile uint32_t*)addr)[0];
+        data[1] = ((const volatile uint32_t*)addr)[1];
+        return;
+    }
+#endif
     flash_cmd(addr, ftype, data, FLASH_RD);
 }
 
+void flash_read_block(uint32_t addr, FlashType_TypeDef ftype, uint32_t* data, uint32_t len)
+{
+#if BOOT_FLASH_MAPPED_READ
+    const volatile uint32_t* src = (const volatile uint32_t*)addr;
+
+    if (ftype == FLASH_MAIN) {
+        //two words per iteration, LDRD / STRD
+        for (uint32_t i = 0; i < len / 4; i += 2) {
+            data[i] = src[i];
+            data[i + 1] = src[i + 1];
+        }
+        return;
+    }
+#endif
+    //a read leaves the controller idle, BUSY is polled only for the data
+    __NOP();
+    while (MFLASH->STAT_bit.BUSY) {
+    };
+    for (uint32_t i = 0; i < len / 4; i += 2) {
+        MFLASH->ADDR = addr;
+        MFLASH->CMD = FLASH_MAGICKEY_CONST << MFLASH_CMD_KEY_Pos |
+                      FLASH_RD | ftype << MFLASH_CMD_NVRON_Pos;
+        addr += 8;
+        while (MFLASH->STAT_bit.BUSY) {
+        };
+        data[i] = MFLASH->DATA[0].DATA;
+        data[i + 1] = MFLASH->DATA[1].DATA;
+    }
+}
+
 RAMFUNC void flash_write(uint32_t addr, FlashType_TypeDef ftype, const uint32_t* data)
 {
     flash_cmd(addr, ftype, (uint32_t*)data, FLASH_WR);
@@ -43,12 +99,77 @@ void flash_erase_page(uint32_t addr, FlashType_TypeDef ftype)
     //~4.570ms
 }
 
+void flash_wait()
+{
+    __NOP();
+    while (MFLASH->STAT_bit.BUSY) {
+    };
+}
+
 void flash_erase_full()
 {
     flash_cmd(0, FLASH_MAIN, NULL, FLASH_ERALL);
     //~35.071ms
 }
 
+uint32_t* flash_cache_page(uint32_t addr, FlashType_TypeDef ftype)
+{
+    uint32_t page = addr & ~(FLASH_PAGE_SIZE_BYTES - 1);
+
+    if (!flash_cache.valid || (flash_cache.addr != page) || (flash_cache.ftype != ftype)) {
+        flash_cache_flush();
+        flash_read_block(page, ftype, flash_cache_data, FLASH_PAGE_SIZE_BYTES);
+        flash_cache.addr = page;
+        flash_cache.ftype = ftype;
+        flash_cache.valid = 1;
+    }
+    flash_cache.dirty = 1;
+    return flash_cache_data;
+}
+
+void flash_cache_write(uint32_t addr, FlashType_TypeDef ftype, const uint8_t* data, uint32_t len)
+{
+    uint8_t* cache_data8 = (uint8_t*)flash_cache_page(addr, ftype);
+
+    //no memcpy, it may run from flash
+    addr &= FLASH_PAGE_SIZE_BYTES - 1;
+    for (uint32_t i = 0; i < len; i++)
+        cache_data8[addr + i] = data[i];
+}
+
+void flash_cache_flush()
+{
+    uint32_t data[2];
+    uint32_t erase = 0;
+    uint32_t* cache_data;
+
+    if (flash_cache.valid && flash_cache.dirty) {
+        //blank 8 bytes can be programmed in place, any other change needs an erase
+        for (uint32_t i = 0; i < FLASH_PAGE_SIZE_BYTES / 8; i++) {
+            cache_data = &flash_cache_data[i * 2];
+            flash_read(flash_cache.addr + i * 8, flash_cache.ftype, data);
+            if (((data[0] != cache_data[0]) || (data[1] != cache_data[1])) &&
+                ((data[0] & data[1]) != 0xFFFFFFFF))
+                erase = 1;
+        }
+        if (erase)
+            flash_erase_page(flash_cache.addr, flash_cache.ftype);
+        //program only what differs from flash
+        for (uint32_t i = 0; i < FLASH_PAGE_SIZE_BYTES / 8; i++) {
+            cache_data = &flash_cache_data[i * 2];
+            if (erase) {
+                data[0] = 0xFFFFFFFF;
+                data[1] = 0xFFFFFFFF;
+            } else
+                flash_read(flash_cache.addr + i * 8, flash_cache.ftype, data);
+            if ((data[0] != cache_data[0]) || (data[1] != cache_data[1]))
+                flash_write(flash_cache.addr + i * 8, flash_cache.ftype, cache_data);
+        }
+    }
+    flash_cache.valid = 0;
+    flash_cache.dirty = 0;
+}
+
 void flash_disable_boot()
 {
     MFLASH->BDIS = MFLASH_BDIS_BMDIS_Msk;
@@ -0,0 +1,171 @@
+/**
+ * \file            boot_journal.c
+ * \brief           Progress journal of page writes in main flash.
+ * \copyright       DC Vostok Vladivostok 2023
+ */
+#include "boot_journal.h"
+
+#if BOOT_USE_JOURNAL
+
+//-- Private function prototypes -----------------------------------------------
+static RAMFUNC uint32_t journal_tag(const uint32_t* entry);
+static RAMFUNC uint32_t journal_scan(uint32_t* start);
+static RAMFUNC uint32_t journal_last(uint32_t page, uint32_t start, uint32_t end);
+static RAMFUNC uint32_t journal_compact(uint32_t start, uint32_t drop_page);
+static RAMFUNC void journal_append(uint32_t word, uint16_t crc);
+
+//-- Private functions ---------------------------------------------------------
+/**
+ * \brief           Tag of an entry, 0 for blank and torn entries
+ */
+uint32_t journal_tag(const uint32_t* entry)
+{
+    //the CRC is stored with its complement, an interrupted write does not pass
+    if ((entry[1] >> 16) != (~entry[1] & 0xFFFF))
+        return 0;
+    return entry[0] & JOURNAL_TAG_MSK;
+}
+
+/**
+ * \brief           Find the first blank entry and the first entry of the current session
+ * \param[out]      start: entry after the last JOURNAL_TAG_CLEAR
+ * \return          First blank entry, JOURNAL_ENTRY_TOTAL when the journal is full
+ */
+uint32_t journal_scan(uint32_t* start)
+{
+    uint32_t data[2];
+    uint32_t i;
+
+    *start = 0;
+    for (i = 0; i < JOURNAL_ENTRY_TOTAL; i++) {
+        flash_read(JOURNAL_ADDR + i * 8, FLASH_MAIN, data);
+        if ((data[0] & data[1]) == 0xFFFFFFFF)
+            break;
+        if (journal_tag(data) == JOURNAL_TAG_CLEAR)
+            *start = i + 1;
+    }
+    return i;
+}
+
+/**
+ * \brief           Tag of the last entry of a page, 0 when there is none
+ */
+uint32_t journal_last(uint32_t page, uint32_t start, uint32_t end)
+{
+    uint32_t data[2];
+    uint32_t tag;
+    uint32_t last = 0;
+
+    for (uint32_t i = start; i < end; i++) {
+        flash_read(JOURNAL_ADDR + i * 8, FLASH_MAIN, data);
+        tag = journal_tag(data);
+        if (tag && (tag != JOURNAL_TAG_CLEAR) && ((data[0] & 0xFFFF) == page))
+            last = tag;
+    }
+    return last;
+}
+
+/**
+ * \brief           Rewrite the journal page keeping only the last JOURNAL_TAG_WRITTEN entry
+ *                  of every page of the current session
+ * \param[in]       start: first entry of the current session, JOURNAL_ENTRY_TOTAL drops all
+ * \param[in]       drop_page: page whose entries are dropped as well
+ * \return          First blank entry
+ */
+uint32_t journal_compact(uint32_t start, uint32_t drop_page)
+{
+    uint32_t* entry;
+    uint32_t page;
+    uint32_t n = 0;
+    uint32_t i;
+    uint32_t j;
+
+    //compacted in the page cache, the page is erased once by flash_cache_flush()
+    entry = flash_cache_page(JOURNAL_ADDR, FLASH_MAIN);
+    for (i = start; i < JOURNAL_ENTRY_TOTAL; i++) {
+        page = entry[i * 2] & 0xFFFF;
+        if ((journal_tag(&entry[i * 2]) != JOURNAL_TAG_WRITTEN) || (page == drop_page))
+            continue;
+        //a later entry of the same page replaces this one
+        for (j = i + 1; j < JOURNAL_ENTRY_TOTAL; j++) {
+            if (journal_tag(&entry[j * 2]) && ((entry[j * 2] & 0xFFFF) == page))
+                break;
+        }
+        if (j < JOURNAL_ENTRY_TOTAL)
+            continue;
+        entry[n * 2] = entry[i * 2];
+        entry[n * 2 + 1] = entry[i * 2 + 1];
+        n++;
+    }
+    for (i = n * 2; i < JOURNAL_ENTRY_TOTAL * 2; i++)
+        entry[i] = 0xFFFFFFFF;
+    flash_cache_flush();
+    return n;
+}
+
+/**
+ * \brief           Program one entry into the first blank double word
+ */
+void journal_append(uint32_t word, uint16_t crc)
+{
+    uint32_t data[2];
+    uint32_t start;
+    uint32_t next;
+
+    //a cached journal page would overwrite the entry when it is committed
+    flash_cache_flush();
+    next = journal_scan(&start);
+    if (next == JOURNAL_ENTRY_TOTAL)
+        next = journal_compact(start, word & 0xFFFF);
+
+    data[0] = word;
+    data[1] = crc | ((uint32_t)(uint16_t)~crc << 16);
+    flash_write(JOURNAL_ADDR + next * 8, FLASH_MAIN, data);
+}
+
+//-- Public functions ----------------------------------------------------------
+void journal_page_written(uint32_t page, uint16_t crc)
+{
+    journal_append(JOURNAL_TAG_WRITTEN | page, crc);
+}
+
+void journal_page_stale(uint32_t page)
+{
+    uint32_t start;
+    uint32_t next;
+
+    next = journal_scan(&start);
+    if (journal_last(page, start, next) == JOURNAL_TAG_WRITTEN)
+        journal_append(JOURNAL_TAG_STALE | page, 0);
+}
+
+void journal_clear()
+{
+    uint32_t start;
+    uint32_t next;
+
+    next = journal_scan(&start);
+    if (start == next)
+        return;
+    if (next == JOURNAL_ENTRY_TOTAL)
+        journal_compact(JOURNAL_ENTRY_TOTAL, 0);
+    else
+        journal_append(JOURNAL_TAG_CLEAR, 0);
+}
+
+uint32_t journal_read(uint32_t* data)
+{
+    uint32_t start;
+    uint32_t next;
+    uint32_t n = 0;
+
+    next = journal_scan(&start);
+    for (uint32_t i = start; i < next; i++) {
+        flash_read(JOURNAL_ADDR + i * 8, FLASH_MAIN, &data[n * 2]);
+        if (journal_tag(&data[n * 2]))
+            n++;
+    }
+    return n;
+}
+
+#endif
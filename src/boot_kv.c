@@ -0,0 +1,156 @@
+/**
+ * \file            boot_kv.c
+ * \brief           Key-value log in the last two pages of main flash.
+ * \copyright       DC Vostok Vladivostok 2023
+ */
+#include "boot_kv.h"
+
+#if BOOT_USE_KV
+
+/**
+ * \brief           RAM index of the log
+ */
+static struct
+{
+    uint8_t ready;
+    uint8_t active;             /*!< page holds a valid header, 0 - the log was never written */
+    uint8_t page;               /*!< page 0 or 1 of the log */
+    uint8_t next;               /*!< first blank record */
+    uint16_t gen;               /*!< generation of the page */
+    uint8_t slot[KV_KEY_TOTAL]; /*!< record + 1 holding the value of a key, 0 - never written */
+} kv;
+
+//-- Private function prototypes -----------------------------------------------
+static RAMFUNC uint32_t kv_record(uint32_t key, uint32_t value);
+static RAMFUNC uint32_t kv_header(uint32_t page, uint32_t* gen);
+static RAMFUNC void kv_scan();
+static RAMFUNC void kv_compact();
+
+//-- Private functions ---------------------------------------------------------
+/**
+ * \brief           Second word of a record: key, inverted key and a check of key and value,
+ *                  blank and torn records do not match it
+ */
+uint32_t kv_record(uint32_t key, uint32_t value)
+{
+    uint32_t check = (value ^ (value >> 16) ^ (key * 0x9E37) ^ 0x5A5A) & 0xFFFF;
+
+    return key | ((~key & 0xFF) << 8) | (check << 16);
+}
+
+/**
+ * \brief           Header of a page: magic, generation and inverted generation
+ * \return          1 if the header is valid
+ */
+uint32_t kv_header(uint32_t page, uint32_t* gen)
+{
+    uint32_t data[2];
+
+    flash_read(KV_PAGE_ADDR(page), FLASH_MAIN, data);
+    *gen = data[1] & 0xFFFF;
+    return (data[0] == KV_HEADER_MAGIC) && ((data[1] >> 16) == (~data[1] & 0xFFFF));
+}
+
+void kv_scan()
+{
+    uint32_t data[2];
+    uint32_t gen[2];
+    uint32_t valid[2];
+    uint32_t key;
+    uint32_t i;
+
+    valid[0] = kv_header(0, &gen[0]);
+    valid[1] = kv_header(1, &gen[1]);
+    //page 1 when it is the only valid one or a newer generation, the generation wraps
+    kv.page = valid[1] && (!valid[0] || ((int16_t)(gen[1] - gen[0]) > 0));
+    kv.active = valid[kv.page];
+    kv.gen = kv.active ? gen[kv.page] : 0;
+
+    for (i = 0; i < KV_KEY_TOTAL; i++)
+        kv.slot[i] = 0;
+    for (i = 0; kv.active && (i < KV_RECORD_TOTAL); i++) {
+        flash_read(KV_PAGE_ADDR(kv.page) + 8 + i * 8, FLASH_MAIN, data);
+        if ((data[0] & data[1]) == 0xFFFFFFFF)
+            break;
+        key = data[1] & 0xFF;
+        if ((key < KV_KEY_TOTAL) && (data[1] == kv_record(key, data[0])))
+            kv.slot[key] = i + 1;
+    }
+    kv.next = i;
+    kv.ready = 1;
+}
+
+/**
+ * \brief           Copy the last record of every key into the other page and commit it with the header,
+ *                  the first write of the log only erases page 0 and writes its header
+ */
+void kv_compact()
+{
+    uint32_t from = KV_PAGE_ADDR(kv.page) + 8;
+    uint32_t to;
+    uint32_t data[2];
+    uint32_t key;
+    uint32_t n = 0;
+
+    if (kv.active)
+        kv.page ^= 1;
+    to = KV_PAGE_ADDR(kv.page);
+    //the page is not the active one, a reset from here on leaves the old log in use
+    flash_erase_page(to, FLASH_MAIN);
+    for (key = 0; key < KV_KEY_TOTAL; key++) {
+        if (!kv.slot[key])
+            continue;
+        flash_read(from + (kv.slot[key] - 1) * 8, FLASH_MAIN, data);
+        flash_write(to + 8 + n * 8, FLASH_MAIN, data);
+        kv.slot[key] = ++n;
+    }
+    kv.gen++;
+    data[0] = KV_HEADER_MAGIC;
+    data[1] = kv.gen | ((~kv.gen & 0xFFFF) << 16);
+    flash_write(to, FLASH_MAIN, data);
+    kv.next = n;
+    kv.active = 1;
+}
+
+//-- Public functions ----------------------------------------------------------
+uint32_t kv_get(uint32_t key, uint32_t* value)
+{
+    uint32_t data[2];
+
+    if (key >= KV_KEY_TOTAL)
+        return 0;
+    if (!kv.ready)
+        kv_scan();
+    if (!kv.slot[key])
+        return 0;
+
+    flash_read(KV_PAGE_ADDR(kv.page) + kv.slot[key] * 8, FLASH_MAIN, data);
+    *value = data[0];
+    return 1;
+}
+
+uint32_t kv_set(uint32_t key, uint32_t value)
+{
+    uint32_t data[2];
+
+    if (key >= KV_KEY_TOTAL)
+        return 0;
+    if (!kv.ready)
+        kv_scan();
+    if (kv.slot[key]) {
+        flash_read(KV_PAGE_ADDR(kv.page) + kv.slot[key] * 8, FLASH_MAIN, data);
+        if (data[0] == value)
+            return 1;
+    }
+
+    if (!kv.active || (kv.next == KV_RECORD_TOTAL))
+        kv_compact();
+
+    data[0] = value;
+    data[1] = kv_record(key, value);
+    flash_write(KV_PAGE_ADDR(kv.page) + 8 + kv.next * 8, FLASH_MAIN, data);
+    kv.slot[key] = ++kv.next;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,20 @@
+/**
+ * \file            boot_mem.c
+ * \brief           RAM arena and the static RAM budget.
+ * \copyright       DC Vostok Vladivostok 2023
+ */
+
+#include "boot_mem.h"
+
+//the linker script places the arena in .noinit ahead of .bss, the startup code does not clear it
+BootArena_TypeDef boot_arena __attribute__((section(".noinit.boot_arena")));
+
+#if BOOT_USE_RAM_RUN
+//the linker script places .ramapp at the start of RAM and does not clear it
+uint32_t boot_ram_app[BOOT_RAM_APP_BYTES / 4] __attribute__((section(".ramapp")));
+#endif
+
+_Static_assert(sizeof(BootArena_TypeDef) + BOOT_RAM_APP_BYTES + BOOT_RAM_DATA_BYTES + BOOT_RAM_BSS_BYTES +
+               BOOT_STACK_BYTES <= BOOT_RAM_BYTES,
+               "RAM arena does not fit the RAM budget");
+_Static_assert((PACKET_FIFO_BYTES % 4) == 0, "PACKET_FIFO_BYTES must keep the arena regions aligned");
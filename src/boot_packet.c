@@ -1,73 +1,314 @@
 /**
- * \file            boot_core.c
+ * \file            boot_packet.c
  * \brief           Functions of working with packets.
  * \copyright       DC Vostok Vladivostok 2023
  */
 
 #include "boot_packet.h"
+#include "boot_mem.h"
+#include "boot_transport.h"
 
 
+//frames checked by the RX interrupt, each is a descriptor followed by its data,
+//data lives in boot_arena.rx_ring
 static volatile struct
 {
-    uint8_t mem[PACKET_FIFO_BYTES];
-    uint32_t wr_ptr;
-    uint32_t rd_ptr;
-    uint32_t full;
-    uint32_t empty;
+    uint32_t wr_ptr;    /*!< next byte of the frame being received */
+    uint32_t rd_ptr;    /*!< descriptor of the oldest complete frame */
+    uint32_t frame_ptr; /*!< start of the frame being received, complete frames end here */
+    uint32_t wr_n;      /*!< bytes written since init */
+    uint32_t rd_n;      /*!< bytes read since init */
+    uint32_t frame_n;   /*!< wr_n at frame_ptr */
 } packet_fifo;
 
+static volatile PacketFraming_TypeDef packet_framing = PACKET_FRAMING_SIGN;
+
+#if BOOT_USE_LINK_TEST
+volatile PacketStats_TypeDef packet_stats;
+#endif
+
+#if BOOT_USE_MULTIDROP
+#define PACKET_RX_SIGN      PACKET_HOST_ADDR_SIGN
+#define PACKET_RX_ADDR_N    2 /*!< node address bytes in front of the command */
+#else
+#define PACKET_RX_SIGN      PACKET_HOST_SIGN
+#define PACKET_RX_ADDR_N    0
+#endif
+
+/**
+ * \brief           Descriptor of a frame in packet_fifo: status, command, data length
+ *                  and the node address on a multidrop bus
+ */
+#define PACKET_RX_DESC_BYTES (4 + PACKET_RX_ADDR_N)
 
 /**
- * \brief           FIFO writing function called from the UART_RX interrupt
+ * \brief           Receiver state of the RX interrupt, a frame is parsed and its CRC
+ *                  is computed as its bytes arrive
+ */
+#define PACKET_RX_HUNT      0 /*!< looking for the signature, or dropping a COBS frame */
+#define PACKET_RX_HDR       1 /*!< node address, command and data length */
+#define PACKET_RX_DATA      2 /*!< data and crc */
+
+static struct
+{
+    uint32_t state;
+    uint32_t n;    /*!< bytes of the frame after the signature */
+    uint32_t end;  /*!< n at the end of the frame */
+    uint16_t sign; /*!< last two bytes while hunting, received crc in PACKET_RX_DATA */
+    uint16_t crc;
+    uint16_t data_n;
+    uint8_t hdr[PACKET_RX_ADDR_N + 4];
+#if BOOT_USE_COBS
+    uint8_t left; /*!< bytes left in the current COBS block */
+    uint8_t zero; /*!< the block ends with an implicit zero */
+#endif
+} packet_rx;
+
+/**
+ * \brief           Transmitter state, the answer is sent from the packet as the TX FIFO empties
+ */
+#define PACKET_TX_IDLE      0
+#define PACKET_TX_RAW       1 /*!< signature framing, bytes as they are */
+#define PACKET_TX_OPEN      2 /*!< COBS opening delimiter */
+#define PACKET_TX_CODE      3 /*!< COBS code byte of the next block */
+#define PACKET_TX_BLOCK     4 /*!< COBS block bytes */
+#define PACKET_TX_END       5 /*!< COBS closing delimiter */
+
+static struct
+{
+    uint32_t state;
+    Packet_TypeDef* packet;
+    uint32_t pos; /*!< next byte of the unencoded frame */
+    uint32_t len;
+    uint32_t run;  /*!< bytes of the current COBS block */
+    uint32_t left; /*!< bytes left in the current COBS block */
+    uint8_t hdr[6]; /*!< signature, command, inverted command, data length */
+} packet_tx;
+
+static inline __attribute__((always_inline)) uint32_t packet_fifo_next(uint32_t ptr)
+{
+    return (ptr == (PACKET_FIFO_BYTES - 1)) ? 0 : ptr + 1;
+}
+
+/**
+ * \brief           FIFO writing function called from the RX interrupt
  * 
  * \param[in]       data: Byte of data 
+ * \return          0 if the FIFO is full
  */
-static inline __attribute__((always_inline)) void packet_fifo_write(uint8_t data)
+static inline __attribute__((always_inline)) uint32_t packet_fifo_write(uint8_t data)
 {
-    if (!packet_fifo.full) {
-        packet_fifo.mem[packet_fifo.wr_ptr] = data;
-        packet_fifo.empty = 0;
-        if (packet_fifo.wr_ptr == (PACKET_FIFO_BYTES - 1))
-            packet_fifo.wr_ptr = 0;
-        else
-            packet_fifo.wr_ptr++;
-    }
+    if ((packet_fifo.wr_n - packet_fifo.rd_n) == PACKET_FIFO_BYTES)
+        return 0;
 
-    if (packet_fifo.wr_ptr == packet_fifo.rd_ptr)
-        packet_fifo.full = 1;
-    else
-        packet_fifo.full = 0;
+    boot_arena.rx_ring[packet_fifo.wr_ptr] = data;
+    packet_fifo.wr_ptr = packet_fifo_next(packet_fifo.wr_ptr);
+    packet_fifo.wr_n++;
+    return 1;
 }
 
+/**
+ * \brief           Drop the bytes of the frame being received
+ */
+static inline __attribute__((always_inline)) void packet_rx_drop()
+{
+    packet_fifo.wr_ptr = packet_fifo.frame_ptr;
+    packet_fifo.wr_n = packet_fifo.frame_n;
+    packet_rx.state = PACKET_RX_HUNT;
+}
 
-void packet_fifo_init()
+/**
+ * \brief           Drop the frame being received and count it as lost
+ */
+static inline __attribute__((always_inline)) void packet_rx_lost()
 {
-    packet_fifo.wr_ptr = 0;
-    packet_fifo.rd_ptr = 0;
-    packet_fifo.full = 0;
-    packet_fifo.empty = 1;
+#if BOOT_USE_LINK_TEST
+    packet_stats.lost++;
+#endif
+    packet_rx_drop();
 }
 
-uint8_t packet_fifo_read()
+/**
+ * \brief           Reserve the descriptor in front of the frame being received,
+ *                  the caller drops the frame when the FIFO is full and counts it once
+ * \return          0 if the FIFO is full
+ */
+static inline __attribute__((always_inline)) uint32_t packet_rx_reserve()
 {
-    uint8_t data = 0;
+    for (uint32_t i = 0; i < PACKET_RX_DESC_BYTES; i++) {
+        if (!packet_fifo_write(0))
+            return 0;
+    }
+    return 1;
+}
 
-    while (packet_fifo.empty) {
-    };
+/**
+ * \brief           Fill in the descriptor and pass the frame to packet_poll()
+ */
+static inline __attribute__((always_inline)) void packet_rx_done(uint8_t status, uint8_t cmd, uint16_t data_n)
+{
+    uint8_t desc[PACKET_RX_DESC_BYTES];
+    uint32_t ptr = packet_fifo.frame_ptr;
+
+    desc[0] = status;
+    desc[1] = cmd;
+    desc[2] = data_n & 0x00FF;
+    desc[3] = (data_n & 0xFF00) >> 8;
+#if BOOT_USE_MULTIDROP
+    desc[4] = packet_rx.hdr[0];
+    desc[5] = packet_rx.hdr[1];
+#endif
+    for (uint32_t i = 0; i < PACKET_RX_DESC_BYTES; i++) {
+        boot_arena.rx_ring[ptr] = desc[i];
+        ptr = packet_fifo_next(ptr);
+    }
+    packet_fifo.frame_ptr = packet_fifo.wr_ptr;
+    packet_fifo.frame_n = packet_fifo.wr_n;
+    packet_rx.state = PACKET_RX_HUNT;
+    packet_rx.sign = 0;
+}
 
-    data = packet_fifo.mem[packet_fifo.rd_ptr];
-    if (packet_fifo.rd_ptr == (PACKET_FIFO_BYTES - 1))
-        packet_fifo.rd_ptr = 0;
+/**
+ * \brief           Check the header collected in packet_rx.hdr and start the CRC of the frame,
+ *                  the descriptor is reserved by the caller
+ * \return          1 if the command is consistent and the data fits the packet, 0 otherwise
+ */
+static inline __attribute__((always_inline)) uint32_t packet_rx_header()
+{
+    uint8_t* hdr = &packet_rx.hdr[PACKET_RX_ADDR_N];
+
+    packet_rx.data_n = hdr[2] | (hdr[3] << 8);
+    if (((hdr[0] ^ hdr[1]) != 0xFF) || (packet_rx.data_n > PACKET_TMP_DATA_BYTES))
+        return 0;
+
+    packet_rx.crc = 0;
+    for (uint32_t i = 0; i < sizeof(packet_rx.hdr); i++)
+        packet_rx.crc = crc_upd(packet_rx.crc, packet_rx.hdr[i]);
+    packet_rx.end = sizeof(packet_rx.hdr) + packet_rx.data_n + 2;
+    return 1;
+}
+
+/**
+ * \brief           Byte of frame data or crc: data goes to the FIFO, crc is accumulated
+ */
+static inline __attribute__((always_inline)) void packet_rx_data(uint8_t data)
+{
+    if ((packet_rx.n - sizeof(packet_rx.hdr)) < packet_rx.data_n) {
+        if (!packet_fifo_write(data)) {
+            packet_rx_lost();
+            return;
+        }
+        packet_rx.crc = crc_upd(packet_rx.crc, data);
+    } else {
+        packet_rx.sign = (packet_rx.sign >> 8) | (uint16_t)(data << 8);
+    }
+    packet_rx.n++;
+}
+
+/**
+ * \brief           Parse next byte of a signature framed packet
+ */
+static inline __attribute__((always_inline)) void packet_rx_sign(uint8_t data)
+{
+    switch (packet_rx.state) {
+    case PACKET_RX_HUNT:
+        //search for a signature
+        packet_rx.sign = (packet_rx.sign >> 8) | (uint16_t)(data << 8);
+        if (packet_rx.sign == PACKET_RX_SIGN) {
+            packet_rx.state = PACKET_RX_HDR;
+            packet_rx.n = 0;
+        }
+        break;
+    case PACKET_RX_HDR:
+        //read service information
+        packet_rx.hdr[packet_rx.n++] = data;
+        if (packet_rx.n < sizeof(packet_rx.hdr))
+            break;
+        packet_rx.sign = 0;
+        packet_rx.state = PACKET_RX_HUNT;
+        //a full FIFO drops the frame, whatever its header
+        if (!packet_rx_reserve()) {
+            packet_rx_lost();
+            break;
+        }
+        //checking the correctness of the command and the length of the data,
+        //a damaged header is answered without reading the rest of the frame
+        if (packet_rx_header())
+            packet_rx.state = PACKET_RX_DATA;
+        else
+            packet_rx_done(MSG_ERR_CMD, CMD_NONE, 0);
+        break;
+    default:
+        //read the whole frame, handlers work with complete data only
+        packet_rx_data(data);
+        if ((packet_rx.state == PACKET_RX_DATA) && (packet_rx.n == packet_rx.end))
+            packet_rx_done((packet_rx.crc == packet_rx.sign) ? MSG_OK : MSG_ERR_CRC,
+                           packet_rx.hdr[PACKET_RX_ADDR_N], packet_rx.data_n);
+        break;
+    }
+}
+
+#if BOOT_USE_COBS
+/**
+ * \brief           Next decoded byte of a COBS frame
+ */
+static inline __attribute__((always_inline)) void packet_rx_cobs_byte(uint8_t data)
+{
+    //header, with the node address in front on a multidrop bus
+    if (packet_rx.n < sizeof(packet_rx.hdr)) {
+        packet_rx.hdr[packet_rx.n++] = data;
+        //a bad header or a full FIFO leaves the frame to be counted as lost at the delimiter
+        if ((packet_rx.n == sizeof(packet_rx.hdr)) && packet_rx_header()) {
+            if (packet_rx_reserve())
+                packet_rx.state = PACKET_RX_DATA;
+            else
+                packet_rx_drop();
+        }
+        return;
+    }
+    //a frame longer than its header says is dropped at the delimiter
+    if (packet_rx.state == PACKET_RX_DATA)
+        packet_rx_data(data);
     else
-        packet_fifo.rd_ptr++;
+        packet_rx.n++;
+}
 
-    if ((packet_fifo.wr_ptr == packet_fifo.rd_ptr) && !packet_fifo.full)
-        packet_fifo.empty = 1;
+/**
+ * \brief           Parse next byte of a COBS encoded frame.
+ *                  A broken frame is dropped at the next delimiter, so the parser
+ *                  is in sync again right after it.
+ */
+static inline __attribute__((always_inline)) void packet_rx_cobs(uint8_t data)
+{
+    if (data != 0) {
+        if (packet_rx.left) {
+            packet_rx.left--;
+            packet_rx_cobs_byte(data);
+            return;
+        }
+        if (packet_rx.zero)
+            packet_rx_cobs_byte(0);
+        packet_rx.zero = (data != 0xFF);
+        packet_rx.left = data - 1;
+        return;
+    }
 
-    return data;
+    //the delimiter ends the frame, inside a block it ends a broken one
+    if (!packet_rx.left && (packet_rx.state == PACKET_RX_DATA) && (packet_rx.n == packet_rx.end))
+        packet_rx_done((packet_rx.crc == packet_rx.sign) ? MSG_OK : MSG_ERR_CRC,
+                       packet_rx.hdr[PACKET_RX_ADDR_N], packet_rx.data_n);
+    else if (packet_rx.n)
+        packet_rx_lost();
+    packet_rx.n = 0;
+    packet_rx.left = 0;
+    packet_rx.zero = 0;
 }
+#endif //BOOT_USE_COBS
 
-uint16_t crc_upd(uint16_t crc_in, uint8_t data)
+/**
+ * \brief           CRC step bit by bit, the entries of the lookup table are crc_bits(crc_bits(i, 0), 0)
+ */
+static inline __attribute__((always_inline)) uint16_t crc_bits(uint16_t crc_in, uint8_t data)
 {
     uint32_t crc = crc_in;
     uint32_t in = data | 0x100;
@@ -84,104 +325,260 @@ uint16_t crc_upd(uint16_t crc_in, uint8_t data)
     return crc & 0xffffu;
 }
 
-void packet_receive(Packet_TypeDef* rx_packet)
+/**
+ * \brief           Forget the frame being received, interrupts must be disabled
+ */
+static inline __attribute__((always_inline)) void packet_rx_reset()
 {
-    uint16_t rx_signature;
-    uint8_t rx_cmd;
-    uint8_t rx_cmd_inv;
-    uint16_t rx_data_n;
-    uint16_t pre_crc;
+    packet_rx_drop();
+    packet_rx.n = 0;
+    packet_rx.sign = 0;
+#if BOOT_USE_COBS
+    packet_rx.left = 0;
+    packet_rx.zero = 0;
+#endif
+}
 
-    //Search for a signature
-    rx_signature = 0x0000;
-    while (rx_signature != PACKET_HOST_SIGN) {
-        rx_signature = (rx_signature >> 8) | (uint16_t)(packet_fifo_read() << 8);
-    }
-    //Read service information
-    rx_cmd = packet_fifo_read();
-    rx_cmd_inv = packet_fifo_read();
-    rx_data_n = packet_fifo_read_u16();
-
-    //checking the correctness of the command
-    if ((rx_cmd ^ rx_cmd_inv) != 0xFF) {
-        rx_packet->cmd_code = CMD_NONE;
-        rx_packet->tmp_data8[0] = MSG_ERR_CMD;
-    }
-    //if everything is correct, then we start counting crc
-    else {
-        pre_crc = 0;
-        pre_crc = crc_upd(pre_crc, rx_cmd);
-        pre_crc = crc_upd(pre_crc, rx_cmd_inv);
-        pre_crc = crc_upd_u16(pre_crc, rx_data_n);
-        //pass what we have parsed to the kernel, the crc will be counted and checked already there in the handler of a specific command
-        rx_packet->cmd_code = rx_cmd;
-        rx_packet->data_n = rx_data_n;
-        rx_packet->crc = pre_crc;
-    }
+void packet_fifo_init()
+{
+    //before the first frame is checked
+    crc_init();
+    __disable_irq();
+    packet_fifo.wr_ptr = 0;
+    packet_fifo.rd_ptr = 0;
+    packet_fifo.frame_ptr = 0;
+    packet_fifo.wr_n = 0;
+    packet_fifo.rd_n = 0;
+    packet_fifo.frame_n = 0;
+    packet_rx_reset();
+    __enable_irq();
+    transport_rx_resume();
 }
 
-uint32_t packet_transmit_status_busy()
+void packet_rx_byte(uint8_t data)
 {
-    return UART->FR_bit.BUSY | !UART->FR_bit.TXFE;
+#if BOOT_USE_COBS
+    if (packet_framing == PACKET_FRAMING_COBS) {
+        packet_rx_cobs(data);
+        return;
+    }
+#endif
+    packet_rx_sign(data);
 }
 
-void packet_transmit(Packet_TypeDef* tx_packet)
+uint32_t packet_rx_left()
 {
-    uint16_t crc = 0;
+    return (packet_rx.state == PACKET_RX_DATA) ? packet_rx.end - packet_rx.n : 0;
+}
 
-    while (packet_transmit_status_busy()) {
-    };
-    DBG_PRINT(0x04);
-    DBG_PRINT(tx_packet->cmd_code);
+uint32_t packet_fifo_fill()
+{
+    return packet_fifo.wr_n - packet_fifo.rd_n;
+}
 
-    UART->DR = PACKET_DEVICE_SIGN & 0x00FF;
-    UART->DR = (PACKET_DEVICE_SIGN & 0xFF00) >> 8;
+void crc_init()
+{
+#if BOOT_CRC_TABLE
+    for (uint32_t i = 0; i < BOOT_CRC_TABLE; i++)
+        boot_arena.crc_table[i] = crc_bits(crc_bits(i, 0), 0);
+#endif
+}
 
-    UART->DR = tx_packet->cmd_code;
-    crc = crc_upd(crc, tx_packet->cmd_code);
+uint16_t crc_upd(uint16_t crc_in, uint8_t data)
+{
+#if BOOT_CRC_TABLE == 256
+    return (uint16_t)((crc_in << 8) | data) ^ boot_arena.crc_table[crc_in >> 8];
+#elif BOOT_CRC_TABLE == 16
+    uint32_t crc = crc_in;
 
-    UART->DR = ~tx_packet->cmd_code;
-    crc = crc_upd(crc, ~tx_packet->cmd_code);
+    crc = (((crc << 4) | (data >> 4)) & 0xffffu) ^ boot_arena.crc_table[crc >> 12];
+    crc = (((crc << 4) | (data & 0x0F)) & 0xffffu) ^ boot_arena.crc_table[crc >> 12];
+    return crc;
+#else
+    return crc_bits(crc_in, data);
+#endif
+}
 
-    UART->DR = tx_packet->data_n & 0x00FF;
-    UART->DR = (tx_packet->data_n & 0xFF00) >> 8;
-    crc = crc_upd_u16(crc, tx_packet->data_n);
+MsgCode_TypeDef packet_poll(Packet_TypeDef* rx_packet)
+{
+    uint8_t desc[PACKET_RX_DESC_BYTES];
+    uint32_t ptr;
 
-    for (uint16_t i = 0; i < tx_packet->data_n; i++) {
-        while (!UART->RIS_bit.TXRIS || UART->FR_bit.TXFF) {
-        };
-        UART->DR = tx_packet->tmp_data8[i];
-        UART->ICR = UART_ICR_TXIC_Msk;
-        crc = crc_upd(crc, tx_packet->tmp_data8[i]);
+    //the answer is sent from the same packet, the next frame waits for it in packet_fifo
+    if (packet_tx.state != PACKET_TX_IDLE) {
+        transport_tx_pump();
+        return MSG_NONE;
     }
+    if (packet_fifo.rd_n == packet_fifo.frame_n)
+        return MSG_NONE;
+
+    //the frame is checked already, only its data is copied
+    ptr = packet_fifo.rd_ptr;
+    for (uint32_t i = 0; i < PACKET_RX_DESC_BYTES; i++) {
+        desc[i] = boot_arena.rx_ring[ptr];
+        ptr = packet_fifo_next(ptr);
+    }
+    rx_packet->cmd_code = desc[1];
+    rx_packet->data_n = desc[2] | (desc[3] << 8);
+#if BOOT_USE_MULTIDROP
+    rx_packet->addr = desc[4] | (desc[5] << 8);
+#endif
+    for (uint32_t i = 0; i < rx_packet->data_n; i++) {
+        rx_packet->tmp_data8[i] = boot_arena.rx_ring[ptr];
+        ptr = packet_fifo_next(ptr);
+    }
+    packet_fifo.rd_ptr = ptr;
+    packet_fifo.rd_n += PACKET_RX_DESC_BYTES + rx_packet->data_n;
+    transport_rx_resume();
+#if BOOT_USE_LINK_TEST
+    if (desc[0] == MSG_OK)
+        packet_stats.frames++;
+    else if (desc[0] == MSG_ERR_CRC)
+        packet_stats.crc_errors++;
+    else
+        packet_stats.hdr_errors++;
+#endif
+
+    return (MsgCode_TypeDef)desc[0];
+}
 
-    UART->DR = crc & 0x00FF;
-    UART->DR = (crc & 0xFF00) >> 8;
+void packet_wait()
+{
+    //interrupts are held off between the check and WFI, a pending one still ends the sleep
+    __disable_irq();
+    if ((packet_tx.state == PACKET_TX_IDLE) ? (packet_fifo.rd_n == packet_fifo.frame_n)
+                                            : transport_tx_waiting())
+        __WFI();
+    __enable_irq();
 }
 
-uint32_t packet_fifo_read_u32()
+void packet_set_framing(PacketFraming_TypeDef framing)
 {
-    uint32_t data = 0;
+    __disable_irq();
+    packet_framing = framing;
+    packet_rx_reset();
+    __enable_irq();
+}
 
-    data = (uint32_t)(packet_fifo_read() << 0);
-    data |= (uint32_t)(packet_fifo_read() << 8);
-    data |= (uint32_t)(packet_fifo_read() << 16);
-    data |= (uint32_t)(packet_fifo_read() << 24);
+uint32_t packet_transmit_status_busy()
+{
+    return (packet_tx.state != PACKET_TX_IDLE) | transport_tx_busy();
+}
 
-    return data;
+uint32_t packet_tx_active()
+{
+    return packet_tx.state != PACKET_TX_IDLE;
 }
 
+/**
+ * \brief           Byte of the unencoded frame: signature, header, data, crc
+ */
+static inline __attribute__((always_inline)) uint8_t packet_tx_frame_byte(uint32_t i)
+{
+    Packet_TypeDef* tx_packet = packet_tx.packet;
+
+    if (i < sizeof(packet_tx.hdr))
+        return packet_tx.hdr[i];
+    i -= sizeof(packet_tx.hdr);
+    if (i < tx_packet->data_n)
+        return tx_packet->tmp_data8[i];
+    return (i == tx_packet->data_n) ? (tx_packet->crc & 0x00FF) : ((tx_packet->crc & 0xFF00) >> 8);
+}
 
-uint16_t packet_fifo_read_u16()
+#if BOOT_USE_COBS
+/**
+ * \brief           Go on after a COBS block: the next code byte or the closing delimiter
+ */
+static inline __attribute__((always_inline)) void packet_tx_block_end()
 {
-    uint16_t data = 0;
+    if (packet_tx.pos == packet_tx.len) {
+        packet_tx.state = PACKET_TX_END;
+        return;
+    }
+    //skip the zero replaced by the code byte
+    if (packet_tx.run < 254)
+        packet_tx.pos++;
+    packet_tx.state = PACKET_TX_CODE;
+}
+#endif
 
-    data = (uint16_t)(packet_fifo_read() << 0);
-    data |= (uint16_t)(packet_fifo_read() << 8);
+uint8_t packet_tx_next()
+{
+    uint8_t data;
+
+    switch (packet_tx.state) {
+#if BOOT_USE_COBS
+    case PACKET_TX_CODE:
+        data = 0;
+        while ((packet_tx.pos + data < packet_tx.len) && (data < 254) && packet_tx_frame_byte(packet_tx.pos + data))
+            data++;
+        packet_tx.run = data;
+        packet_tx.left = data;
+        packet_tx.state = PACKET_TX_BLOCK;
+        if (!data)
+            packet_tx_block_end();
+        return data + 1;
+    case PACKET_TX_BLOCK:
+        data = packet_tx_frame_byte(packet_tx.pos++);
+        if (--packet_tx.left == 0)
+            packet_tx_block_end();
+        return data;
+    case PACKET_TX_OPEN:
+        packet_tx.state = PACKET_TX_CODE;
+        return 0;
+    case PACKET_TX_END:
+        packet_tx.state = PACKET_TX_IDLE;
+        return 0;
+#endif
+    default:
+        data = packet_tx_frame_byte(packet_tx.pos++);
+        if (packet_tx.pos == packet_tx.len)
+            packet_tx.state = PACKET_TX_IDLE;
+        return data;
+    }
+}
+
+void packet_transmit(Packet_TypeDef* tx_packet)
+{
+    uint16_t crc = 0;
 
-    return data;
+    while (packet_tx.state != PACKET_TX_IDLE)
+        transport_tx_pump();
+    DBG_PRINT(0x04);
+    DBG_PRINT(tx_packet->cmd_code);
+    transport_tx_start();
+
+    packet_tx.hdr[0] = PACKET_DEVICE_SIGN & 0x00FF;
+    packet_tx.hdr[1] = (PACKET_DEVICE_SIGN & 0xFF00) >> 8;
+    packet_tx.hdr[2] = tx_packet->cmd_code;
+    packet_tx.hdr[3] = ~tx_packet->cmd_code;
+    packet_tx.hdr[4] = tx_packet->data_n & 0x00FF;
+    packet_tx.hdr[5] = (tx_packet->data_n & 0xFF00) >> 8;
+    for (uint32_t i = 2; i < sizeof(packet_tx.hdr); i++)
+        crc = crc_upd(crc, packet_tx.hdr[i]);
+    for (uint16_t i = 0; i < tx_packet->data_n; i++)
+        crc = crc_upd(crc, tx_packet->tmp_data8[i]);
+    tx_packet->crc = crc;
+
+    packet_tx.packet = tx_packet;
+    packet_tx.len = sizeof(packet_tx.hdr) + tx_packet->data_n + 2;
+    packet_tx.pos = 0;
+    packet_tx.state = PACKET_TX_RAW;
+#if BOOT_USE_COBS
+    //COBS frame has no signature
+    if (packet_framing == PACKET_FRAMING_COBS) {
+        packet_tx.pos = 2;
+        packet_tx.state = PACKET_TX_OPEN;
+    }
+#endif
+    transport_tx_pump();
 }
 
+void packet_transmit_flush()
+{
+    while (packet_transmit_status_busy())
+        transport_tx_pump();
+}
 
 uint16_t crc_upd_u32(uint16_t crc_in, uint32_t data)
 {
@@ -201,12 +598,3 @@ uint16_t crc_upd_u16(uint16_t crc_in, uint16_t data)
     return crc_in;
 }
 
-
-RAMFUNC void UART_RX_IRQHandler()
-{
-    UART->ICR = UART_ICR_RXIC_Msk;
-
-    while (!UART->FR_bit.RXFE) {
-        packet_fifo_write(UART->DR_bit.DATA);
-    }
-}
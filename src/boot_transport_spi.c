@@ -0,0 +1,127 @@
+/**
+ * \file            boot_transport_spi.c
+ * \brief           SPI slave link to a host MCU. The host clocks every byte in both directions:
+ *                  bytes it clocks while the device has no answer are 0x00 or stale and are
+ *                  dropped by the frame parser of the host, 0x00 clocked by the host while it
+ *                  waits for an answer are dropped by packet_rx_byte().
+ * \copyright       DC Vostok Vladivostok 2023
+ */
+
+#include "boot_transport.h"
+#include "boot_packet.h"
+#include "bitbanding.h"
+
+#if BOOT_TRANSPORT == BOOT_TRANSPORT_SPI
+
+//-- Private functions ---------------------------------------------------------
+/**
+ * \brief           Parse the bytes in the SPI RX FIFO. A byte lost to an overrun
+ *                  fails the CRC of its frame, the host sends it again.
+ */
+static inline __attribute__((always_inline)) void spis_rx_drain()
+{
+    while (SPI->SR_bit.RNE)
+        packet_rx_byte(SPI->DR);
+}
+
+//-- Public functions ----------------------------------------------------------
+void transport_init()
+{
+    SPIS_PORT->ALTFUNCSET = SPIS_PINS_MSK;
+    SPIS_PORT->DENSET = SPIS_PINS_MSK;
+
+    RCU->SPICFG = (RCU_SPICFG_CLKSEL_PLLCLK << RCU_SPICFG_CLKSEL_Pos) |
+                  (1 << RCU_SPICFG_CLKEN_Pos) |
+                  (1 << RCU_SPICFG_RSTDIS_Pos);
+    //8-bit Motorola frames, mode 0, the host drives SCK and SS
+    SPI->CR0 = (7 << SPI_CR0_DSS_Pos) | (0 << SPI_CR0_FRF_Pos);
+    SPI->CR1 = SPI_CR1_MS_Msk;
+    SPI->CR1 |= SPI_CR1_SSE_Msk;
+    //transport_sync() reads the sync byte itself
+    SPI->IMSC = 0;
+    NVIC_EnableIRQ(SPIS_RX_IRQn);
+    NVIC_EnableIRQ(SPIS_RT_IRQn);
+    NVIC_EnableIRQ(SPIS_TX_IRQn);
+}
+
+int transport_sync()
+{
+    uint32_t timeout_start;
+
+    BIT_BAND_PER(TIMEOUT_TMR->CTRL, TMR_CTRL_ON_Msk) = 0;
+    TIMEOUT_TMR->LOAD = 0xffffffffu;
+    TIMEOUT_TMR->VALUE = TIMEOUT_TMR->LOAD;
+    BIT_BAND_PER(TIMEOUT_TMR->CTRL, TMR_CTRL_ON_Msk) = 1;
+    timeout_start = TIMEOUT_TMR->VALUE;
+    //the clock comes from the host, nothing to measure
+    while (!SPI->SR_bit.RNE || ((SPI->DR & 0xFF) != SPIS_SYNC_BYTE)) {
+        if (timeout_start - TIMEOUT_TMR->VALUE > (SYSCLK / 1000 * SPIS_TIMEOUT))
+            return -1;
+    }
+
+    //the device signature with bytes swapped goes out with the next bytes the host clocks
+    SPI->DR = (PACKET_DEVICE_SIGN & 0xFF00) >> 8;
+    SPI->DR = PACKET_DEVICE_SIGN & 0x00FF;
+    SPI->ICR = SPI_ICR_RTIC_Msk | SPI_ICR_RORIC_Msk;
+    SPI->IMSC = SPI_IMSC_RXIM_Msk | SPI_IMSC_RTIM_Msk;
+
+    return 0;
+}
+
+void transport_tx_start()
+{
+}
+
+void transport_tx_pump()
+{
+    while (packet_tx_active() && SPI->SR_bit.TNF)
+        SPI->DR = packet_tx_next();
+    //the TX interrupt wakes the core once the host has clocked out half of the FIFO
+    if (packet_tx_active())
+        SPI->IMSC |= SPI_IMSC_TXIM_Msk;
+}
+
+uint32_t transport_tx_busy()
+{
+    //the last bytes leave only when the host clocks them
+    return SPI->SR_bit.BSY | !SPI->SR_bit.TFE;
+}
+
+uint32_t transport_tx_waiting()
+{
+    return SPI->IMSC & SPI_IMSC_TXIM_Msk;
+}
+
+void transport_rx_resume()
+{
+}
+
+void transport_stop()
+{
+    SPI->IMSC = 0;
+    NVIC_DisableIRQ(SPIS_RX_IRQn);
+    NVIC_DisableIRQ(SPIS_RT_IRQn);
+    NVIC_DisableIRQ(SPIS_TX_IRQn);
+    NVIC_ClearPendingIRQ(SPIS_RX_IRQn);
+    NVIC_ClearPendingIRQ(SPIS_RT_IRQn);
+    NVIC_ClearPendingIRQ(SPIS_TX_IRQn);
+}
+
+RAMFUNC void SPIS_RX_IRQHandler()
+{
+    spis_rx_drain();
+}
+
+RAMFUNC void SPIS_RT_IRQHandler()
+{
+    SPI->ICR = SPI_ICR_RTIC_Msk | SPI_ICR_RORIC_Msk;
+    spis_rx_drain();
+}
+
+RAMFUNC void SPIS_TX_IRQHandler()
+{
+    //only wakes the core, transport_tx_pump() refills the FIFO
+    SPI->IMSC &= ~SPI_IMSC_TXIM_Msk;
+}
+
+#endif //BOOT_TRANSPORT == BOOT_TRANSPORT_SPI
@@ -0,0 +1,223 @@
+/**
+ * \file            boot_transport_uart.c
+ * \brief           UART link with auto-baud, optional RS-485 driver enable and RTS / CTS.
+ * \copyright       DC Vostok Vladivostok 2023
+ */
+
+#include "boot_transport.h"
+#include "boot_packet.h"
+#include "bitbanding.h"
+
+#if BOOT_TRANSPORT == BOOT_TRANSPORT_UART
+
+#if BOOT_USE_FLOW_CTRL
+static volatile uint32_t uart_rts_off; /*!< RTS is released */
+#endif
+
+//-- Private functions ---------------------------------------------------------
+static int wait_uart_rx(uint32_t value)
+{
+    uint32_t timeout_start;
+    BIT_BAND_PER(TIMEOUT_TMR->CTRL, TMR_CTRL_ON_Msk) = 0;
+    TIMEOUT_TMR->LOAD = 0xffffffffu;
+    TIMEOUT_TMR->VALUE = TIMEOUT_TMR->LOAD;
+    BIT_BAND_PER(TIMEOUT_TMR->CTRL, TMR_CTRL_ON_Msk) = 1;
+    timeout_start = TIMEOUT_TMR->VALUE;
+    // while (((UART_PORT->DATA >> UART_PIN_RX_POS) & 1) != value ) {
+    while (BIT_BAND_PER(UART_PORT->DATA,(1 << UART_PIN_RX_POS)) != value ) {
+        if(timeout_start - TIMEOUT_TMR->VALUE > (SYSCLK/1000 * UART_TIMEOUT)){
+            return -1;
+        }
+    };
+    return 0;
+}
+
+/**
+ * \brief           Release the RS-485 bus after the last stop bit
+ */
+static inline __attribute__((always_inline)) void uart_tx_end()
+{
+#if BOOT_USE_UART_DE
+    while (transport_tx_busy()) {
+    };
+    UART_DE_CLR();
+#endif
+}
+
+/**
+ * \brief           Parse the bytes in the UART RX FIFO and set the RX interrupt level
+ *                  for the bytes still to come
+ */
+static inline __attribute__((always_inline)) void uart_rx_drain()
+{
+    uint32_t level = UART_RX_IFLS;
+
+    while (!UART->FR_bit.RXFE)
+        packet_rx_byte(UART->DR_bit.DATA);
+#if BOOT_USE_FLOW_CTRL
+    //the host stops within a few bytes, the ring keeps room for them
+    if (packet_fifo_fill() >= PACKET_FIFO_RTS_OFF) {
+        uart_rts_off = 1;
+        UART_RTS_RELEASE();
+    }
+#endif
+    if (packet_rx_left() > UART_RX_BULK_BYTES)
+        level = UART_RX_IFLS_BULK;
+    UART->IFLS = level << UART_IFLS_RXIFLSEL_Pos | UART_IFLS_RXIFLSEL_Lvl18 << UART_IFLS_TXIFLSEL_Pos;
+}
+
+//-- Public functions ----------------------------------------------------------
+void transport_init()
+{
+    UART_PORT->ALTFUNCSET = UART_PINS_MSK;
+    UART_PORT->DENSET = UART_PINS_MSK;
+
+    RCU->UARTCFG[UART_NUM].UARTCFG = (RCU_UARTCFG_UARTCFG_CLKSEL_PLLCLK << RCU_UARTCFG_UARTCFG_CLKSEL_Pos) |
+                                     (1 << RCU_UARTCFG_UARTCFG_CLKEN_Pos) |
+                                     (1 << RCU_UARTCFG_UARTCFG_RSTDIS_Pos);
+     UART->IFLS = UART_RX_IFLS << UART_IFLS_RXIFLSEL_Pos |
+                  UART_IFLS_RXIFLSEL_Lvl18 << UART_IFLS_TXIFLSEL_Pos;
+    UART->IMSC = UART_MIS_RXMIS_Msk | UART_MIS_RTMIS_Msk;
+    NVIC_EnableIRQ(UART_RX_IRQn);
+    NVIC_EnableIRQ(UART_RT_IRQn);
+    NVIC_EnableIRQ(UART_TX_IRQn);
+#if BOOT_USE_UART_DE
+    //transceiver listens to the bus until the bootloader answers
+    UART_DE_PORT->DATAOUTCLR = UART_DE_PIN_MSK;
+    UART_DE_PORT->DENSET = UART_DE_PIN_MSK;
+    UART_DE_PORT->OUTENSET = UART_DE_PIN_MSK;
+#endif
+#if BOOT_USE_FLOW_CTRL
+    //the host may send from the start, an unconnected CTS reads as asserted
+    UART_RTS_PORT->DATAOUTCLR = UART_RTS_PIN_MSK;
+    UART_RTS_PORT->DENSET = UART_RTS_PIN_MSK;
+    UART_RTS_PORT->OUTENSET = UART_RTS_PIN_MSK;
+    UART_CTS_PORT->DENSET = UART_CTS_PIN_MSK;
+    UART_CTS_PORT->PULLMODE |= 0b10 << (UART_CTS_PIN_POS * 2); // enable Pull Down
+#endif
+}
+
+int transport_sync()
+{
+    uint32_t ticks_counted;
+    uint32_t baud_i;
+    uint32_t baud_f;
+
+    //Waiting for the start bit - 0
+
+    if(wait_uart_rx(0) < 0){
+        return -1;
+    }
+    //turn on timer
+    UART_TMR->LOAD = 0xffffffffu;
+    UART_TMR->VALUE = UART_TMR->LOAD;
+    BIT_BAND_PER(UART_TMR->CTRL, TMR_CTRL_ON_Msk) = 1;
+    //We are waiting for the start of a group of seven 1 (0x7F)
+    if(wait_uart_rx(1) < 0){
+        return -1;
+    }
+
+    ticks_counted = UART_TMR->VALUE;
+    //Waiting for bit - 0
+    if(wait_uart_rx(0) < 0){
+        return -1;
+    }
+
+    ticks_counted -= UART_TMR->VALUE;
+    UART_TMR->CTRL_bit.ON = 0;
+    //calculate baudrate
+    baud_i = ticks_counted / (16 * 7);
+    baud_f = (uint32_t)((ticks_counted / (16.0f * 7.0f) - baud_i) * 64 + 0.5f);
+
+    //Waiting for stop bit - 1
+    if(wait_uart_rx(1) < 0){
+        return -1;
+    }
+    //turn on UART
+    UART->IBRD = baud_i;
+    UART->FBRD = baud_f;
+    UART->LCRH = (1 << UART_LCRH_FEN_Pos) | (3 << UART_LCRH_WLEN_Pos);
+    UART->CR = (1 << UART_CR_RXE_Pos) | (1 << UART_CR_TXE_Pos) | (1 << UART_CR_UARTEN_Pos);
+#if !BOOT_USE_MULTIDROP
+    //transmit the device signature with bytes swapped,
+    //nodes on a multidrop bus stay quiet until they are addressed
+    UART_DE_SET();
+    UART->DR = (PACKET_DEVICE_SIGN & 0xFF00) >> 8;
+    UART->DR = PACKET_DEVICE_SIGN & 0x00FF;
+    uart_tx_end();
+#endif
+
+    return 0;
+}
+
+void transport_tx_start()
+{
+    UART_DE_SET();
+}
+
+void transport_tx_pump()
+{
+    while (packet_tx_active() && !UART->FR_bit.TXFF && UART_CTS_ASSERTED()) {
+        UART->DR = packet_tx_next();
+        if (!packet_tx_active())
+            uart_tx_end();
+    }
+    //the TX interrupt wakes the core once the full FIFO has drained to its level,
+    //a byte held back by CTS is polled
+    if (packet_tx_active() && UART->FR_bit.TXFF) {
+        UART->ICR = UART_ICR_TXIC_Msk;
+        UART->IMSC |= UART_IMSC_TXIM_Msk;
+    }
+}
+
+uint32_t transport_tx_busy()
+{
+    return UART->FR_bit.BUSY | !UART->FR_bit.TXFE;
+}
+
+uint32_t transport_tx_waiting()
+{
+    return UART->IMSC & UART_IMSC_TXIM_Msk;
+}
+
+void transport_rx_resume()
+{
+#if BOOT_USE_FLOW_CTRL
+    if (uart_rts_off && (packet_fifo_fill() <= PACKET_FIFO_RTS_ON)) {
+        uart_rts_off = 0;
+        UART_RTS_ASSERT();
+    }
+#endif
+}
+
+void transport_stop()
+{
+    //the application gets the UART without the bootloader interrupt
+    NVIC_DisableIRQ(UART_RX_IRQn);
+    NVIC_DisableIRQ(UART_RT_IRQn);
+    NVIC_DisableIRQ(UART_TX_IRQn);
+    NVIC_ClearPendingIRQ(UART_RX_IRQn);
+    NVIC_ClearPendingIRQ(UART_RT_IRQn);
+    NVIC_ClearPendingIRQ(UART_TX_IRQn);
+}
+
+RAMFUNC void UART_RX_IRQHandler()
+{
+    UART->ICR = UART_ICR_RXIC_Msk;
+    uart_rx_drain();
+}
+
+RAMFUNC void UART_RT_IRQHandler()
+{
+    UART->ICR = UART_ICR_RTIC_Msk;
+    uart_rx_drain();
+}
+
+RAMFUNC void UART_TX_IRQHandler()
+{
+    //only wakes the core, transport_tx_pump() refills the FIFO
+    UART->IMSC &= ~UART_IMSC_TXIM_Msk;
+    UART->ICR = UART_ICR_TXIC_Msk;
+}
+
+#endif //BOOT_TRANSPORT == BOOT_TRANSPORT_UART
@@ -1,11 +1,14 @@
 #include "boot_core.h"
+#include "boot_transport.h"
+#include "boot_packet.h"
+#include "boot_app.h"
 
 static void DebugInit()
 {
 #ifdef DEBUG
     // configure service outputs for output
-    RCU->HCLKCFG = DBG_PORT_EN;
-    RCU->HRSTCFG = DBG_PORT_EN;
+    RCU->HCLKCFG |= DBG_PORT_EN;
+    RCU->HRSTCFG |= DBG_PORT_EN;
     DBG_PORT->DENSET = DBG_INFO_MSK << 8;
     DBG_PORT->OUTENSET = DBG_INFO_MSK << 8;
 #endif
@@ -21,47 +24,43 @@ static void FPUInit()
     }
 }
 
+#define PLLCFG(ref, n, m)   (((ref) << RCU_PLLCFG_REFSRC_Pos) | \
+                             ((n) << RCU_PLLCFG_N_Pos) | \
+                             ((m) << RCU_PLLCFG_M_Pos) | \
+                             (1 << RCU_PLLCFG_OD_Pos) | \
+                             (1 << RCU_PLLCFG_OUTEN_Pos))
+
 static void ClockInit()
 {
-    //Set up PLL at 100 MHz (from internal 8 MHz)
-    RCU->PLLCFG = (RCU_PLLCFG_REFSRC_OSICLK << RCU_PLLCFG_REFSRC_Pos) |
-                  (1 << RCU_PLLCFG_N_Pos) |
-                  (25 << RCU_PLLCFG_M_Pos) |
-                  (1 << RCU_PLLCFG_OD_Pos) |
-                  (1 << RCU_PLLCFG_OUTEN_Pos);
+    //AppStart() may have switched to the PLL already
+    if (RCU->SYSCLKSTAT_bit.SYSSTAT == RCU_SYSCLKCFG_SYSSEL_PLLCLK)
+        return;
+#if BOOT_CLK_SRC == BOOT_CLK_OSE
+    //Set up PLL at SYSCLK from the crystal, it does not lock when the crystal does not start
+    RCU->PLLCFG = PLLCFG(RCU_PLLCFG_REFSRC_OSECLK, BOOT_OSE_PLL_N, BOOT_PLL_M(BOOT_OSE_HZ, BOOT_OSE_PLL_N));
+    for (uint32_t i = 0; i < BOOT_OSE_START_LOOPS && !RCU->PLLCFG_bit.LOCK; ++i)
+        ;
+    if (!RCU->PLLCFG_bit.LOCK)
+#endif
+    //Set up PLL at SYSCLK from internal 8 MHz
+    RCU->PLLCFG = PLLCFG(RCU_PLLCFG_REFSRC_OSICLK, 1, BOOT_PLL_M(BOOT_OSI_HZ, 1));
     //Waiting for PLL to stabilize
     while (!RCU->PLLCFG_bit.LOCK)
         ;
-    // Set the number of waitstate for the flash drive = 4 (4*30 = 120 MHz max)
-    MFLASH->CTRL = 3 << MFLASH_CTRL_LAT_Pos;
+    // Set the number of waitstates for the flash drive, one per 30 MHz
+    MFLASH->CTRL = BOOT_FLASH_LAT << MFLASH_CTRL_LAT_Pos;
     // Change system frequency to PLL
     RCU->SYSCLKCFG = RCU_SYSCLKCFG_SYSSEL_PLLCLK << RCU_SYSCLKCFG_SYSSEL_Pos;
     //SystemCoreClockUpdate();
 
 }
 
-static void UartInit()
-{
-    UART_PORT->ALTFUNCSET = UART_PINS_MSK;
-    UART_PORT->DENSET = UART_PINS_MSK;
-
-    RCU->UARTCFG[UART_NUM].UARTCFG = (RCU_UARTCFG_UARTCFG_CLKSEL_PLLCLK << RCU_UARTCFG_UARTCFG_CLKSEL_Pos) |
-                                     (1 << RCU_UARTCFG_UARTCFG_CLKEN_Pos) |
-                                     (1 << RCU_UARTCFG_UARTCFG_RSTDIS_Pos);
-     UART->IFLS = UART_IFLS_RXIFLSEL_Lvl18 << UART_IFLS_RXIFLSEL_Pos |
-                  UART_IFLS_RXIFLSEL_Lvl18 << UART_IFLS_TXIFLSEL_Pos;
-    UART->IMSC = UART_MIS_RXMIS_Msk;
-    NVIC_EnableIRQ(UART_RX_IRQn);
-}
-
 
 void GpioInit(){
     BIT_BAND_PER(RCU->HCLKCFG, RCU_HCLKCFG_GPIOAEN_Msk) = 1;
     BIT_BAND_PER(RCU->HRSTCFG, RCU_HCLKCFG_GPIOAEN_Msk) = 1;
     BIT_BAND_PER(RCU->HCLKCFG, RCU_HCLKCFG_GPIOBEN_Msk) = 1;
     BIT_BAND_PER(RCU->HRSTCFG, RCU_HCLKCFG_GPIOBEN_Msk) = 1;
-    BOOTEN_PORT->DENSET = BOOTEN_PIN_MSK;
-    BOOTEN_PORT->PULLMODE = 0b01 << (BOOTEN_PIN_POS * 2); // enable Pull Up
 }
 void TimersInit(){
     BIT_BAND_PER(RCU->PRSTCFG, UART_TMR_EN_Msk) = 1;
@@ -76,23 +75,73 @@ void PeriphInit()
     DebugInit();
     FPUInit();
     ClockInit();
-    GpioInit();
-    UartInit();
+    transport_init();
     TimersInit();
 }
 
+/**
+ * \brief           Called by Reset_Handler before RAM is initialized, so it uses no variables and
+ *                  no ramfuncs. With BOOTEN high the application is started at once, at the reset clock.
+ */
+void BootenCheck()
+{
+    BIT_BAND_PER(RCU->HCLKCFG, RCU_HCLKCFG_GPIOAEN_Msk) = 1;
+    BIT_BAND_PER(RCU->HRSTCFG, RCU_HCLKCFG_GPIOAEN_Msk) = 1;
+    BOOTEN_PORT->DENSET = BOOTEN_PIN_MSK;
+    BOOTEN_PORT->PULLMODE = 0b01 << (BOOTEN_PIN_POS * 2); // enable Pull Up
+    for (uint32_t i = 0; i < BOOTEN_SETTLE_LOOPS; ++i){
+        __NOP();
+    }
+#if !BOOT_USE_APP_CHECK
+    //with BOOT_USE_APP_CHECK the image is checked by main() with RAM and the ramfuncs ready
+    if (BOOTEN_PORT->DATA & BOOTEN_PIN_MSK){
+        //flash_disable_boot() is a ramfunc, it is not in RAM yet
+        MFLASH->BDIS = MFLASH_BDIS_BMDIS_Msk;
+        NVIC_SystemReset();
+    }
+#endif
+}
+
+#if BOOT_USE_APP_CHECK
+/**
+ * \brief           BOOTEN is high: start the application if its image is intact. The header and the
+ *                  marker are read at the reset clock, the full digest runs at 100 MHz only when the
+ *                  marker is missing and leaves it for the next boot. Returns only for a bad image,
+ *                  which keeps the bootloader.
+ */
+static void AppStart()
+{
+    AppHeader_TypeDef hdr;
+
+    if (!app_header(&hdr))
+        return;
+    if (!app_marked(&hdr)) {
+        ClockInit();
+        crc_init();
+        if (app_digest(&hdr) != (uint16_t)hdr.crc)
+            return;
+        app_mark(&hdr);
+    }
+    boot_exit();
+}
+#endif
 
 int main()
 {
-    PeriphInit();
-    
-    if ((BOOTEN_PORT->DATA & BOOTEN_PIN_MSK) > 0){
-        boot_exit();
+    uint32_t app_rejected = 0;
+
+#if BOOT_USE_APP_CHECK
+    if (BOOTEN_PORT->DATA & BOOTEN_PIN_MSK) {
+        AppStart();
+        app_rejected = 1;
     }
+#endif
+    PeriphInit();
 
-    
-    if(boot_init() < 0){
-        boot_exit();
+    //a rejected image is not started when the host is silent, the bootloader waits for it
+    while (boot_init() < 0) {
+        if (!app_rejected)
+            boot_exit();
     }
 
     boot_core();
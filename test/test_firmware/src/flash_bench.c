@@ -0,0 +1,47 @@
+/**
+ * \file            flash_bench.c
+ * \brief           Read throughput of boot_flash.c built into an application (env:vostok_uno_vn035_flashbench):
+ *                  main flash with loads against NVR through MFLASH commands.
+ * \copyright       DC Vostok Vladivostok 2023
+ */
+#ifdef FLASH_BENCH
+#include "boot_flash.h"
+
+static uint32_t bench_buf[FLASH_PAGE_SIZE_BYTES / 4];
+
+static uint32_t bench_cycles(uint32_t addr, FlashType_TypeDef ftype, uint32_t block)
+{
+    uint32_t t0;
+    uint32_t t;
+
+    __disable_irq();
+    t0 = DWT->CYCCNT;
+    for (uint32_t i = 0; i < 16; i++) {
+        if (block)
+            flash_read_block(addr, ftype, bench_buf, FLASH_PAGE_SIZE_BYTES);
+        else
+            for (uint32_t j = 0; j < FLASH_PAGE_SIZE_BYTES / 8; j++)
+                flash_read(addr + j * 8, ftype, &bench_buf[j * 2]);
+    }
+    t = DWT->CYCCNT - t0;
+    __enable_irq();
+    return t / 16;
+}
+
+static void bench_print(const char* name, uint32_t cycles)
+{
+    printf("%-26s %6lu cycles/kB %6lu kB/s\n", name, cycles, SystemCoreClock / cycles);
+}
+
+void flash_bench()
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    bench_print("nvr flash_read", bench_cycles(FLASH_NVR_CFGWORD_OFFSET, FLASH_NVR, 0));
+    bench_print("nvr flash_read_block", bench_cycles(FLASH_NVR_CFGWORD_OFFSET, FLASH_NVR, 1));
+    bench_print("main flash_read", bench_cycles(0, FLASH_MAIN, 0));
+    bench_print("main flash_read_block", bench_cycles(0, FLASH_MAIN, 1));
+}
+#endif
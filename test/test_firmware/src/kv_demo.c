@@ -0,0 +1,24 @@
+/**
+ * \file            kv_demo.c
+ * \brief           Key-value log of boot_kv.c built into an application (env:vostok_uno_vn035_kv):
+ *                  a reset counter under key 0, read back by the bootloader with tools/nvr_kv.py get 0.
+ * \copyright       DC Vostok Vladivostok 2023
+ */
+#ifdef KV_DEMO
+#include "boot_kv.h"
+
+#define KV_DEMO_KEY 0
+
+void kv_demo()
+{
+    uint32_t resets = 0;
+
+    if (!kv_get(KV_DEMO_KEY, &resets))
+        printf("key %d was never written\n", KV_DEMO_KEY);
+    resets++;
+    if (!kv_set(KV_DEMO_KEY, resets) || !kv_get(KV_DEMO_KEY, &resets))
+        printf("key %d write failed\n", KV_DEMO_KEY);
+    else
+        printf("reset %lu\n", resets);
+}
+#endif
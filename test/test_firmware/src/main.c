@@ -1,6 +1,13 @@
 #include "plib035.h"
 #include "retarget_conf.h"
 
+#ifdef FLASH_BENCH
+void flash_bench();
+#endif
+#ifdef KV_DEMO
+void kv_demo();
+#endif
+
 #define LED_PIN (GPIO_Pin_5)
 #define LED_PORT (GPIOB)
 
@@ -33,6 +40,12 @@ int main()
     periph_init();
     printf("All periph inited\n");
     printf("CPU frequency is %lu MHz\n", SystemCoreClock / (int)1E6);
+#ifdef FLASH_BENCH
+    flash_bench();
+#endif
+#ifdef KV_DEMO
+    kv_demo();
+#endif
 
     while(1){
        // __WFI();
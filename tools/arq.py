@@ -0,0 +1,181 @@
+"""
+Host side of the selective repeat page transfer.
+
+CMD_ARQ_WRITE frames carry a page plus a sequence number and are not
+answered; the device programs every correct frame as soon as it is read from
+its FIFO and marks the sequence number in a window of ARQ_WINDOW frames.
+CMD_ARQ_POLL slides that window and returns the bitmap of programmed frames,
+so every zero bit below the last frame sent before the poll names a frame
+that was lost and only those frames are sent again.
+
+The sender never has more than `budget` bytes unconfirmed by a poll answer,
+which keeps the device FIFO (PACKET_FIFO_BYTES) from overflowing while the
+flash is busy.
+"""
+
+import collections
+import struct
+
+import bootproto as bp
+
+
+class _Poll:
+    __slots__ = ("tag", "index", "base", "reset", "sent_total", "time")
+
+    def __init__(self, tag, index, base, reset, sent_total, time):
+        self.tag = tag
+        self.index = index
+        self.base = base
+        self.reset = reset
+        self.sent_total = sent_total
+        self.time = time
+
+
+class ArqSender:
+    """
+    Transport independent state machine for one transfer.
+
+    frames are prebuilt CMD_ARQ_WRITE frames, the list index is the sequence
+    number. The owner calls pump() whenever it can write, on_answer() for every
+    device frame and on_timeout() once `deadline` has passed.
+    """
+
+    def __init__(self, frames, framing=bp.FRAMING_SIGN, budget=bp.PACKET_FIFO_BYTES,
+                 group=2, timeout=0.5, retries=5, window=bp.ARQ_WINDOW):
+        self.frames = frames
+        self.framing = framing
+        self.budget = budget
+        self.group = group
+        self.timeout = timeout
+        self.retries = retries
+        self.window = window
+        self.acked = [False] * len(frames)
+        self.sent_epoch = [-1] * len(frames)
+        self.base = 0
+        # window base of the last poll sent, the device uses it for all later frames
+        self.poll_base = 0
+        self.next_new = 0
+        self.retx = collections.deque()
+        self.queued = set()
+        self.polls = collections.deque()
+        self.poll_count = 0
+        self.tag = 0
+        self.sent_total = 0
+        self.confirmed = 0
+        self.since_poll = 0
+        self.synced = False
+        self.timeouts = 0
+        self.error = None
+        # statistics
+        self.sent_frames = 0
+        self.resent_frames = 0
+
+    @property
+    def done(self):
+        return self.synced and self.base >= len(self.frames)
+
+    @property
+    def deadline(self):
+        return self.polls[0].time + self.timeout if self.polls else None
+
+    # -- sending ----------------------------------------------------------
+    def _poll(self, now, reset=False):
+        self.tag = self.tag % 0x7FFF + 1
+        self.poll_base = self.base
+        frame = bp.frame_arq_poll(self.base, self.tag, reset, self.framing)
+        self.sent_total += len(frame)
+        self.polls.append(_Poll(self.tag, self.poll_count, self.base, reset,
+                                self.sent_total, now))
+        self.poll_count += 1
+        self.since_poll = 0
+        return frame
+
+    def _peek(self):
+        while self.retx and self.acked[self.retx[0]]:
+            self.queued.discard(self.retx.popleft())
+        if self.retx:
+            return self.retx[0]
+        if self.next_new < len(self.frames) and self.next_new < self.poll_base + self.window:
+            return self.next_new
+        return None
+
+    def _take(self, seq):
+        if self.retx and self.retx[0] == seq:
+            self.queued.discard(self.retx.popleft())
+        else:
+            self.next_new += 1
+
+    def pump(self, now):
+        """Frames to send now, as many as the budget allows."""
+        out = []
+        if self.error is not None or self.done:
+            return out
+        if not self.synced:
+            # the window of the device is unknown until the reset is answered
+            if not self.polls:
+                out.append(self._poll(now, reset=True))
+            return out
+        while True:
+            seq = self._peek()
+            if seq is None or self.sent_total + len(self.frames[seq]) - self.confirmed > self.budget:
+                break
+            self._take(seq)
+            frame = self.frames[seq]
+            if self.sent_epoch[seq] >= 0:
+                self.resent_frames += 1
+            self.sent_epoch[seq] = self.poll_count
+            self.sent_total += len(frame)
+            self.sent_frames += 1
+            self.since_poll += 1
+            out.append(frame)
+            if self.since_poll >= self.group:
+                out.append(self._poll(now))
+        # nothing to wait for: ask for the status or move the window on
+        if not self.polls and (self.base < self.next_new or self.poll_base != self.base):
+            out.append(self._poll(now))
+        return out
+
+    # -- receiving --------------------------------------------------------
+    def on_answer(self, frame, now):
+        if not frame.crc_ok or frame.cmd != bp.CMD_MSG:
+            return
+        if frame.msg_cmd == bp.CMD_ARQ_WRITE and frame.status == bp.MSG_FAIL:
+            seq = struct.unpack_from("<I", frame.msg_data, 0)[0] if len(frame.msg_data) >= 4 else -1
+            self.error = "frame %d refused by device" % seq
+            return
+        if frame.msg_cmd != bp.CMD_ARQ_POLL or frame.status != bp.MSG_OK or len(frame.msg_data) < 8:
+            return
+        word, bits = struct.unpack_from("<II", frame.msg_data, 0)
+        tag = (word >> 17) & 0x7FFF
+        if not any(p.tag == tag for p in self.polls):
+            return
+        # answers come in order, polls before this one have lost their answer
+        while True:
+            poll = self.polls.popleft()
+            if poll.tag == tag:
+                break
+        self.timeouts = 0
+        self.confirmed = max(self.confirmed, poll.sent_total)
+        if poll.reset:
+            self.synced = True
+        for i in range(self.window):
+            seq = poll.base + i
+            if seq < len(self.frames) and bits & (1 << i):
+                self.acked[seq] = True
+        # frames sent before this poll and not programmed are lost
+        for seq in range(self.base, self.next_new):
+            if not self.acked[seq] and 0 <= self.sent_epoch[seq] <= poll.index \
+                    and seq not in self.queued:
+                self.retx.append(seq)
+                self.queued.add(seq)
+        while self.base < len(self.frames) and self.acked[self.base]:
+            self.base += 1
+
+    def on_timeout(self, now):
+        """Poll answers are overdue: assume the FIFO drained and poll again."""
+        self.timeouts += 1
+        if self.timeouts > self.retries:
+            self.error = "no poll answer after %d tries" % self.timeouts
+            return
+        self.polls.clear()
+        self.confirmed = self.sent_total
@@ -0,0 +1,295 @@
+#!/usr/bin/env python3
+"""
+Throughput of stop-and-wait against selective repeat under bit errors.
+
+Runs the host strategies against the DeviceModel of boot_sim.py in virtual
+time: both UART directions are modelled at the given baudrate with injected
+bit errors, the device FIFO (PACKET_FIFO_BYTES) overflows when the host sends
+too far ahead, and flash timings come from boot_flash.c. After every run the
+simulated flash is compared with the image.
+
+    arq_bench.py --baud 921600 --pages 64 --ber 0,1e-5,1e-4
+    arq_bench.py -i firmware.bin --framing cobs
+"""
+
+import argparse
+import heapq
+import itertools
+import random
+import struct
+import sys
+
+import bootproto as bp
+import boot_sim
+import image_plan
+from arq import ArqSender
+
+
+class Sim:
+    """Event queue in virtual time."""
+
+    def __init__(self):
+        self.now = 0.0
+        self.events = []
+        self.seq = itertools.count()
+
+    def call_at(self, when, fn, *args):
+        heapq.heappush(self.events, (when, next(self.seq), fn, args))
+
+    def run(self, done, limit):
+        while self.events and not done():
+            when, _, fn, args = heapq.heappop(self.events)
+            if when > limit:
+                return False
+            self.now = when
+            fn(*args)
+        return done()
+
+
+class Wire:
+    """One direction of the UART: serialises characters and adds noise."""
+
+    def __init__(self, sim, baud, noise):
+        self.sim = sim
+        self.byte_time = 10.0 / baud
+        self.free = 0.0
+        self.noise = noise
+
+    def send(self, data, fn, when=None):
+        start = max(self.sim.now if when is None else when, self.free)
+        self.free = start + len(data) * self.byte_time
+        self.sim.call_at(self.free, fn, self.noise.apply(data))
+        return self.free
+
+
+class Device:
+    """DeviceModel behind the FIFO of boot_packet.c."""
+
+    def __init__(self, sim, uplink, framing, fifo_bytes):
+        self.sim = sim
+        self.uplink = uplink
+        self.model = boot_sim.DeviceModel()
+        self.model.framing = framing
+        if framing == bp.FRAMING_COBS:
+            self.parser = bp.CobsFrameParser(bp.PACKET_HOST_SIGN)
+        else:
+            self.parser = bp.FrameParser(bp.PACKET_HOST_SIGN, bp.PACKET_TMP_DATA_BYTES)
+        self.fifo_bytes = fifo_bytes
+        self.backlog = []
+        self.cpu_free = 0.0
+        self.overflows = 0
+        self.host = None
+
+    def receive(self, data):
+        now = self.sim.now
+        # bytes stay in the FIFO until packet_poll() gets to their packet
+        self.backlog = [(t, n) for t, n in self.backlog if t > now]
+        room = self.fifo_bytes - sum(n for _, n in self.backlog)
+        if room < len(data):
+            self.overflows += 1
+            data = data[:max(room, 0)]
+        self.backlog.append((max(now, self.cpu_free), len(data)))
+        for frame in self.parser.feed(data):
+            answers, busy = self.model.handle(frame)
+            done = max(now, self.cpu_free) + busy
+            out = b"".join(answers)
+            if out:
+                # packet_poll() takes the next frame once the answer is sent
+                done = self.uplink.send(out, self.host.receive, done)
+            self.cpu_free = done
+
+
+class Host:
+    def __init__(self, sim, downlink, device, framing):
+        self.sim = sim
+        self.downlink = downlink
+        self.device = device
+        self.framing = framing
+        self.parser = bp.make_parser(framing)
+        self.finished = None
+        self.error = None
+        self.sent_frames = 0
+        self.resent_frames = 0
+
+    def send(self, frame):
+        self.downlink.send(frame, self.device.receive)
+
+    @property
+    def done(self):
+        return self.finished is not None or self.error is not None
+
+
+class StopAndWaitHost(Host):
+    """CMD_WRITE_PAGE, one page per round trip, resent on any error."""
+
+    def __init__(self, sim, downlink, device, framing, pages, timeout):
+        super().__init__(sim, downlink, device, framing)
+        self.frames = [bp.build_frame(bp.CMD_WRITE_PAGE, struct.pack(
+            "<I", bp.addr_word(addr, False, True)) + data, framing=framing)
+            for addr, data in pages]
+        self.words = [struct.pack("<I", bp.addr_word(addr, False, True)) for addr, _ in pages]
+        self.timeout = timeout
+        self.i = 0
+        self.last = None
+        self.waiting = False
+        self.timer = 0
+
+    def start(self):
+        self.transmit()
+
+    def transmit(self):
+        if self.last == self.i:
+            self.resent_frames += 1
+        self.last = self.i
+        self.sent_frames += 1
+        self.send(self.frames[self.i])
+        self.waiting = True
+        self.timer += 1
+        self.sim.call_at(self.downlink.free + self.timeout, self.on_timer, self.timer)
+
+    def on_timer(self, timer):
+        if timer == self.timer and not self.done:
+            self.transmit()
+
+    def receive(self, data):
+        for frame in self.parser.feed(data):
+            # one request in flight, answers after a timeout belong to an older try
+            if self.done or not self.waiting:
+                return
+            self.waiting = False
+            if frame.crc_ok and frame.cmd == bp.CMD_MSG and frame.status == bp.MSG_OK \
+                    and frame.msg_cmd == bp.CMD_WRITE_PAGE and frame.msg_data[:4] == self.words[self.i]:
+                self.i += 1
+                if self.i == len(self.frames):
+                    self.finished = self.sim.now
+                    return
+            # MSG_ERR_CRC, MSG_ERR_CMD or a damaged answer: send the page again
+            self.transmit()
+
+
+class SelectiveRepeatHost(Host):
+    """CMD_ARQ_WRITE stream driven by ArqSender."""
+
+    def __init__(self, sim, downlink, device, framing, pages, timeout, group):
+        super().__init__(sim, downlink, device, framing)
+        frames = [bp.frame_arq_write(i, addr, data, False, True, framing)
+                  for i, (addr, data) in enumerate(pages)]
+        self.arq = ArqSender(frames, framing, group=group, timeout=timeout, retries=1000)
+        self.timer_at = None
+
+    def start(self):
+        self.pump()
+
+    def pump(self):
+        for frame in self.arq.pump(self.sim.now):
+            self.send(frame)
+        self.sent_frames = self.arq.sent_frames
+        self.resent_frames = self.arq.resent_frames
+        if self.arq.error is not None:
+            self.error = self.arq.error
+        elif self.arq.done:
+            self.finished = self.sim.now
+        deadline = self.arq.deadline
+        if deadline is not None and deadline != self.timer_at:
+            self.timer_at = deadline
+            self.sim.call_at(deadline, self.on_timer)
+
+    def on_timer(self):
+        deadline = self.arq.deadline
+        if self.done or deadline is None or self.sim.now < deadline:
+            return
+        self.arq.on_timeout(self.sim.now)
+        self.pump()
+
+    def receive(self, data):
+        for frame in self.parser.feed(data):
+            self.arq.on_answer(frame, self.sim.now)
+        if not self.done:
+            self.pump()
+
+
+def run_once(mode, pages, opts, ber, seed):
+    sim = Sim()
+    rng = random.Random(seed)
+    downlink = Wire(sim, opts.baud, boot_sim.Noise(ber, rng.random()))
+    uplink = Wire(sim, opts.baud, boot_sim.Noise(ber, rng.random()))
+    device = Device(sim, uplink, opts.framing_code, bp.PACKET_FIFO_BYTES)
+    frame_time = (bp.FLASH_PAGE_SIZE_BYTES + 16) * downlink.byte_time
+    if mode == "saw":
+        # tight timeout of a tuned host: frame, erase and program, answer
+        timeout = 2 * frame_time + bp.FLASH_T_ERASE_PAGE + \
+            bp.FLASH_PAGE_SIZE_BYTES // 8 * bp.FLASH_T_WRITE_DWORD + 0.005
+        host = StopAndWaitHost(sim, downlink, device, opts.framing_code, pages, timeout)
+    else:
+        timeout = 10 * (frame_time + bp.FLASH_T_ERASE_PAGE) + 0.01
+        host = SelectiveRepeatHost(sim, downlink, device, opts.framing_code, pages,
+                                   timeout, opts.group)
+    device.host = host
+    host.start()
+    sim.run(lambda: host.done, opts.limit)
+    ok = host.finished is not None and all(
+        device.model.main[addr:addr + len(data)] == data for addr, data in pages)
+    return ok, host.finished if ok else None, host, device
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("-i", "--image", help="image to send (default random pages)")
+    ap.add_argument("-a", "--address", type=lambda s: int(s, 0), default=0)
+    ap.add_argument("--pages", type=int, default=bp.FLASH_APP_PAGE_TOTAL,
+                    help="random pages when no image is given")
+    ap.add_argument("-b", "--baud", type=int, default=921600)
+    ap.add_argument("--ber", default="0,1e-6,1e-5,3e-5,1e-4",
+                    help="comma separated bit error rates")
+    ap.add_argument("--framing", choices=("sign", "cobs"), default="sign")
+    ap.add_argument("--group", type=int, default=2, help="ARQ frames per poll")
+    ap.add_argument("--runs", type=int, default=3, help="runs per point, averaged")
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--limit", type=float, default=600.0, help="virtual time limit per run, s")
+    opts = ap.parse_args()
+    opts.framing_code = bp.FRAMING_COBS if opts.framing == "cobs" else bp.FRAMING_SIGN
+
+    if opts.image:
+        try:
+            plan = image_plan.load(opts.image, opts.address)
+        except (image_plan.ImageError, OSError) as e:
+            print("%s: %s" % (opts.image, e), file=sys.stderr)
+            return 1
+        pages = [(p.addr, p.data) for p in plan.pages if not p.nvr]
+    else:
+        rng = random.Random(opts.seed)
+        pages = [(i * bp.FLASH_PAGE_SIZE_BYTES,
+                  bytes(rng.getrandbits(8) for _ in range(bp.FLASH_PAGE_SIZE_BYTES)))
+                 for i in range(opts.pages)]
+    total = len(pages) * bp.FLASH_PAGE_SIZE_BYTES
+
+    print("%d pages, %d baud, %s framing, %d runs per point" %
+          (len(pages), opts.baud, opts.framing, opts.runs))
+    print("%-8s  %-28s  %-28s  %s" % ("ber", "stop-and-wait", "selective repeat", "gain"))
+    status = 0
+    for ber in (float(b) for b in opts.ber.split(",")):
+        row = []
+        for mode in ("saw", "arq"):
+            times, resent, sent = [], 0, 0
+            for run in range(opts.runs):
+                ok, t, host, _ = run_once(mode, pages, opts, ber, opts.seed * 1000 + run)
+                sent += host.sent_frames
+                resent += host.resent_frames
+                if not ok:
+                    status = 1
+                    times = None
+                    break
+                times.append(t)
+            if times is None:
+                row.append((None, "FAILED %s" % (host.error or "time limit")))
+            else:
+                avg = sum(times) / len(times)
+                row.append((avg, "%7.1f kB/s  %5.1f%% resent" %
+                            (total / avg / 1024, 100.0 * resent / max(sent, 1))))
+        gain = "%.2fx" % (row[0][0] / row[1][0]) if row[0][0] and row[1][0] else "-"
+        print("%-8g  %-28s  %-28s  %s" % (ber, row[0][1], row[1][1], gain))
+    return status
+
+
+if __name__ == "__main__":
+    sys.exit(main())
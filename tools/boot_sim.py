@@ -0,0 +1,1192 @@
+#!/usr/bin/env python3
+"""
+Simulated K1921VK035 bootloader devices on pseudo terminals.
+
+Every device gets its own pty; host tools open the printed slave path exactly
+like a real serial port. All devices are served from one event loop, and the
+UART line rate plus the flash timings of boot_flash.c are modelled so that
+host-side throughput numbers are meaningful.
+
+With --bus N a single pty is an RS-485 bus of N multidrop nodes with the
+addresses 1..N; answers of nodes talking at the same time collide.
+
+With --spi HZ the devices are BOOT_TRANSPORT_SPI builds clocked by a host MCU
+at HZ: 8 clocks per byte and no auto-baud, the pty stands in for the host
+driver that clocks the frames and polls for the answers.
+
+    boot_sim.py -n 8 --baud 460800 --rearm 0.2
+    boot_sim.py --bus 16 --baud 460800
+    boot_sim.py --spi 8000000
+"""
+
+import argparse
+import heapq
+import itertools
+import os
+import random
+import selectors
+import signal
+import struct
+import sys
+import time
+import tty
+
+import bootproto as bp
+
+CHIPID = 0x0F035001
+CPUID = 0x410FC241
+BOOT_VER = (0x0001 << 16) | 0x0003
+BOOT_NAME = b"K1921VK035_BOOTLOADER"
+# crc_upd() in boot_packet.c costs about 40 cycles per byte at 100 MHz
+T_CRC_BYTE = 0.4e-6
+# the RX interrupt checks the CRC as bytes arrive, packet_poll() only copies the data
+T_COPY_BYTE = 0.05e-6
+# SSP of the K1921VK035 follows a host clock up to SYSCLK / 12 in slave mode
+SPI_SCK_MAX = 100e6 / 12
+
+
+class DeviceModel:
+    """
+    Protocol behaviour of boot_core.c without any I/O.
+
+    handle() takes a host frame and returns (answer frames, busy seconds).
+    A node_addr makes it a BOOT_USE_MULTIDROP build, legacy a bootloader
+    from before CMD_GET_INFO_EXT with one page per packet, ram_run a
+    BOOT_USE_RAM_RUN build with one page per packet, app_check a
+    BOOT_USE_APP_CHECK build. Otherwise it has every command of the
+    full profile (env:generic_K1921VK035_full).
+    """
+
+    # commands a legacy bootloader answers with MSG_ERR_CMD
+    LEGACY_MISSING = {bp.CMD_GET_INFO_EXT, bp.CMD_WRITE_PAGES, bp.CMD_READ_PAGES,
+                      bp.CMD_GET_JOURNAL, bp.CMD_KV_GET, bp.CMD_KV_SET,
+                      bp.CMD_ERASE_RANGE, bp.CMD_WRITE_SESSION, bp.CMD_BATCH,
+                      bp.CMD_ECHO, bp.CMD_TEST_STREAM}
+    # commands only BOOT_USE_RAM_RUN builds have
+    RAM_RUN_CMDS = {bp.CMD_RAM_WRITE, bp.CMD_RAM_RUN}
+    # commands only BOOT_USE_APP_CHECK builds have
+    APP_CHECK_CMDS = {bp.CMD_VALIDATE}
+
+    def __init__(self, cfgword=0xFFFFFFFF, node_addr=None, legacy=False, ram_run=False,
+                 app_check=False):
+        self.main = bytearray(b"\xFF" * bp.FLASH_TOTAL_BYTES)
+        self.nvr = bytearray(b"\xFF" * bp.FLASH_NVR_TOTAL_BYTES)
+        struct.pack_into("<I", self.nvr, bp.FLASH_NVR_CFGWORD_OFFSET, cfgword)
+        self.exited = False
+        self.framing = bp.FRAMING_SIGN
+        self.arq_base = 0
+        self.arq_bits = 0
+        # page cache of boot_flash.c: [addr, nvr, data, dirty] or None
+        self.cache = None
+        self.node_addr = node_addr
+        self.page_status = [set(), set()]
+        self.pages_written = 0
+        self.legacy = legacy
+        self.ram_run = ram_run and not legacy
+        self.app_check = app_check and not legacy
+        # pages above the application hold the journal
+        self.app_pages = bp.FLASH_PAGE_TOTAL if legacy else bp.FLASH_APP_PAGE_TOTAL
+        self.pages_max = 1 if legacy or self.ram_run else bp.PACKET_PAGES_MAX
+        self.data_max = self.pages_max * bp.FLASH_PAGE_SIZE_BYTES + 8
+        self.fifo_bytes = bp.PACKET_FIFO_BYTES
+        if self.ram_run:
+            # the RAM application takes its size from the RX ring
+            self.fifo_bytes += (bp.PACKET_PAGES_MAX - 1) * bp.FLASH_PAGE_SIZE_BYTES - bp.RAM_APP_BYTES
+        self.ram = bytearray(bp.RAM_APP_BYTES)
+        # packet_stats: frames, crc_errors, hdr_errors, lost
+        self.stats = [0, 0, 0, 0]
+        # CMD_WRITE_SESSION: [start, end, nvr, next, ahead] or None
+        self.session = None
+        # seconds the flash is still erasing after the answer of the last command
+        self.background = 0.0
+
+    # -- flash primitives ---------------------------------------------------
+    def _mem(self, nvr):
+        return self.nvr if nvr else self.main
+
+    def cfgword(self):
+        return struct.unpack_from("<I", self.nvr, bp.FLASH_NVR_CFGWORD_OFFSET)[0]
+
+    def _access(self, addr, nvr, write):
+        cfg = self.cfgword()
+        if nvr:
+            en = cfg & (bp.CFGWORD_NVRWE_MSK if write else bp.CFGWORD_NVRRE_MSK)
+            if addr < bp.FLASH_NVR_BOOT_PAGES * bp.FLASH_PAGE_SIZE_BYTES:
+                en = 0
+        else:
+            en = cfg & (bp.CFGWORD_FLASHWE_MSK if write else bp.CFGWORD_FLASHRE_MSK)
+        if nvr:
+            limit = bp.FLASH_NVR_TOTAL_BYTES
+        else:
+            limit = self.app_pages * bp.FLASH_PAGE_SIZE_BYTES if write else bp.FLASH_TOTAL_BYTES
+        return bool(en) and addr < limit
+
+    def erase_page(self, addr, nvr):
+        mem = self._mem(nvr)
+        base = addr & ~(bp.FLASH_PAGE_SIZE_BYTES - 1)
+        mem[base:base + bp.FLASH_PAGE_SIZE_BYTES] = b"\xFF" * bp.FLASH_PAGE_SIZE_BYTES
+
+    def program(self, addr, nvr, data):
+        # programming can only clear bits
+        mem = self._mem(nvr)
+        for i, b in enumerate(data):
+            mem[addr + i] &= b
+
+    def cache_write(self, addr, nvr, data):
+        page = addr & ~(bp.FLASH_PAGE_SIZE_BYTES - 1)
+        busy = 0.0
+        if self.cache is None or self.cache[0] != page or self.cache[1] != nvr:
+            busy = self.cache_flush()
+            mem = self._mem(nvr)
+            self.cache = [page, nvr, bytearray(mem[page:page + bp.FLASH_PAGE_SIZE_BYTES]), False]
+        off = addr - page
+        self.cache[2][off:off + len(data)] = data
+        self.cache[3] = True
+        return busy
+
+    def cache_flush(self):
+        """flash_cache_flush(): erase only when programmed bytes change."""
+        cache, self.cache = self.cache, None
+        if cache is None or not cache[3]:
+            return 0.0
+        page, nvr, data, _ = cache
+        mem = self._mem(nvr)
+        old = mem[page:page + bp.FLASH_PAGE_SIZE_BYTES]
+        busy = 0.0
+        erase = any(old[i:i + 8] != data[i:i + 8] and old[i:i + 8] != b"\xFF" * 8
+                    for i in range(0, bp.FLASH_PAGE_SIZE_BYTES, 8))
+        if erase:
+            self.erase_page(page, nvr)
+            busy += bp.FLASH_T_ERASE_PAGE
+        for i in range(0, bp.FLASH_PAGE_SIZE_BYTES, 8):
+            if mem[page + i:page + i + 8] != data[i:i + 8]:
+                self.program(page + i, nvr, data[i:i + 8])
+                busy += bp.FLASH_T_WRITE_DWORD
+        return busy
+
+    # -- progress journal, boot_journal.c -----------------------------------
+    def _journal_words(self):
+        off = bp.JOURNAL_ADDR
+        return [struct.unpack_from("<II", self.main, off + i * 8) for i in range(bp.JOURNAL_ENTRY_TOTAL)]
+
+    @staticmethod
+    def _journal_tag(entry):
+        if entry[1] >> 16 != ~entry[1] & 0xFFFF:
+            return 0
+        return entry[0] & bp.JOURNAL_TAG_MSK
+
+    def _journal_scan(self):
+        """(first entry of the session, first blank entry)"""
+        start = 0
+        words = self._journal_words()
+        for i, e in enumerate(words):
+            if e[0] & e[1] == 0xFFFFFFFF:
+                return start, i
+            if self._journal_tag(e) == bp.JOURNAL_TAG_CLEAR:
+                start = i + 1
+        return start, len(words)
+
+    def journal_entries(self):
+        start, end = self._journal_scan()
+        return [e for e in self._journal_words()[start:end] if self._journal_tag(e)]
+
+    def _journal_compact(self, start, drop_page):
+        words = self._journal_words()
+        keep = []
+        for i in range(start, len(words)):
+            page = words[i][0] & 0xFFFF
+            if self._journal_tag(words[i]) != bp.JOURNAL_TAG_WRITTEN or page == drop_page:
+                continue
+            if any(self._journal_tag(e) and e[0] & 0xFFFF == page for e in words[i + 1:]):
+                continue
+            keep.append(words[i])
+        blob = b"".join(struct.pack("<II", *e) for e in keep)
+        off = bp.JOURNAL_ADDR
+        self.main[off:off + bp.FLASH_PAGE_SIZE_BYTES] = blob + b"\xFF" * (bp.FLASH_PAGE_SIZE_BYTES - len(blob))
+        busy = bp.FLASH_T_ERASE_PAGE + bp.FLASH_PAGE_SIZE_BYTES // 8 * bp.FLASH_T_WRITE_DWORD
+        return len(keep), busy
+
+    def journal_append(self, word, crc):
+        if self.legacy:
+            return 0.0
+        busy = self.cache_flush()
+        start, end = self._journal_scan()
+        if end == bp.JOURNAL_ENTRY_TOTAL:
+            end, t = self._journal_compact(start, word & 0xFFFF)
+            busy += t
+        entry = struct.pack("<II", word, crc | ((~crc & 0xFFFF) << 16))
+        self.program(bp.JOURNAL_ADDR + end * 8, False, entry)
+        return busy + bp.FLASH_T_WRITE_DWORD
+
+    def journal_stale(self, page):
+        last = 0
+        for e in self.journal_entries():
+            if self._journal_tag(e) != bp.JOURNAL_TAG_CLEAR and e[0] & 0xFFFF == page:
+                last = self._journal_tag(e)
+        if last != bp.JOURNAL_TAG_WRITTEN:
+            return 0.0
+        return self.journal_append(bp.JOURNAL_TAG_STALE | page, 0)
+
+    def journal_clear(self):
+        if self.legacy:
+            return 0.0
+        start, end = self._journal_scan()
+        if start == end:
+            return 0.0
+        if end == bp.JOURNAL_ENTRY_TOTAL:
+            return self._journal_compact(bp.JOURNAL_ENTRY_TOTAL, 0)[1]
+        return self.journal_append(bp.JOURNAL_TAG_CLEAR, 0)
+
+    # -- key-value log, boot_kv.c -------------------------------------------
+    def _kv_page(self):
+        """(active page, generation), page None when the log was never written"""
+        gen = []
+        for page in (0, 1):
+            magic, word = struct.unpack_from("<II", self.main, bp.kv_page_addr(page))
+            gen.append(word & 0xFFFF if (magic, word) == bp.kv_header(word) else None)
+        if gen[1] is not None and (gen[0] is None or 0 < (gen[1] - gen[0]) & 0xFFFF < 0x8000):
+            return 1, gen[1]
+        return (0, gen[0]) if gen[0] is not None else (None, 0)
+
+    def _kv_words(self, page):
+        off = bp.kv_page_addr(page) + 8
+        return [struct.unpack_from("<II", self.main, off + i * 8) for i in range(bp.KV_RECORD_TOTAL)]
+
+    def _kv_scan(self, page):
+        """({key: record}, first blank record)"""
+        slot = {}
+        if page is None:
+            return slot, 0
+        words = self._kv_words(page)
+        for i, (value, word) in enumerate(words):
+            if value & word == 0xFFFFFFFF:
+                return slot, i
+            key = word & 0xFF
+            if key < bp.KV_KEY_TOTAL and word == bp.kv_record(key, value):
+                slot[key] = i
+        return slot, len(words)
+
+    def kv_values(self):
+        page = self._kv_page()[0]
+        if page is None:
+            return {}
+        words = self._kv_words(page)
+        return {key: words[i][0] for key, i in self._kv_scan(page)[0].items()}
+
+    def kv_get(self, key):
+        return self.kv_values().get(key) if key < bp.KV_KEY_TOTAL else None
+
+    def kv_set(self, key, value):
+        """Busy seconds, None for a key out of range."""
+        if key >= bp.KV_KEY_TOTAL:
+            return None
+        if self.kv_get(key) == value:
+            return 0.0
+        busy = 0.0
+        page, gen = self._kv_page()
+        slot, end = self._kv_scan(page)
+        if page is None or end == bp.KV_RECORD_TOTAL:
+            # the other page takes the last record of every key, its header is programmed last
+            keep = [self._kv_words(page)[slot[k]] for k in sorted(slot)]
+            page = 0 if page is None else page ^ 1
+            base = bp.kv_page_addr(page)
+            self.erase_page(base, False)
+            self.program(base + 8, False, b"".join(struct.pack("<II", *e) for e in keep))
+            self.program(base, False, struct.pack("<II", *bp.kv_header(gen + 1)))
+            end = len(keep)
+            busy += bp.FLASH_T_ERASE_PAGE + (end + 1) * bp.FLASH_T_WRITE_DWORD
+        self.program(bp.kv_page_addr(page) + 8 + end * 8, False,
+                     struct.pack("<II", value, bp.kv_record(key, value)))
+        return busy + bp.FLASH_T_WRITE_DWORD
+
+    # -- application check, boot_app.c ---------------------------------------
+    def app_header(self):
+        """(length, crc) of a plausible application header, None otherwise."""
+        vtor = struct.unpack_from("<12I", self.main, 0)
+        magic, length, crc = vtor[bp.APP_HDR_OFFSET // 4:bp.APP_HDR_OFFSET // 4 + 3]
+        sp, pc = vtor[:2]
+        if magic != bp.APP_HDR_MAGIC or not 48 <= length <= self.app_pages * bp.FLASH_PAGE_SIZE_BYTES or length & 7 or \
+                crc >> 16 != ~crc & 0xFFFF or not bp.RAM_APP_BASE < sp <= bp.RAM_APP_BASE + 16 * 1024 or \
+                not pc & 1 or pc >= length:
+            return None
+        return length, crc & 0xFFFF
+
+    def app_unmark(self):
+        """app_unmark() before main flash changes: busy seconds."""
+        if not self.app_check or not self.kv_get(bp.APP_KV_KEY):
+            return 0.0
+        return self.kv_set(bp.APP_KV_KEY, 0)
+
+    def power_cycle(self):
+        """Reset of the board: flash is kept, RAM state and the page cache are lost."""
+        self.exited = False
+        self.framing = bp.FRAMING_SIGN
+        self.arq_base = 0
+        self.arq_bits = 0
+        self.cache = None
+        self.page_status = [set(), set()]
+        self.pages_written = 0
+        self.session = None
+        self.stats = [0, 0, 0, 0]
+
+    # -- command handlers ---------------------------------------------------
+    # expected data_n of every command, checked before the handler runs
+    DATA_N = {
+        bp.CMD_GET_INFO: 0,
+        bp.CMD_GET_INFO_EXT: 0,
+        bp.CMD_GET_CFGWORD: 0,
+        bp.CMD_SET_CFGWORD: 4,
+        bp.CMD_SET_FRAMING: 1,
+        bp.CMD_WRITE_PAGE: 4 + bp.FLASH_PAGE_SIZE_BYTES,
+        bp.CMD_READ_PAGE: 4,
+        bp.CMD_READ_PAGES: 8,
+        bp.CMD_ERASE_FULL: 4,
+        bp.CMD_ERASE_PAGE: 4,
+        bp.CMD_ERASE_RANGE: 8,
+        bp.CMD_WRITE_SESSION: 8,
+        bp.CMD_EXIT: 0,
+        bp.CMD_FLUSH: 0,
+        bp.CMD_ARQ_POLL: 4,
+        bp.CMD_PAGE_STATUS: 4,
+        bp.CMD_RAM_RUN: 8,
+        bp.CMD_GET_JOURNAL: 0,
+        bp.CMD_KV_GET: 4,
+        bp.CMD_KV_SET: 8,
+        bp.CMD_VALIDATE: 0,
+        bp.CMD_TEST_STREAM: 8,
+    }
+
+    def msg(self, status, cmd, data=b""):
+        return bp.build_msg(status, cmd, data, self.framing)
+
+    def handle(self, frame):
+        cmd = frame.cmd
+        data = frame.data
+        cost = len(data) * T_COPY_BYTE
+        self.background = 0.0
+        if self.node_addr is not None:
+            # multidrop: damaged and foreign packets are dropped, broadcasts not answered
+            if not frame.crc_ok or len(frame.data) > self.data_max or \
+                    frame.addr not in (self.node_addr, bp.PACKET_ADDR_BROADCAST):
+                return [], cost
+            if frame.addr == bp.PACKET_ADDR_BROADCAST:
+                return [], self._handle(frame, cost)[1]
+        return self._handle(frame, cost)
+
+    def _handle(self, frame, cost):
+        cmd = frame.cmd
+        data = frame.data
+        # the RX interrupt refuses a header with data_n above PACKET_TMP_DATA_BYTES
+        if len(data) > self.data_max:
+            self.stats[2] += 1
+            return [self.msg(bp.MSG_ERR_CMD, bp.CMD_NONE)], 0.0
+        # boot_core() answers damaged packets itself
+        if not frame.crc_ok:
+            self.stats[1] += 1
+            return [self.msg(bp.MSG_ERR_CRC, cmd)], cost
+        self.stats[0] += 1
+        if cmd == bp.CMD_NONE:
+            return [self.msg(bp.MSG_OK, cmd)], cost
+        handler = getattr(self, "cmd_%s" % bp.cmd_name(cmd).lower(), None)
+        if handler is None or (self.legacy and cmd in self.LEGACY_MISSING) or \
+                (not self.ram_run and cmd in self.RAM_RUN_CMDS) or \
+                (not self.app_check and cmd in self.APP_CHECK_CMDS):
+            return [self.msg(bp.MSG_ERR_CMD, cmd)], cost
+        if self.DATA_N.get(cmd, len(data)) != len(data):
+            return [self.msg(bp.MSG_ERR_LEN, cmd)], cost
+        answers, busy = handler(cmd, data)
+        return answers, cost + busy
+
+    def _addr(self, data):
+        word = struct.unpack_from("<I", data, 0)[0]
+        cfg = word >> 24
+        addr = word & ~(bp.FLASH_PAGE_SIZE_BYTES - 1) & 0x00FFFFFF
+        return word, addr, bool(cfg & bp.CMD_WRITE_PAGE_OPT_NVR_MSK), \
+            bool(cfg & bp.CMD_WRITE_PAGE_OPT_ERASE_MSK)
+
+    def cmd_get_info(self, cmd, data):
+        info = struct.pack("<III", CHIPID, CPUID, BOOT_VER) + BOOT_NAME + b"\0\0"
+        if not self.legacy:
+            info += bytes([bp.CLK_OSI])
+        return [self.msg(bp.MSG_OK, cmd, info)], 0.0
+
+    def cmd_get_info_ext(self, cmd, data):
+        cmds = [c for c in bp.CMD_NAMES if c not in (bp.CMD_NONE, bp.CMD_MSG)
+                and (self.ram_run or c not in self.RAM_RUN_CMDS)
+                and (self.app_check or c not in self.APP_CHECK_CMDS)]
+        info = struct.pack("<9I", BOOT_VER, self.data_max, self.fifo_bytes, 100000000 // 16,
+                           bp.FLASH_PAGE_SIZE_BYTES, self.app_pages, bp.FLASH_NVR_PAGE_TOTAL,
+                           self.pages_max, (1 << bp.FRAMING_SIGN) | (1 << bp.FRAMING_COBS))
+        info += bytes([len(cmds)]) + bytes(cmds)
+        return [self.msg(bp.MSG_OK, cmd, info)], 0.0
+
+    def cmd_get_cfgword(self, cmd, data):
+        busy = self.cache_flush()
+        return [self.msg(bp.MSG_OK, cmd, struct.pack("<I", self.cfgword()))], busy
+
+    def cmd_set_cfgword(self, cmd, data):
+        cfgword = struct.unpack_from("<I", data, 0)[0]
+        busy = self.cache_flush()
+        if not self.cfgword() & bp.CFGWORD_NVRWE_MSK:
+            status = bp.MSG_FAIL
+        else:
+            busy += self.cache_write(bp.FLASH_NVR_CFGWORD_OFFSET, True, data[:4])
+            busy += self.cache_flush()
+            status = bp.MSG_OK
+        return [self.msg(status, cmd, struct.pack("<I", cfgword))], busy
+
+    def cmd_set_framing(self, cmd, data):
+        framing = data[0]
+        ok = framing in (bp.FRAMING_SIGN, bp.FRAMING_COBS)
+        answer = self.msg(bp.MSG_OK if ok else bp.MSG_FAIL, cmd, struct.pack("<I", framing))
+        if ok:
+            self.framing = framing
+        return [answer], 0.0
+
+    def page_write(self, data):
+        """page_write() of boot_core.c: (status, busy seconds)."""
+        _, addr, nvr, erase = self._addr(data)
+        busy = self.cache_flush()
+        if not self._access(addr, nvr, True):
+            return bp.MSG_FAIL, busy
+        session = self.session
+        if session and session[2] == nvr and session[0] <= addr < session[1]:
+            # a page of the session is erased unless it was erased ahead
+            erase = addr != session[4]
+        else:
+            session = None
+        if not nvr:
+            busy += self.app_unmark()
+        if erase:
+            self.erase_page(addr, nvr)
+            busy += bp.FLASH_T_ERASE_PAGE
+        page = data[4:4 + bp.FLASH_PAGE_SIZE_BYTES]
+        self.program(addr, nvr, page)
+        busy += bp.FLASH_PAGE_SIZE_BYTES // 8 * bp.FLASH_T_WRITE_DWORD
+        self.page_status[nvr].add(addr // bp.FLASH_PAGE_SIZE_BYTES)
+        self.pages_written += 1
+        if not nvr:
+            busy += len(page) * T_CRC_BYTE + \
+                self.journal_append(bp.JOURNAL_TAG_WRITTEN | addr // bp.FLASH_PAGE_SIZE_BYTES,
+                                    bp.crc16(page))
+        if session:
+            # the page above the written ones is erased while the next packet arrives
+            if addr == session[4]:
+                session[4] = None
+            if addr >= session[3]:
+                session[3] = addr + bp.FLASH_PAGE_SIZE_BYTES
+                if session[3] < session[1] and session[4] is None:
+                    session[4] = session[3]
+                    busy += self.page_erase(session[4], nvr)
+                    self.background = bp.FLASH_T_ERASE_PAGE
+        return bp.MSG_OK, busy
+
+    def page_erase(self, addr, nvr):
+        """page_erase() of boot_core.c without the erase time, it runs on after the return."""
+        busy = 0.0 if nvr else self.journal_stale(addr // bp.FLASH_PAGE_SIZE_BYTES) + self.app_unmark()
+        self.erase_page(addr, nvr)
+        return busy
+
+    def _range_ok(self, addr, nvr, count):
+        end = addr + (count - 1) * bp.FLASH_PAGE_SIZE_BYTES
+        return 0 < count <= bp.FLASH_PAGE_TOTAL and self._access(addr, nvr, True) and \
+            self._access(end, nvr, True)
+
+    def cmd_write_session(self, cmd, data):
+        word, addr, nvr, _ = self._addr(data)
+        count = struct.unpack_from("<I", data, 4)[0]
+        busy = self.cache_flush()
+        self.session = None
+        status = bp.MSG_OK
+        if count:
+            if not self._range_ok(addr, nvr, count):
+                status = bp.MSG_FAIL
+            else:
+                self.session = [addr, addr + count * bp.FLASH_PAGE_SIZE_BYTES, nvr, addr, addr]
+                busy += self.page_erase(addr, nvr)
+                self.background = bp.FLASH_T_ERASE_PAGE
+        return [self.msg(status, cmd, struct.pack("<II", word, count))], busy
+
+    def cmd_write_page(self, cmd, data):
+        status, busy = self.page_write(data)
+        return [self.msg(status, cmd, data[:4])], busy
+
+    def cmd_write_pages(self, cmd, data):
+        count = (len(data) - 4) // bp.FLASH_PAGE_SIZE_BYTES
+        if count == 0 or len(data) != 4 + count * bp.FLASH_PAGE_SIZE_BYTES:
+            return [self.msg(bp.MSG_ERR_LEN, cmd)], 0.0
+        word = struct.unpack_from("<I", data, 0)[0]
+        busy = 0.0
+        status = bp.MSG_OK
+        done = 0
+        for i in range(count):
+            page = struct.pack("<I", word + i * bp.FLASH_PAGE_SIZE_BYTES) + \
+                data[4 + i * bp.FLASH_PAGE_SIZE_BYTES:4 + (i + 1) * bp.FLASH_PAGE_SIZE_BYTES]
+            status, t = self.page_write(page)
+            busy += t
+            if status != bp.MSG_OK:
+                break
+            done += 1
+        return [self.msg(status, cmd, struct.pack("<II", word, done))], busy
+
+    def cmd_write_range(self, cmd, data):
+        word = struct.unpack_from("<I", data, 0)[0]
+        addr = word & 0x00FFFFFF
+        nvr = bool((word >> 24) & bp.CMD_WRITE_PAGE_OPT_NVR_MSK)
+        page = addr & ~(bp.FLASH_PAGE_SIZE_BYTES - 1)
+        if not 4 < len(data) <= 4 + bp.FLASH_PAGE_SIZE_BYTES - (addr - page):
+            return [self.msg(bp.MSG_ERR_LEN, cmd)], 0.0
+        busy = 0.0
+        if not self._access(page, nvr, True):
+            status = bp.MSG_FAIL
+        else:
+            if not nvr:
+                busy += self.journal_stale(page // bp.FLASH_PAGE_SIZE_BYTES) + self.app_unmark()
+            busy += self.cache_write(addr, nvr, data[4:])
+            status = bp.MSG_OK
+        return [self.msg(status, cmd, data[:4])], busy
+
+    def cmd_flush(self, cmd, data):
+        return [self.msg(bp.MSG_OK, cmd)], self.cache_flush()
+
+    def cmd_arq_write(self, cmd, data):
+        # streamed frames are never answered, except when flash refuses the page
+        if len(data) != 4 + bp.FLASH_PAGE_SIZE_BYTES + 2:
+            return [], 0.0
+        seq = struct.unpack_from("<H", data, 4 + bp.FLASH_PAGE_SIZE_BYTES)[0]
+        offset = (seq - self.arq_base) & 0xFFFF
+        if offset >= bp.ARQ_WINDOW or self.arq_bits & (1 << offset):
+            return [], 0.0
+        status, busy = self.page_write(data)
+        if status != bp.MSG_OK:
+            return [self.msg(bp.MSG_FAIL, cmd, struct.pack("<I", seq))], busy
+        self.arq_bits |= 1 << offset
+        return [], busy
+
+    def cmd_arq_poll(self, cmd, data):
+        word = struct.unpack_from("<I", data, 0)[0]
+        base = word & 0xFFFF
+        if (word >> 16) & bp.CMD_ARQ_POLL_OPT_RESET_MSK:
+            self.arq_bits = 0
+        else:
+            shift = (base - self.arq_base) & 0xFFFF
+            self.arq_bits = self.arq_bits >> shift if shift < bp.ARQ_WINDOW else 0
+        self.arq_base = base
+        return [self.msg(bp.MSG_OK, cmd, struct.pack("<II", word, self.arq_bits))], 0.0
+
+    def cmd_page_status(self, cmd, data):
+        opt = struct.unpack_from("<I", data, 0)[0]
+        main = sum(1 << i for i in self.page_status[0])
+        nvr = sum(1 << i for i in self.page_status[1])
+        addr = bp.PACKET_ADDR_BROADCAST if self.node_addr is None else self.node_addr
+        out = struct.pack("<IIII", addr, main & 0xFFFFFFFF, main >> 32, nvr)
+        if opt & bp.CMD_PAGE_STATUS_OPT_CLEAR_MSK:
+            self.page_status = [set(), set()]
+        return [self.msg(bp.MSG_OK, cmd, out)], 0.0
+
+    def cmd_read_page(self, cmd, data):
+        word, addr, nvr, _ = self._addr(data)
+        count = 1
+        if cmd == bp.CMD_READ_PAGES:
+            count = struct.unpack_from("<I", data, 4)[0]
+            if not 0 < count <= self.pages_max:
+                return [self.msg(bp.MSG_ERR_LEN, cmd)], 0.0
+        self.cache_flush()
+        out = struct.pack("<I", word)
+        end = addr + count * bp.FLASH_PAGE_SIZE_BYTES
+        if not self._access(addr, nvr, False) or not self._access(end - 1, nvr, False):
+            status = bp.MSG_FAIL
+        else:
+            status = bp.MSG_OK
+            out += bytes(self._mem(nvr)[addr:end])
+        return [self.msg(status, cmd, out)], 0.0
+
+    def cmd_read_pages(self, cmd, data):
+        return self.cmd_read_page(cmd, data)
+
+    def cmd_erase_full(self, cmd, data):
+        return self._erase(cmd, data, True)
+
+    def cmd_erase_page(self, cmd, data):
+        return self._erase(cmd, data, False)
+
+    def cmd_erase_range(self, cmd, data):
+        word, addr, nvr, _ = self._addr(data)
+        count = struct.unpack_from("<I", data, 4)[0]
+        busy = self.cache_flush()
+        answers = []
+        status = bp.MSG_OK
+        if not self._range_ok(addr, nvr, count):
+            status = bp.MSG_FAIL
+            count = 0
+        for i in range(count):
+            busy += self.page_erase(addr + i * bp.FLASH_PAGE_SIZE_BYTES, nvr) + bp.FLASH_T_ERASE_PAGE
+            if i and not i % bp.PACKET_ERASE_PROGRESS:
+                answers.append(self.msg(bp.MSG_BUSY, cmd, struct.pack("<II", word, i)))
+        answers.append(self.msg(status, cmd, struct.pack("<II", word, count)))
+        return answers, busy
+
+    def _erase(self, cmd, data, full):
+        word, addr, nvr, _ = self._addr(data)
+        busy = self.cache_flush()
+        if not self._access(addr, nvr, True):
+            status = bp.MSG_FAIL
+        else:
+            if full:
+                busy = self.app_unmark()
+                if self.legacy:
+                    self.main[:] = b"\xFF" * bp.FLASH_TOTAL_BYTES
+                    busy += bp.FLASH_T_ERASE_FULL
+                else:
+                    # the key-value log is kept, the pages below it are erased one by one
+                    kv = bp.FLASH_KV_PAGE * bp.FLASH_PAGE_SIZE_BYTES
+                    self.main[:kv] = b"\xFF" * kv
+                    busy += bp.FLASH_T_ERASE_FULL_KV + self.journal_clear()
+            else:
+                busy = bp.FLASH_T_ERASE_PAGE
+                if not nvr:
+                    busy += self.journal_stale(addr // bp.FLASH_PAGE_SIZE_BYTES) + self.app_unmark()
+                self.erase_page(addr, nvr)
+            status = bp.MSG_OK
+        return [self.msg(status, cmd, struct.pack("<I", word))], busy
+
+    # commands CMD_BATCH refuses: no answer, a longer answer or a change of the link
+    BATCH_REFUSED = {bp.CMD_BATCH, bp.CMD_EXIT, bp.CMD_SET_FRAMING, bp.CMD_GET_INFO_EXT,
+                     bp.CMD_READ_PAGE, bp.CMD_READ_PAGES, bp.CMD_GET_JOURNAL, bp.CMD_ARQ_WRITE,
+                     bp.CMD_RAM_RUN, bp.CMD_ECHO, bp.CMD_TEST_STREAM}
+
+    def cmd_batch(self, cmd, data):
+        if len(data) > self.data_max - bp.BATCH_ANSWER_BYTES:
+            return [self.msg(bp.MSG_ERR_LEN, cmd)], 0.0
+        # the list is moved behind the answers
+        busy = len(data) * T_COPY_BYTE
+        answers = []
+        status = []
+        pos = 0
+        while pos < len(data) and len(status) < bp.BATCH_CMDS_MAX:
+            if len(data) - pos < 3:
+                status.append(bp.MSG_ERR_LEN)
+                break
+            sub, n = struct.unpack_from("<BH", data, pos)
+            pos += 3
+            if n > len(data) - pos:
+                status.append(bp.MSG_ERR_LEN)
+                break
+            sub_data = data[pos:pos + n]
+            pos += n
+            if sub in self.BATCH_REFUSED:
+                status.append(bp.MSG_ERR_CMD)
+                break
+            # the answers are only looked at, framed with the signature
+            framing, self.framing = self.framing, bp.FRAMING_SIGN
+            frame = bp.Frame(bp.PACKET_HOST_SIGN, sub, sub_data, True, b"")
+            sub_answers, sub_busy = self._handle(frame, n * T_COPY_BYTE)
+            self.framing = framing
+            busy += sub_busy
+            parser = bp.FrameParser(bp.PACKET_DEVICE_SIGN)
+            sub_answers = [a for raw in sub_answers for a in parser.feed(raw)]
+            # progress of a long command goes out as progress of the batch
+            answers += [self.msg(a.status, cmd, a.msg_data) for a in sub_answers
+                        if a.status == bp.MSG_BUSY]
+            status.append(sub_answers[-1].status)
+            if status[-1] != bp.MSG_OK:
+                break
+        ok = pos == len(data) and (not status or status[-1] == bp.MSG_OK)
+        answers.append(self.msg(bp.MSG_OK if ok else bp.MSG_FAIL, cmd, bytes(status)))
+        return answers, busy
+
+    def cmd_echo(self, cmd, data):
+        if len(data) > self.data_max - 4:
+            return [self.msg(bp.MSG_ERR_LEN, cmd)], 0.0
+        return [self.msg(bp.MSG_OK, cmd, data)], len(data) * T_COPY_BYTE
+
+    def cmd_test_stream(self, cmd, data):
+        count, size, state = struct.unpack("<HHI", data)
+        if size % 4 or size > self.data_max - 8:
+            return [self.msg(bp.MSG_ERR_LEN, cmd)], 0.0
+        answers = []
+        for i in range(count):
+            pattern, state = bp.stream_pattern(state, size)
+            answers.append(self.msg(bp.MSG_BUSY, cmd, struct.pack("<I", i) + pattern))
+        answers.append(self.msg(bp.MSG_OK, cmd, struct.pack("<4I", *self.stats)))
+        return answers, count * size * T_COPY_BYTE
+
+    def cmd_ram_write(self, cmd, data):
+        if len(data) <= 4:
+            return [self.msg(bp.MSG_ERR_LEN, cmd)], 0.0
+        offset = struct.unpack_from("<I", data, 0)[0]
+        chunk = data[4:]
+        status = bp.MSG_FAIL
+        if offset + len(chunk) <= bp.RAM_APP_BYTES:
+            self.ram[offset:offset + len(chunk)] = chunk
+            status = bp.MSG_OK
+        return [self.msg(status, cmd, struct.pack("<I", offset))], 0.0
+
+    def cmd_ram_run(self, cmd, data):
+        size, crc = struct.unpack("<II", data)
+        ok = 8 <= size <= bp.RAM_APP_BYTES
+        crc_calc = bp.crc16(self.ram[:size]) if ok else 0
+        sp, pc = struct.unpack_from("<II", self.ram, 0)
+        top = bp.RAM_APP_BASE + 16 * 1024
+        ok = ok and crc_calc == (crc & 0xFFFF) and bp.RAM_APP_BASE < sp <= top and \
+            pc & 1 and bp.RAM_APP_BASE <= pc < bp.RAM_APP_BASE + size
+        self.exited = bool(ok)
+        status = bp.MSG_OK if ok else bp.MSG_FAIL
+        busy = (size * T_CRC_BYTE if size <= bp.RAM_APP_BYTES else 0.0) + \
+            (self.cache_flush() + self.journal_clear() if ok else 0.0)
+        return [self.msg(status, cmd, struct.pack("<II", size, crc_calc))], busy
+
+    def cmd_exit(self, cmd, data):
+        self.exited = True
+        busy = self.cache_flush()
+        return [self.msg(bp.MSG_OK, cmd)], busy + self.journal_clear()
+
+    def cmd_get_journal(self, cmd, data):
+        busy = self.cache_flush()
+        entries = self.journal_entries()
+        out = struct.pack("<I", len(entries)) + b"".join(struct.pack("<II", *e) for e in entries)
+        return [self.msg(bp.MSG_OK, cmd, out)], busy
+
+    def cmd_kv_get(self, cmd, data):
+        key = struct.unpack("<I", data)[0]
+        busy = self.cache_flush()
+        value = self.kv_get(key) if self.cfgword() & bp.CFGWORD_FLASHRE_MSK else None
+        status = bp.MSG_FAIL if value is None else bp.MSG_OK
+        out = struct.pack("<II", key, 0xFFFFFFFF if value is None else value)
+        return [self.msg(status, cmd, out)], busy
+
+    def cmd_kv_set(self, cmd, data):
+        key, value = struct.unpack("<II", data)
+        busy = self.cache_flush()
+        refused = self.app_check and key == bp.APP_KV_KEY
+        t = self.kv_set(key, value) if self._access(0, False, True) and \
+            not refused else None
+        status = bp.MSG_FAIL if t is None else bp.MSG_OK
+        return [self.msg(status, cmd, struct.pack("<I", key))], busy + (t or 0.0)
+
+    def cmd_validate(self, cmd, data):
+        busy = self.cache_flush()
+        hdr = self.app_header()
+        status = bp.MSG_FAIL
+        length, crc = 0, 0
+        if hdr:
+            length = hdr[0]
+            crc = bp.app_digest(self.main[:length])
+            busy += length * T_CRC_BYTE
+            if crc == hdr[1]:
+                busy += self.kv_set(bp.APP_KV_KEY, bp.app_mark(length, crc))
+                status = bp.MSG_OK
+        return [self.msg(status, cmd, struct.pack("<II", length, crc))], busy
+
+
+class Noise:
+    """
+    Bit errors at a fixed bit error rate. A UART character takes 10 bits on
+    the line, a hit start or stop bit garbles a random data bit.
+    """
+
+    def __init__(self, ber, seed=None):
+        self.ber = ber
+        self.rng = random.Random(seed)
+        self.gap = self._gap()
+        self.flips = 0
+
+    def _gap(self):
+        return int(self.rng.expovariate(self.ber)) if self.ber > 0 else 0
+
+    def apply(self, data):
+        if self.ber <= 0:
+            return data
+        bits = len(data) * 10
+        if self.gap >= bits:
+            self.gap -= bits
+            return data
+        out = bytearray(data)
+        pos = self.gap
+        while pos < bits:
+            i, b = divmod(pos, 10)
+            out[i] ^= 1 << (b - 1 if 1 <= b <= 8 else self.rng.randrange(8))
+            self.flips += 1
+            pos += 1 + self._gap()
+        self.gap = pos - bits
+        return bytes(out)
+
+
+def link_byte_time(baud, spi):
+    """Time of one byte on the link: start and stop bit on the UART, 8 clocks on SPI."""
+    if spi:
+        return 8.0 / spi
+    return 10.0 / baud if baud else 0.0
+
+
+def open_pty():
+    """Raw pty as (master, slave, slave path); the slave is kept open so the
+    pty survives host reconnects."""
+    master, slave = os.openpty()
+    tty.setraw(slave)
+    os.set_blocking(master, False)
+    return master, slave, os.ttyname(slave)
+
+
+class PtyDevice:
+    """One simulated board: a DeviceModel behind a pty with UART timing."""
+
+    ST_SYNC, ST_BOOT, ST_APP, ST_DEAD = range(4)
+
+    def __init__(self, loop, index, baud, rearm=None, dead=False, ber=0.0, legacy=False,
+                 ram_run=False, cut=None, rtscts=False, spi=0, app_check=False):
+        self.loop = loop
+        self.index = index
+        self.byte_time = link_byte_time(baud, spi)
+        self.rearm = rearm
+        self.master, self.slave, self.path = open_pty()
+        self.boards = 0
+        self.noise_rx = Noise(ber)
+        self.noise_tx = Noise(ber)
+        self.legacy = legacy
+        self.ram_run = ram_run
+        self.app_check = app_check
+        self.cut = cut
+        self.rtscts = rtscts
+        self.overflows = 0
+        self.tx_pending = bytearray()
+        self.reset(dead)
+
+    def reset(self, dead=False):
+        self.model = DeviceModel(legacy=self.legacy, ram_run=self.ram_run, app_check=self.app_check)
+        self.parser = bp.FrameParser(bp.PACKET_HOST_SIGN)
+        self.state = self.ST_DEAD if dead else self.ST_SYNC
+        self.rx_time = 0.0
+        self.cpu_free = 0.0
+        self.flash_free = 0.0
+        # FIFO of boot_packet.c: (time the bytes are read, count) of whole frames and of
+        # the frame being received
+        self.backlog = []
+        self.partial = (0.0, 0)
+
+    def fifo_fill(self, when):
+        self.backlog = [(t, n) for t, n in self.backlog if t > when]
+        return sum(n for _, n in self.backlog) + (self.partial[1] if self.partial[0] > when else 0)
+
+    def fifo_drained(self, level):
+        """Time the FIFO holds level bytes or less."""
+        fill = sum(n for _, n in self.backlog) + self.partial[1]
+        t = 0.0
+        for when, n in sorted(self.backlog + [self.partial]):
+            if fill <= level:
+                break
+            fill -= n
+            t = when
+        return t
+
+    def rts_resume(self):
+        self.loop.add_reader(self.master, self.on_readable)
+        self.on_readable()
+
+    def power_cycle(self, down=1.0):
+        """Power lost in the middle of a session: flash survives, the board is back after down seconds."""
+        self.model.power_cycle()
+        self.parser = bp.FrameParser(bp.PACKET_HOST_SIGN)
+        self.state = self.ST_DEAD
+        self.loop.call_at(time.monotonic() + down, setattr, self, "state", self.ST_SYNC)
+
+    def on_readable(self):
+        now = time.monotonic()
+        start = max(self.rx_time, now)
+        fifo_bytes = self.model.fifo_bytes
+        room = fifo_bytes - self.fifo_fill(start) if self.state == self.ST_BOOT else fifo_bytes
+        # small reads keep the arrival time of every frame close to the line rate
+        size = 256
+        if self.rtscts:
+            # RTS released at the high watermark holds the rest back in the host
+            if room <= bp.PACKET_FIFO_RTS_SLACK:
+                self.loop.remove_reader(self.master)
+                self.loop.call_at(self.fifo_drained(fifo_bytes // 2), self.rts_resume)
+                return
+            size = min(size, room - bp.PACKET_FIFO_RTS_SLACK)
+        try:
+            chunk = os.read(self.master, size)
+        except BlockingIOError:
+            return
+        except OSError:
+            chunk = b""
+        if not chunk:
+            return
+        self.rx_time = start + len(chunk) * self.byte_time
+        if len(chunk) > room:
+            # packet_fifo_write() drops what does not fit
+            self.overflows += 1
+            self.model.stats[3] += 1
+            chunk = chunk[:room]
+        self.process(self.noise_rx.apply(chunk))
+
+    def process(self, chunk):
+        if self.state == self.ST_SYNC:
+            # boot_init() measures the first byte and answers with the signature
+            pos = chunk.find(bytes([bp.SYNC_BYTE]))
+            if pos < 0:
+                return
+            self.state = self.ST_BOOT
+            ready = bp.build_msg(bp.MSG_READY, bp.CMD_NONE)
+            self.send_at(self.rx_time, bp.SYNC_ANSWER + ready)
+            self.cpu_free = self.rx_time + len(ready) * self.byte_time
+            chunk = chunk[pos + 1:]
+        if self.state != self.ST_BOOT:
+            return
+        for frame in self.parser.feed(chunk):
+            framing = self.model.framing
+            # the frame leaves the FIFO when the core is free to read it, a handler
+            # that touches flash also waits for an erase left running by the last one
+            start = max(self.rx_time, self.cpu_free, self.flash_free)
+            self.backlog.append((start, len(frame.raw)))
+            answers, busy = self.model.handle(frame)
+            if self.cut is not None and self.model.pages_written >= self.cut:
+                # the last page is programmed, its answer is never sent
+                self.cut = None
+                self.power_cycle()
+                return
+            out = b"".join(answers)
+            done = start + busy + len(out) * self.byte_time
+            self.cpu_free = done
+            self.flash_free = start + busy + self.model.background
+            if out:
+                self.send_at(done, out)
+            if self.model.exited:
+                self.boards += 1
+                self.state = self.ST_APP
+                if self.rearm is not None:
+                    self.loop.call_at(done + self.rearm, self.reset)
+                return
+            if self.model.framing != framing:
+                # whatever follows is already in the new framing
+                rest = bytes(self.parser.buf)
+                self.parser = bp.make_parser(self.model.framing, bp.PACKET_HOST_SIGN)
+                self.process(rest)
+                return
+        self.partial = (max(self.rx_time, self.cpu_free), len(self.parser.buf))
+
+    def send_at(self, when, data):
+        self.loop.call_at(when, self._write, self.noise_tx.apply(data))
+
+    def _write(self, data):
+        # a flush is pending while the pty holds bytes the host has not read yet
+        busy = bool(self.tx_pending)
+        self.tx_pending += data
+        if not busy:
+            self._flush()
+
+    def _flush(self):
+        try:
+            n = os.write(self.master, self.tx_pending)
+        except BlockingIOError:
+            n = 0
+        except OSError:
+            n = len(self.tx_pending)
+        del self.tx_pending[:n]
+        if self.tx_pending:
+            self.loop.call_at(time.monotonic() + 0.001, self._flush)
+
+
+class BusNode:
+    """One BOOT_USE_MULTIDROP board on a BusDevice."""
+
+    def __init__(self, bus, addr, ber):
+        self.bus = bus
+        self.model = DeviceModel(node_addr=addr)
+        self.parser = bp.FrameParser(bp.PACKET_HOST_ADDR_SIGN, addressed=True)
+        self.noise = Noise(ber)
+        self.synced = False
+        self.cpu_free = 0.0
+        self.flash_free = 0.0
+        # FIFO of boot_packet.c as (time the bytes are read, count)
+        self.backlog = []
+        self.overflows = 0
+
+    def process(self, chunk, rx_time):
+        chunk = self.noise.apply(chunk)
+        if not self.synced:
+            # boot_init() measures the first byte, a multidrop node does not answer it
+            pos = chunk.find(bytes([bp.SYNC_BYTE]))
+            if pos < 0:
+                return
+            self.synced = True
+            chunk = chunk[pos + 1:]
+        self.backlog = [(t, n) for t, n in self.backlog if t > rx_time]
+        room = bp.PACKET_FIFO_BYTES - sum(n for _, n in self.backlog)
+        if room < len(chunk):
+            self.overflows += 1
+            chunk = chunk[:max(room, 0)]
+        self.backlog.append((max(rx_time, self.cpu_free), len(chunk)))
+        self.feed(chunk, rx_time)
+
+    def feed(self, chunk, rx_time):
+        if self.model.exited:
+            return
+        for frame in self.parser.feed(chunk):
+            framing = self.model.framing
+            answers, busy = self.model.handle(frame)
+            out = b"".join(answers)
+            self.cpu_free = max(rx_time, self.cpu_free, self.flash_free) + busy
+            self.flash_free = self.cpu_free + self.model.background
+            if out:
+                # packet_poll() takes the next frame once the answer is sent
+                self.cpu_free = self.bus.send_at(self.cpu_free, out)
+            if self.model.exited:
+                return
+            if self.model.framing != framing:
+                rest = bytes(self.parser.buf)
+                self.parser = bp.make_parser(self.model.framing, bp.PACKET_HOST_ADDR_SIGN, True)
+                self.feed(rest, rx_time)
+                return
+
+
+class BusDevice:
+    """
+    RS-485 bus of multidrop nodes with the addresses 1..count behind one pty.
+
+    Every node sees all host bytes with its own bit errors. Answers whose
+    transmissions overlap in time are garbled.
+    """
+
+    def __init__(self, loop, count, baud, ber=0.0):
+        self.loop = loop
+        self.byte_time = 10.0 / baud if baud else 0.0
+        self.master, self.slave, self.path = open_pty()
+        self.nodes = [BusNode(self, i + 1, ber) for i in range(count)]
+        self.noise_tx = Noise(ber)
+        self.rng = random.Random()
+        self.rx_time = 0.0
+        self.on_air = []
+        self.collisions = 0
+
+    def on_readable(self):
+        try:
+            chunk = os.read(self.master, 65536)
+        except (BlockingIOError, OSError):
+            return
+        if not chunk:
+            return
+        self.rx_time = max(self.rx_time, time.monotonic()) + len(chunk) * self.byte_time
+        for node in self.nodes:
+            node.process(chunk, self.rx_time)
+
+    def send_at(self, start, data):
+        end = start + len(data) * self.byte_time
+        tx = [start, end, data]
+        for other in self.on_air:
+            if other[0] < end and start < other[1]:
+                self.collisions += 1
+                other[2] = self._garble(other[2])
+                tx[2] = self._garble(tx[2])
+        self.on_air.append(tx)
+        self.loop.call_at(end, self._write, tx)
+        return end
+
+    def _garble(self, data):
+        return bytes(b ^ self.rng.getrandbits(8) for b in data)
+
+    def _write(self, tx):
+        self.on_air.remove(tx)
+        try:
+            os.write(self.master, self.noise_tx.apply(tx[2]))
+        except OSError:
+            pass
+
+
+class Loop:
+    """Minimal selector loop with timers."""
+
+    def __init__(self):
+        self.sel = selectors.DefaultSelector()
+        self.timers = []
+        self.seq = itertools.count()
+
+    def call_at(self, when, fn, *args):
+        heapq.heappush(self.timers, (when, next(self.seq), fn, args))
+
+    def add_reader(self, fd, fn):
+        self.sel.register(fd, selectors.EVENT_READ, fn)
+
+    def remove_reader(self, fd):
+        self.sel.unregister(fd)
+
+    def run(self):
+        while True:
+            timeout = None
+            if self.timers:
+                timeout = max(0.0, self.timers[0][0] - time.monotonic())
+            for key, _ in self.sel.select(timeout):
+                key.data()
+            now = time.monotonic()
+            while self.timers and self.timers[0][0] <= now:
+                _, _, fn, args = heapq.heappop(self.timers)
+                fn(*args)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("-n", "--count", type=int, default=1, help="number of devices")
+    ap.add_argument("--baud", type=int, default=460800,
+                    help="modelled UART rate, 0 for an ideal link")
+    ap.add_argument("--rearm", type=float, default=None, metavar="S",
+                    help="after CMD_EXIT wait S seconds and present a fresh board")
+    ap.add_argument("--dead", default="", metavar="I,J",
+                    help="indices of devices that never answer")
+    ap.add_argument("--legacy", default="", metavar="I,J",
+                    help="indices of devices without CMD_GET_INFO_EXT and multi-page packets")
+    ap.add_argument("--cut", type=int, default=None, metavar="N",
+                    help="power cycle every device once after N written pages, flash is kept "
+                         "and the device answers auto-baud again after 1 s")
+    ap.add_argument("--ram-run", action="store_true",
+                    help="devices are BOOT_USE_RAM_RUN builds")
+    ap.add_argument("--app-check", action="store_true",
+                    help="devices are BOOT_USE_APP_CHECK builds with CMD_VALIDATE")
+    ap.add_argument("--ber", type=float, default=0.0,
+                    help="bit error rate injected in both directions")
+    ap.add_argument("--rtscts", action="store_true",
+                    help="devices are BOOT_USE_FLOW_CTRL builds and hold the host back with RTS")
+    ap.add_argument("--spi", type=float, default=0, metavar="HZ",
+                    help="devices are BOOT_TRANSPORT_SPI builds clocked by the host at HZ")
+    ap.add_argument("--bus", type=int, default=0, metavar="N",
+                    help="one pty with an RS-485 bus of N multidrop nodes instead")
+    ap.add_argument("--link-dir", default=None,
+                    help="also create symlinks DIR/devN to the pty slaves")
+    args = ap.parse_args()
+    if args.spi and (args.bus or args.rtscts):
+        ap.error("--spi has no multidrop bus and no RTS / CTS")
+    if args.spi > SPI_SCK_MAX:
+        ap.error("--spi above %.0f Hz is more than the SSP follows in slave mode" % SPI_SCK_MAX)
+
+    dead = {int(i) for i in args.dead.split(",") if i}
+    legacy = {int(i) for i in args.legacy.split(",") if i}
+    loop = Loop()
+    devices = []
+    if args.bus:
+        bus = BusDevice(loop, args.bus, args.baud, args.ber)
+        loop.add_reader(bus.master, bus.on_readable)
+        devices.append(bus)
+        print(bus.path)
+        args.count = 0
+    for i in range(args.count):
+        dev = PtyDevice(loop, i, args.baud, args.rearm, i in dead, args.ber, i in legacy,
+                        args.ram_run, args.cut, args.rtscts, args.spi, args.app_check)
+        loop.add_reader(dev.master, dev.on_readable)
+        devices.append(dev)
+        path = dev.path
+        if args.link_dir:
+            path = os.path.join(args.link_dir, "dev%d" % i)
+            if os.path.lexists(path):
+                os.unlink(path)
+            os.symlink(dev.path, path)
+        print(path)
+    print("ready", flush=True)
+
+    signal.signal(signal.SIGTERM, lambda *_: sys.exit(0))
+    try:
+        loop.run()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,457 @@
+#!/usr/bin/env python3
+"""
+Capture, decode and replay of bootloader sessions.
+
+record puts a pty between a host tool and the board and writes both
+directions of the link with timestamps to a trace file. analyze decodes the
+frames of a trace (signature or COBS framing as switched by CMD_SET_FRAMING)
+and prints the latency of every command, idle gaps, retransmits and the
+effective throughput. replay sends the host side of a trace to a simulated
+board (boot_sim.py) in the same order: every host chunk waits for as many
+device frames as it had seen when it was recorded, so stop-and-wait and
+windowed streams keep their shape, and prints the analysis of the replay.
+
+    boot_trace.py record -p /dev/ttyUSB0 -b 460800 -o flash.trace -- \\
+        python3 tools/gang_flasher.py -b 460800 -i firmware.bin {port}
+    boot_trace.py record --simulate -o flash.trace -- python3 tools/ramrun.py -i app.bin {port}
+    boot_trace.py analyze flash.trace
+    boot_trace.py replay flash.trace --baud 921600
+
+Trace files are text: a "# boot_trace baud=N" line, then one chunk per line
+as "seconds H|D hex", H from the host and D from the device.
+"""
+
+import argparse
+import bisect
+import os
+import selectors
+import signal
+import struct
+import subprocess
+import sys
+import time
+
+import bootproto as bp
+import boot_sim
+
+HOST = "H"
+DEVICE = "D"
+
+# bytes of the request data that are not flash contents
+WRITE_HEADERS = {
+    bp.CMD_WRITE_PAGE: 4,
+    bp.CMD_WRITE_PAGES: 4,
+    bp.CMD_WRITE_RANGE: 4,
+    bp.CMD_ARQ_WRITE: 6,
+    bp.CMD_RAM_WRITE: 4,
+}
+
+
+# -- Trace files --------------------------------------------------------------
+class Trace:
+    """Chunks of both directions as (seconds, HOST or DEVICE, bytes)."""
+
+    def __init__(self, baud=0):
+        self.baud = baud
+        self.chunks = []
+        self.start = None
+
+    def add(self, direction, data, now=None):
+        now = time.monotonic() if now is None else now
+        if self.start is None:
+            self.start = now
+        self.chunks.append((now - self.start, direction, bytes(data)))
+
+    def save(self, path):
+        with open(path, "w") as f:
+            f.write("# boot_trace baud=%d\n" % self.baud)
+            for t, direction, data in self.chunks:
+                f.write("%.6f %s %s\n" % (t, direction, data.hex()))
+
+    @classmethod
+    def load(cls, path):
+        trace = cls()
+        with open(path) as f:
+            for line in f:
+                line = line.strip()
+                if line.startswith("#"):
+                    for word in line[1:].split():
+                        if word.startswith("baud="):
+                            trace.baud = int(word[5:])
+                    continue
+                if line:
+                    t, direction, data = line.split()
+                    trace.chunks.append((float(t), direction, bytes.fromhex(data)))
+        return trace
+
+
+# -- Decoding -----------------------------------------------------------------
+class Stream:
+    """One direction: frame parser plus the time of every byte offset."""
+
+    def __init__(self, sign):
+        self.sign = sign
+        self.parser = bp.make_parser(bp.FRAMING_SIGN, sign)
+        self.offsets = []
+        self.times = []
+        self.fed = 0
+
+    def feed(self, t, data):
+        self.offsets.append(self.fed)
+        self.times.append(t)
+        self.fed += len(data)
+        frames = self.parser.feed(data)
+        # frames are back to back before whatever the parser still holds
+        end = self.fed - len(self.parser.buf)
+        out = []
+        for frame in reversed(frames):
+            start = end - len(frame.raw)
+            out.append((self.time_at(start), frame))
+            end = start
+        return list(reversed(out))
+
+    def time_at(self, offset):
+        return self.times[max(bisect.bisect_right(self.offsets, max(offset, 0)) - 1, 0)]
+
+    def set_framing(self, framing):
+        self.parser = bp.make_parser(framing, self.sign)
+
+
+class Request:
+    __slots__ = ("frame", "start", "end", "retransmit")
+
+    def __init__(self, frame, start, end, retransmit):
+        self.frame = frame
+        self.start = start
+        self.end = end
+        self.retransmit = retransmit
+
+
+class CmdStats:
+    def __init__(self):
+        self.sent = 0
+        self.retransmits = 0
+        self.lost = 0
+        self.latency = []
+        self.status = {}
+        self.busy = 0
+
+
+class Decoder:
+    """Frames of a session with the requests paired to their answers."""
+
+    def __init__(self, baud=0):
+        self.baud = baud
+        self.wire_end = 0.0
+        self.host = Stream(bp.PACKET_HOST_SIGN)
+        self.device = Stream(bp.PACKET_DEVICE_SIGN)
+        self.cmds = {}
+        self.pending = []
+        self.answer_ok = {}
+        self.device_frames = 0
+        self.answers = 0
+        self.damaged = 0
+        self.unmatched = 0
+        self.sync_bytes = 0
+        self.signed = None
+        self.written = 0
+        self.read = 0
+        self.bytes = {HOST: 0, DEVICE: 0}
+        self.first = None
+        self.last = None
+        self.gaps = []
+        self.last_frame = None
+
+    def stats(self, cmd):
+        return self.cmds.setdefault(cmd, CmdStats())
+
+    def feed(self, t, direction, data, gap=0.05):
+        # host bytes go on the wire after they are written, device bytes were on it before they
+        # are read; the line is busy with a chunk for its bytes at the baudrate
+        wire = len(data) * 10.0 / self.baud if self.baud else 0.0
+        start = max(t, self.wire_end) if direction == HOST else t - wire
+        if self.first is None:
+            self.first = t
+        elif start - self.wire_end >= gap:
+            self.gaps.append((start - self.wire_end, self.wire_end, self.last_frame))
+        self.last = t
+        self.wire_end = max(self.wire_end, start + wire)
+        self.bytes[direction] += len(data)
+        if direction == HOST:
+            if self.device_frames == 0:
+                self.sync_bytes += data.count(bp.SYNC_BYTE)
+            for start, frame in self.host.feed(t, data):
+                self.on_request(start, t, frame)
+        else:
+            if self.signed is None and bp.SYNC_ANSWER in data:
+                self.signed = t
+            for _, frame in self.device.feed(t, data):
+                self.on_answer(t, frame)
+
+    def on_request(self, start, end, frame):
+        self.last_frame = frame
+        st = self.stats(frame.cmd)
+        st.sent += 1
+        retransmit = frame.raw in self.answer_ok and not self.answer_ok[frame.raw]
+        if retransmit:
+            st.retransmits += 1
+            # the first copy is given up when the host sends it again
+            for req in self.pending:
+                if req.frame.raw == frame.raw:
+                    self.pending.remove(req)
+                    st.lost += 1
+                    break
+        elif frame.cmd in WRITE_HEADERS:
+            self.written += max(len(frame.data) - WRITE_HEADERS[frame.cmd], 0)
+        self.answer_ok[frame.raw] = False
+        # streamed frames are only answered when flash refuses them
+        if frame.cmd != bp.CMD_ARQ_WRITE:
+            self.pending.append(Request(frame, start, end, retransmit))
+
+    def on_answer(self, t, frame):
+        self.last_frame = frame
+        self.device_frames += 1
+        if not frame.crc_ok or frame.cmd != bp.CMD_MSG:
+            self.damaged += 1
+            return
+        if frame.status == bp.MSG_READY:
+            return
+        if frame.status != bp.MSG_ERR_CRC:
+            self.answers += 1
+        for req in self.pending:
+            if req.frame.cmd == frame.msg_cmd:
+                break
+        else:
+            if frame.msg_cmd == bp.CMD_ARQ_WRITE:
+                # a streamed frame that was refused, its request is not kept
+                st = self.stats(bp.CMD_ARQ_WRITE)
+                st.status[frame.status] = st.status.get(frame.status, 0) + 1
+            else:
+                self.unmatched += 1
+            return
+        st = self.stats(req.frame.cmd)
+        if frame.status == bp.MSG_BUSY:
+            st.busy += 1
+            return
+        self.pending.remove(req)
+        st.latency.append(t - req.end)
+        st.status[frame.status] = st.status.get(frame.status, 0) + 1
+        self.answer_ok[req.frame.raw] = frame.status != bp.MSG_ERR_CRC
+        if frame.status == bp.MSG_OK and req.frame.cmd in (bp.CMD_READ_PAGE, bp.CMD_READ_PAGES):
+            self.read += max(len(frame.msg_data) - 4, 0)
+        if frame.status == bp.MSG_OK and req.frame.cmd == bp.CMD_SET_FRAMING:
+            # the answer went in the old framing, both sides switch after it
+            framing = struct.unpack_from("<I", frame.msg_data, 0)[0]
+            self.host.set_framing(framing)
+            self.device.set_framing(framing)
+
+    def finish(self):
+        for req in self.pending:
+            self.stats(req.frame.cmd).lost += 1
+        self.pending = []
+
+
+def decode(trace, gap=0.05):
+    dec = Decoder(trace.baud)
+    for t, direction, data in trace.chunks:
+        dec.feed(t, direction, data, gap)
+    dec.finish()
+    return dec
+
+
+def report(dec, baud, out=sys.stdout, top=5):
+    span = (dec.last - dec.first) if dec.first is not None else 0.0
+    print("%-14s %6s %6s %5s %8s %8s %8s  %s" % ("command", "sent", "retx", "lost", "avg ms",
+                                                 "max ms", "busy", "answers"), file=out)
+    for cmd in sorted(dec.cmds, key=lambda c: -dec.cmds[c].sent):
+        st = dec.cmds[cmd]
+        lat = st.latency
+        answers = " ".join("%s:%d" % (bp.msg_name(s), n) for s, n in sorted(st.status.items()))
+        print("%-14s %6d %6d %5d %8s %8s %8d  %s" % (
+            bp.cmd_name(cmd), st.sent, st.retransmits, st.lost,
+            "%.2f" % (sum(lat) / len(lat) * 1e3) if lat else "-",
+            "%.2f" % (max(lat) * 1e3) if lat else "-", st.busy, answers), file=out)
+    retx = sum(st.retransmits for st in dec.cmds.values())
+    sent = sum(st.sent for st in dec.cmds.values())
+    print("frames: %d host (%d retransmitted), %d device (%d damaged, %d unmatched)" % (
+        sent, retx, dec.device_frames, dec.damaged, dec.unmatched), file=out)
+    if dec.signed is not None:
+        print("auto-baud: %d sync bytes, signature at %.3f s" % (dec.sync_bytes, dec.signed), file=out)
+    idle = sum(g for g, _, _ in dec.gaps)
+    print("idle gaps: %d, %.3f s of %.3f s" % (len(dec.gaps), idle, span), file=out)
+    for g, at, frame in sorted(dec.gaps, key=lambda g: -g[0])[:top]:
+        print("  %8.1f ms at %.3f s after %r" % (g * 1e3, at, frame), file=out)
+    line = ""
+    if baud and span > 0:
+        line = ", line busy %.0f%% / %.0f%%" % (dec.bytes[HOST] * 10.0 / baud / span * 100,
+                                              dec.bytes[DEVICE] * 10.0 / baud / span * 100)
+    print("wire: %d bytes host, %d bytes device%s" % (dec.bytes[HOST], dec.bytes[DEVICE], line),
+          file=out)
+    if span > 0:
+        print("throughput: %.1f kB/s written, %.1f kB/s read over %.3f s" % (
+            dec.written / span / 1024, dec.read / span / 1024, span), file=out)
+    return span
+
+
+# -- Capture ------------------------------------------------------------------
+def record(opts):
+    sim = None
+    path = opts.port
+    if opts.simulate:
+        sim, path = start_simulator(opts.baud, opts.spi, opts.ber)
+    if path is None:
+        print("no port given", file=sys.stderr)
+        return 1
+    trace = Trace(opts.baud)
+    dev = bp.open_port(path, opts.baud)
+    master, slave, pty_path = boot_sim.open_pty()
+    host = None
+    sel = selectors.DefaultSelector()
+    sel.register(master, selectors.EVENT_READ, (HOST, dev))
+    sel.register(dev, selectors.EVENT_READ, (DEVICE, master))
+    if opts.command:
+        cmd = [pty_path if a == "{port}" else a for a in opts.command]
+        host = subprocess.Popen(cmd)
+    else:
+        print(pty_path, flush=True)
+    signal.signal(signal.SIGTERM, lambda *_: sys.exit(0))
+    try:
+        while host is None or host.poll() is None:
+            for key, _ in sel.select(0.1):
+                direction, dst = key.data
+                try:
+                    data = os.read(key.fileobj, 4096)
+                except (BlockingIOError, OSError):
+                    continue
+                if data:
+                    trace.add(direction, data)
+                    os.write(dst, data)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        trace.save(opts.output)
+        os.close(dev)
+        os.close(master)
+        os.close(slave)
+        if sim is not None:
+            sim.terminate()
+            sim.wait()
+    print("%s: %d chunks" % (opts.output, len(trace.chunks)), file=sys.stderr)
+    return host.returncode if host is not None else 0
+
+
+# -- Replay -------------------------------------------------------------------
+def start_simulator(baud, spi=0, ber=0.0):
+    here = os.path.dirname(os.path.abspath(__file__))
+    cmd = [sys.executable, os.path.join(here, "boot_sim.py"), "--baud", str(baud)]
+    if spi:
+        cmd += ["--spi", str(spi)]
+    if ber:
+        cmd += ["--ber", str(ber)]
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, text=True)
+    path = None
+    for line in proc.stdout:
+        line = line.strip()
+        if line == "ready":
+            break
+        path = line
+    return proc, path
+
+
+def host_steps(trace):
+    """Host chunks with the number of answers seen when each was sent; answers to
+    damaged frames and damaged answers depend on the line and are not counted."""
+    dec = Decoder()
+    steps = []
+    for t, direction, data in trace.chunks:
+        if direction == HOST:
+            steps.append((dec.answers, data))
+        dec.feed(t, direction, data)
+    return steps
+
+
+def replay(opts):
+    recorded = Trace.load(opts.trace)
+    baud = opts.baud or recorded.baud or 460800
+    steps = host_steps(recorded)
+    sim, path = start_simulator(baud, opts.spi)
+    fd = bp.open_port(path, baud)
+    trace = Trace(baud)
+    dec = Decoder(baud)
+    try:
+        i = 0
+        waited = time.monotonic()
+        while True:
+            now = time.monotonic()
+            # the device may answer less than it did on the wire, then the host side goes on
+            while i < len(steps) and (dec.answers >= steps[i][0] or now - waited > opts.wait):
+                os.write(fd, steps[i][1])
+                trace.add(HOST, steps[i][1], now)
+                dec.feed(trace.chunks[-1][0], HOST, steps[i][1])
+                i += 1
+                waited = now
+            try:
+                data = os.read(fd, 4096)
+            except BlockingIOError:
+                data = b""
+            if data:
+                trace.add(DEVICE, data)
+                dec.feed(trace.chunks[-1][0], DEVICE, data)
+                waited = time.monotonic()
+            elif i >= len(steps) and time.monotonic() - waited > opts.wait:
+                break
+            else:
+                time.sleep(0.0002)
+    finally:
+        os.close(fd)
+        sim.terminate()
+        sim.wait()
+    if opts.output:
+        trace.save(opts.output)
+    rec_span = report(decode(recorded, opts.gap), recorded.baud, out=open(os.devnull, "w"))
+    span = report(decode(trace, opts.gap), baud)
+    print("replay %.3f s against %.3f s recorded" % (span, rec_span))
+    return 0
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    sub = ap.add_subparsers(dest="action", required=True)
+    rec = sub.add_parser("record", help="capture a session through a pty")
+    rec.add_argument("-p", "--port", help="serial port of the board")
+    rec.add_argument("-b", "--baud", type=int, default=460800)
+    rec.add_argument("-o", "--output", required=True, help="trace file")
+    rec.add_argument("--simulate", action="store_true", help="capture in front of a simulated board")
+    rec.add_argument("--spi", type=float, default=0, metavar="HZ",
+                     help="the simulated board is a BOOT_TRANSPORT_SPI build clocked at HZ")
+    rec.add_argument("--ber", type=float, default=0.0, help="bit error rate of the simulated link")
+    rec.add_argument("command", nargs=argparse.REMAINDER,
+                     help="host tool to run, {port} is replaced by the pty; "
+                          "without it the pty is printed and the capture runs until Ctrl-C")
+    an = sub.add_parser("analyze", help="decode a trace")
+    an.add_argument("trace")
+    an.add_argument("--gap", type=float, default=0.05, help="idle gaps from this long, s")
+    rep = sub.add_parser("replay", help="send the host side of a trace to a simulated board")
+    rep.add_argument("trace")
+    rep.add_argument("-b", "--baud", type=int, default=0, help="modelled UART rate, default as recorded")
+    rep.add_argument("--spi", type=float, default=0, metavar="HZ",
+                     help="replay against a BOOT_TRANSPORT_SPI build clocked at HZ")
+    rep.add_argument("-o", "--output", help="trace file of the replay")
+    rep.add_argument("--wait", type=float, default=1.0,
+                     help="give up waiting for a device frame after this long, s")
+    rep.add_argument("--gap", type=float, default=0.05, help="idle gaps from this long, s")
+    opts = ap.parse_args()
+
+    if opts.action == "record":
+        if opts.command and opts.command[0] == "--":
+            opts.command = opts.command[1:]
+        return record(opts)
+    if opts.action == "analyze":
+        trace = Trace.load(opts.trace)
+        report(decode(trace, opts.gap), trace.baud)
+        return 0
+    return replay(opts)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,834 @@
+"""
+Host side of the K1921VK035 bootloader protocol.
+
+Mirrors the constants of include/boot_conf.h, include/boot_flash.h,
+include/boot_journal.h, include/boot_kv.h and include/boot_packet.h and provides framing, CRC
+and a streaming frame parser shared by the host tools in this directory.
+
+Frame layout (both directions, multi-byte fields are little-endian):
+
+    sign:u16 | cmd:u8 | ~cmd:u8 | data_n:u16 | data[data_n] | crc:u16
+
+The CRC covers everything after the signature. Device answers are always
+CMD_MSG frames whose data starts with [status, cmd, 0x55, 0x55].
+
+After CMD_SET_FRAMING(FRAMING_COBS) the same frame without the signature is
+COBS encoded and enclosed in 0x00 delimiters:
+
+    0x00 | COBS(cmd | ~cmd | data_n | data | crc) | 0x00
+
+Bootloaders built with BOOT_USE_MULTIDROP take host frames with a node
+address in front of the command (covered by the CRC); 0xFFFF is executed by
+all nodes and never answered:
+
+    PACKET_HOST_ADDR_SIGN:u16 | addr:u16 | cmd:u8 | ~cmd:u8 | data_n:u16 | data | crc:u16
+"""
+
+import os
+import select
+import struct
+import termios
+import time
+import tty
+
+# -- boot_conf.h --------------------------------------------------------------
+PACKET_HOST_SIGN = 0x5C81
+PACKET_DEVICE_SIGN = 0x7EA3
+PACKET_EMPTY_DATA = 0x55
+PACKET_PAGES_MAX = 4
+PACKET_ERASE_PROGRESS = 8
+PACKET_TMP_DATA_BYTES = PACKET_PAGES_MAX * 1024 + 8
+# RX ring of a default build, CMD_GET_INFO_EXT reports the real size
+PACKET_FIFO_BYTES = 6632
+# RTS watermarks of BOOT_USE_FLOW_CTRL builds
+PACKET_FIFO_RTS_SLACK = 256
+PACKET_FIFO_RTS_OFF = PACKET_FIFO_BYTES - PACKET_FIFO_RTS_SLACK
+PACKET_FIFO_RTS_ON = PACKET_FIFO_BYTES // 2
+PACKET_HOST_ADDR_SIGN = 0x5C82
+PACKET_ADDR_BROADCAST = 0xFFFF
+SYNC_BYTE = 0x7F
+# boot_init() answers with the device signature bytes swapped
+SYNC_ANSWER = bytes([(PACKET_DEVICE_SIGN >> 8) & 0xFF, PACKET_DEVICE_SIGN & 0xFF])
+UART_TIMEOUT_S = 0.5
+ARQ_WINDOW = 32
+BATCH_CMDS_MAX = 32
+BATCH_ANSWER_BYTES = 64
+RAM_APP_BASE = 0x20000000  # BOOT_USE_RAM_RUN builds only
+RAM_APP_BYTES = 8192
+# PLL reference reported by CMD_GET_INFO
+CLK_OSI = 0
+CLK_OSE = 1
+CLK_NAMES = {CLK_OSI: "OSI", CLK_OSE: "OSE"}
+
+# -- boot_flash.h -------------------------------------------------------------
+FLASH_PAGE_SIZE_BYTES = 1024
+FLASH_PAGE_TOTAL = 64
+FLASH_TOTAL_BYTES = FLASH_PAGE_SIZE_BYTES * FLASH_PAGE_TOTAL
+FLASH_NVR_PAGE_TOTAL = 4
+FLASH_NVR_TOTAL_BYTES = FLASH_PAGE_SIZE_BYTES * FLASH_NVR_PAGE_TOTAL
+FLASH_NVR_CFGWORD_OFFSET = 3 * FLASH_PAGE_SIZE_BYTES
+FLASH_NVR_BOOT_PAGES = 3  # NVR pages holding the bootloader itself
+FLASH_NVR_NODE_ADDR_OFFSET = FLASH_NVR_CFGWORD_OFFSET + 8
+FLASH_KV_PAGE = FLASH_PAGE_TOTAL - 2
+FLASH_JOURNAL_PAGE = FLASH_PAGE_TOTAL - 3
+# main flash pages of the application in a BOOT_USE_JOURNAL build, CMD_GET_INFO_EXT reports them
+FLASH_APP_PAGE_TOTAL = FLASH_JOURNAL_PAGE
+
+FLASH_MAIN = 0
+FLASH_NVR = 1
+
+CFGWORD_NVRWE_MSK = 1 << 2
+CFGWORD_FLASHWE_MSK = 1 << 3
+CFGWORD_NVRRE_MSK = 1 << 6
+CFGWORD_FLASHRE_MSK = 1 << 7
+
+# Erase/program timings from boot_flash.c, seconds
+FLASH_T_WRITE_DWORD = 42.5e-6
+FLASH_T_ERASE_PAGE = 4.570e-3
+FLASH_T_ERASE_FULL = 35.071e-3
+# CMD_ERASE_FULL of a BOOT_USE_KV build erases the pages below the key-value log one by one
+FLASH_T_ERASE_FULL_KV = FLASH_KV_PAGE * FLASH_T_ERASE_PAGE
+
+# -- boot_journal.h -----------------------------------------------------------
+JOURNAL_ADDR = FLASH_JOURNAL_PAGE * FLASH_PAGE_SIZE_BYTES
+JOURNAL_ENTRY_TOTAL = FLASH_PAGE_SIZE_BYTES // 8
+JOURNAL_TAG_MSK = 0xFFFF0000
+JOURNAL_TAG_WRITTEN = 0x4A570000
+JOURNAL_TAG_STALE = 0x4A580000
+JOURNAL_TAG_CLEAR = 0x4A430000
+
+# -- boot_kv.h ----------------------------------------------------------------
+KV_KEY_TOTAL = 32
+KV_HEADER_MAGIC = 0x4C4F564B
+KV_RECORD_TOTAL = FLASH_PAGE_SIZE_BYTES // 8 - 1
+
+
+def kv_page_addr(page):
+    """Main flash address of page 0 or 1 of the key-value log."""
+    return (FLASH_KV_PAGE + page) * FLASH_PAGE_SIZE_BYTES
+
+
+def kv_header(gen):
+    """Header double word committing a page of the key-value log."""
+    gen &= 0xFFFF
+    return KV_HEADER_MAGIC, gen | ((~gen & 0xFFFF) << 16)
+
+
+def kv_record(key, value):
+    """Second word of a key-value record, see kv_record() of boot_kv.c."""
+    check = (value ^ (value >> 16) ^ (key * 0x9E37) ^ 0x5A5A) & 0xFFFF
+    return key | ((~key & 0xFF) << 8) | (check << 16)
+
+
+# -- boot_app.h ---------------------------------------------------------------
+APP_HDR_OFFSET = 0x1C  # reserved vectors 7 .. 9 of the application vector table
+APP_HDR_BYTES = 12
+APP_HDR_MAGIC = 0x48505041
+APP_KV_KEY = KV_KEY_TOTAL - 1
+
+
+def app_digest(image):
+    """CRC16 of an application image without its header, see app_digest() of boot_app.c."""
+    return crc16(image[APP_HDR_OFFSET + APP_HDR_BYTES:], crc16(image[:APP_HDR_OFFSET]))
+
+
+def app_header(length, crc):
+    """Header bytes at APP_HDR_OFFSET: magic, length, CRC16 with its complement."""
+    return struct.pack("<III", APP_HDR_MAGIC, length, crc | ((~crc & 0xFFFF) << 16))
+
+
+def app_mark(length, crc):
+    """Key-value marker of a validated image, see APP_MARK() of boot_app.h."""
+    return ((length >> 3) << 16) | crc
+
+
+# -- boot_packet.h ------------------------------------------------------------
+CMD_WRITE_PAGE_OPT_ERASE_MSK = 1 << 6
+CMD_WRITE_PAGE_OPT_NVR_MSK = 1 << 7
+CMD_READ_PAGE_OPT_NVR_MSK = CMD_WRITE_PAGE_OPT_NVR_MSK
+CMD_ARQ_POLL_OPT_RESET_MSK = 1 << 0
+CMD_PAGE_STATUS_OPT_CLEAR_MSK = 1 << 0
+
+CMD_GET_INFO = 0x35
+CMD_GET_INFO_EXT = 0x36
+CMD_GET_CFGWORD = 0x3A
+CMD_SET_CFGWORD = 0x65
+CMD_WRITE_PAGE = 0x9A
+CMD_WRITE_PAGES = 0x9C
+CMD_WRITE_RANGE = 0x99
+CMD_FLUSH = 0x66
+CMD_PAGE_STATUS = 0x56
+CMD_READ_PAGE = 0xA5
+CMD_READ_PAGES = 0xAC
+CMD_ERASE_FULL = 0xC5
+CMD_ERASE_PAGE = 0xCA
+CMD_ERASE_RANGE = 0xCC
+CMD_SET_FRAMING = 0x3C
+CMD_ARQ_WRITE = 0x96
+CMD_ARQ_POLL = 0x69
+CMD_WRITE_SESSION = 0x95
+CMD_GET_JOURNAL = 0x39
+CMD_KV_GET = 0x53
+CMD_KV_SET = 0x6A
+CMD_RAM_WRITE = 0x93
+CMD_VALIDATE = 0xA9
+CMD_BATCH = 0x59
+CMD_ECHO = 0xA6
+CMD_TEST_STREAM = 0xAA
+CMD_RAM_RUN = 0xF3
+CMD_NONE = 0x00
+CMD_EXIT = 0xF5
+CMD_MSG = 0xFA
+
+CMD_NAMES = {
+    CMD_GET_INFO: "GET_INFO",
+    CMD_GET_INFO_EXT: "GET_INFO_EXT",
+    CMD_GET_CFGWORD: "GET_CFGWORD",
+    CMD_SET_CFGWORD: "SET_CFGWORD",
+    CMD_WRITE_PAGE: "WRITE_PAGE",
+    CMD_WRITE_PAGES: "WRITE_PAGES",
+    CMD_WRITE_RANGE: "WRITE_RANGE",
+    CMD_FLUSH: "FLUSH",
+    CMD_PAGE_STATUS: "PAGE_STATUS",
+    CMD_READ_PAGE: "READ_PAGE",
+    CMD_READ_PAGES: "READ_PAGES",
+    CMD_ERASE_FULL: "ERASE_FULL",
+    CMD_ERASE_PAGE: "ERASE_PAGE",
+    CMD_ERASE_RANGE: "ERASE_RANGE",
+    CMD_SET_FRAMING: "SET_FRAMING",
+    CMD_ARQ_WRITE: "ARQ_WRITE",
+    CMD_ARQ_POLL: "ARQ_POLL",
+    CMD_WRITE_SESSION: "WRITE_SESSION",
+    CMD_GET_JOURNAL: "GET_JOURNAL",
+    CMD_KV_GET: "KV_GET",
+    CMD_KV_SET: "KV_SET",
+    CMD_RAM_WRITE: "RAM_WRITE",
+    CMD_RAM_RUN: "RAM_RUN",
+    CMD_VALIDATE: "VALIDATE",
+    CMD_BATCH: "BATCH",
+    CMD_ECHO: "ECHO",
+    CMD_TEST_STREAM: "TEST_STREAM",
+    CMD_NONE: "NONE",
+    CMD_EXIT: "EXIT",
+    CMD_MSG: "MSG",
+}
+
+MSG_NONE = 0
+MSG_ERR_CMD = 1
+MSG_ERR_CRC = 2
+MSG_READY = 3
+MSG_OK = 4
+MSG_FAIL = 5
+MSG_ERR_LEN = 6
+MSG_BUSY = 7
+
+MSG_NAMES = {
+    MSG_NONE: "NONE",
+    MSG_ERR_CMD: "ERR_CMD",
+    MSG_ERR_CRC: "ERR_CRC",
+    MSG_READY: "READY",
+    MSG_OK: "OK",
+    MSG_FAIL: "FAIL",
+    MSG_ERR_LEN: "ERR_LEN",
+    MSG_BUSY: "BUSY",
+}
+
+FRAMING_SIGN = 0
+FRAMING_COBS = 1
+
+
+def cmd_name(cmd):
+    return CMD_NAMES.get(cmd, "0x%02X" % cmd)
+
+
+def msg_name(status):
+    return MSG_NAMES.get(status, "0x%02X" % status)
+
+
+# -- CRC ----------------------------------------------------------------------
+def _crc_table():
+    table = []
+    for high in range(256):
+        crc = high << 8
+        for _ in range(8):
+            crc <<= 1
+            if crc & 0x10000:
+                crc ^= 0x11021
+        table.append(crc)
+    return table
+
+
+_CRC_TABLE = _crc_table()
+
+
+def crc_upd(crc, data):
+    """Same result as crc_upd() in boot_packet.c, table driven."""
+    return (((crc << 8) | data) ^ _CRC_TABLE[crc >> 8]) & 0xFFFF
+
+
+def crc16(data, crc=0):
+    table = _CRC_TABLE
+    for b in data:
+        crc = (((crc << 8) | b) ^ table[crc >> 8]) & 0xFFFF
+    return crc
+
+
+# -- COBS ---------------------------------------------------------------------
+def cobs_encode(data):
+    out = bytearray()
+    pos = 0
+    n = len(data)
+    while True:
+        run = 0
+        while pos + run < n and run < 254 and data[pos + run]:
+            run += 1
+        out.append(run + 1)
+        out += data[pos:pos + run]
+        pos += run
+        if pos == n:
+            return bytes(out)
+        if run < 254:
+            pos += 1
+
+
+def cobs_decode(data):
+    """Decode one COBS block sequence (without delimiters), None if broken."""
+    out = bytearray()
+    pos = 0
+    n = len(data)
+    while pos < n:
+        code = data[pos]
+        if code == 0 or pos + code > n:
+            return None
+        out += data[pos + 1:pos + code]
+        pos += code
+        if code != 0xFF and pos < n:
+            out.append(0)
+    return bytes(out)
+
+
+# -- Framing ------------------------------------------------------------------
+def build_frame(cmd, data=b"", sign=PACKET_HOST_SIGN, framing=FRAMING_SIGN, addr=None):
+    body = bytes([cmd, cmd ^ 0xFF]) + struct.pack("<H", len(data)) + bytes(data)
+    if addr is not None:
+        body = struct.pack("<H", addr) + body
+        sign = PACKET_HOST_ADDR_SIGN
+    body += struct.pack("<H", crc16(body))
+    if framing == FRAMING_COBS:
+        return b"\0" + cobs_encode(body) + b"\0"
+    return struct.pack("<H", sign) + body
+
+
+def to_cobs(frame):
+    """Re-frame a signature framed packet as COBS."""
+    return b"\0" + cobs_encode(frame[2:]) + b"\0"
+
+
+def to_addressed(frame, addr, framing=FRAMING_SIGN):
+    """Re-frame a signature framed host packet for node addr of a multidrop bus."""
+    body = struct.pack("<H", addr) + frame[2:-2]
+    body += struct.pack("<H", crc16(body))
+    if framing == FRAMING_COBS:
+        return b"\0" + cobs_encode(body) + b"\0"
+    return struct.pack("<H", PACKET_HOST_ADDR_SIGN) + body
+
+
+def build_msg(status, cmd, data=b"", framing=FRAMING_SIGN):
+    """Device answer frame, as produced by msg_cmd() in boot_core.c."""
+    payload = bytes([status, cmd, PACKET_EMPTY_DATA, PACKET_EMPTY_DATA]) + bytes(data)
+    return build_frame(CMD_MSG, payload, PACKET_DEVICE_SIGN, framing)
+
+
+def addr_word(addr, nvr=False, erase=False):
+    cfg = 0
+    if nvr:
+        cfg |= CMD_WRITE_PAGE_OPT_NVR_MSK
+    if erase:
+        cfg |= CMD_WRITE_PAGE_OPT_ERASE_MSK
+    return (cfg << 24) | (addr & 0x00FFFFFF)
+
+
+def frame_get_info():
+    return build_frame(CMD_GET_INFO)
+
+
+class Info:
+    """
+    Identification from a CMD_GET_INFO answer. clock is the PLL reference,
+    CLK_OSI or CLK_OSE, None for bootloaders that do not report it.
+    """
+
+    def __init__(self, msg_data):
+        self.chipid, self.cpuid, self.boot_ver = struct.unpack_from("<3I", msg_data, 0)
+        name = msg_data[12:]
+        end = name.find(b"\0")
+        self.name = name[:end].decode("ascii", "replace")
+        # the name is followed by two zero bytes, then the clock source
+        self.clock = name[end + 2] if end >= 0 and len(name) > end + 2 else None
+
+
+def frame_get_info_ext():
+    return build_frame(CMD_GET_INFO_EXT)
+
+
+class InfoExt:
+    """
+    Capabilities from a CMD_GET_INFO_EXT answer. Bootloaders without the
+    command are described by InfoExt.legacy().
+    """
+
+    def __init__(self, msg_data=None):
+        if msg_data is None:
+            return
+        (self.boot_ver, self.data_max, self.fifo_bytes, self.baud_max, self.page_size,
+         self.pages, self.nvr_pages, self.pages_max, framings) = struct.unpack_from("<9I", msg_data, 0)
+        self.framings = {f for f in (FRAMING_SIGN, FRAMING_COBS) if framings >> f & 1}
+        n = msg_data[36]
+        self.cmds = set(msg_data[37:37 + n])
+
+    @classmethod
+    def legacy(cls):
+        info = cls()
+        info.boot_ver = None
+        info.data_max = FLASH_PAGE_SIZE_BYTES + 8
+        info.fifo_bytes = 8192
+        info.baud_max = None
+        info.page_size = FLASH_PAGE_SIZE_BYTES
+        info.pages = FLASH_PAGE_TOTAL
+        info.nvr_pages = FLASH_NVR_PAGE_TOTAL
+        info.pages_max = 1
+        info.framings = {FRAMING_SIGN}
+        info.cmds = None
+        return info
+
+    def supports(self, cmd):
+        return self.cmds is not None and cmd in self.cmds
+
+
+def frame_get_cfgword():
+    return build_frame(CMD_GET_CFGWORD)
+
+
+def frame_set_cfgword(cfgword):
+    return build_frame(CMD_SET_CFGWORD, struct.pack("<I", cfgword))
+
+
+def frame_write_page(addr, data, nvr=False, erase=False):
+    if len(data) != FLASH_PAGE_SIZE_BYTES:
+        raise ValueError("page data must be %d bytes" % FLASH_PAGE_SIZE_BYTES)
+    return build_frame(CMD_WRITE_PAGE, struct.pack("<I", addr_word(addr, nvr, erase)) + data)
+
+
+def frame_write_pages(addr, data, nvr=False, erase=False):
+    """Consecutive pages in one packet, up to PACKET_PAGES_MAX of the device."""
+    if not data or len(data) % FLASH_PAGE_SIZE_BYTES:
+        raise ValueError("data must be whole pages of %d bytes" % FLASH_PAGE_SIZE_BYTES)
+    return build_frame(CMD_WRITE_PAGES, struct.pack("<I", addr_word(addr, nvr, erase)) + data)
+
+
+def frame_write_range(addr, data, nvr=False):
+    """Bytes inside one page, merged in the device page cache."""
+    page_left = FLASH_PAGE_SIZE_BYTES - (addr & (FLASH_PAGE_SIZE_BYTES - 1))
+    if not 0 < len(data) <= page_left:
+        raise ValueError("range must hold 1..%d bytes" % page_left)
+    return build_frame(CMD_WRITE_RANGE, struct.pack("<I", addr_word(addr, nvr)) + data)
+
+
+def frame_flush():
+    return build_frame(CMD_FLUSH)
+
+
+def frame_page_status(clear=False):
+    return build_frame(CMD_PAGE_STATUS, struct.pack("<I", CMD_PAGE_STATUS_OPT_CLEAR_MSK if clear else 0))
+
+
+def page_status_pages(msg_data):
+    """Node address and sets of main / NVR page indexes from a CMD_PAGE_STATUS answer."""
+    addr, main_lo, main_hi, nvr = struct.unpack_from("<IIII", msg_data, 0)
+    main = main_lo | (main_hi << 32)
+    return (addr & 0xFFFF, {i for i in range(FLASH_PAGE_TOTAL) if main >> i & 1},
+            {i for i in range(FLASH_NVR_PAGE_TOTAL) if nvr >> i & 1})
+
+
+def frame_get_journal():
+    return build_frame(CMD_GET_JOURNAL)
+
+
+def journal_entry(page, crc, tag=JOURNAL_TAG_WRITTEN):
+    """One journal double word as stored in NVR."""
+    return struct.pack("<II", tag | page, crc | ((~crc & 0xFFFF) << 16))
+
+
+def journal_pages(msg_data):
+    """{main page index: CRC16} of the pages whose last entry in a CMD_GET_JOURNAL answer is written."""
+    n = struct.unpack_from("<I", msg_data, 0)[0]
+    pages = {}
+    for i in range(n):
+        word, crc = struct.unpack_from("<II", msg_data, 4 + i * 8)
+        page = word & 0xFFFF
+        if word & JOURNAL_TAG_MSK == JOURNAL_TAG_WRITTEN:
+            pages[page] = crc & 0xFFFF
+        else:
+            pages.pop(page, None)
+    return pages
+
+
+def frame_kv_get(key):
+    return build_frame(CMD_KV_GET, struct.pack("<I", key))
+
+
+def frame_kv_set(key, value):
+    return build_frame(CMD_KV_SET, struct.pack("<II", key, value))
+
+
+def frame_read_page(addr, nvr=False):
+    return build_frame(CMD_READ_PAGE, struct.pack("<I", addr_word(addr, nvr)))
+
+
+def frame_read_pages(addr, count, nvr=False):
+    return build_frame(CMD_READ_PAGES, struct.pack("<II", addr_word(addr, nvr), count))
+
+
+def frame_erase_page(addr, nvr=False):
+    return build_frame(CMD_ERASE_PAGE, struct.pack("<I", addr_word(addr, nvr)))
+
+
+def frame_erase_range(addr, count, nvr=False):
+    """count pages from addr, MSG_BUSY answers report progress before the final one."""
+    return build_frame(CMD_ERASE_RANGE, struct.pack("<II", addr_word(addr, nvr), count))
+
+
+def frame_write_session(addr, count, nvr=False):
+    """Pages written next are erased ahead by the device, count 0 closes the session."""
+    return build_frame(CMD_WRITE_SESSION, struct.pack("<II", addr_word(addr, nvr), count))
+
+
+def frame_erase_full():
+    return build_frame(CMD_ERASE_FULL, struct.pack("<I", 0))
+
+
+def frame_exit():
+    return build_frame(CMD_EXIT)
+
+
+def frame_ram_write(offset, data):
+    """Bytes of a RAM application at offset from RAM_APP_BASE."""
+    if not data:
+        raise ValueError("no data")
+    return build_frame(CMD_RAM_WRITE, struct.pack("<I", offset) + data)
+
+
+def frame_ram_run(size, crc):
+    """Check the first size bytes of the RAM application against crc and start it."""
+    return build_frame(CMD_RAM_RUN, struct.pack("<II", size, crc))
+
+
+def frame_validate():
+    """Digest of the application image on the device, marks it for BOOTEN when it matches the header."""
+    return build_frame(CMD_VALIDATE)
+
+
+def batch_entry(frame):
+    """cmd:u8 | data_n:u16 | data of a signature framed host frame."""
+    return frame[2:3] + frame[4:-2]
+
+
+def frame_batch(frames):
+    """
+    Commands of signature framed host frames in one CMD_BATCH. The device
+    runs them in order and stops at the first one not answering MSG_OK, the
+    answer data is the status of every command it ran.
+    """
+    return build_frame(CMD_BATCH, b"".join(batch_entry(f) for f in frames))
+
+
+def batches(frames, data_max=PACKET_TMP_DATA_BYTES):
+    """Split frames into lists that fit one CMD_BATCH each, data_max of the device."""
+    out = []
+    size = 0
+    for frame in frames:
+        n = len(batch_entry(frame))
+        if not out or len(out[-1]) == BATCH_CMDS_MAX or size + n > data_max - BATCH_ANSWER_BYTES:
+            out.append([])
+            size = 0
+        out[-1].append(frame)
+        size += n
+    return out
+
+
+def frame_echo(data):
+    return build_frame(CMD_ECHO, data)
+
+
+def frame_test_stream(count, size, seed):
+    """count MSG_BUSY frames of seq:u32 | size bytes of the pattern, then the link counters."""
+    return build_frame(CMD_TEST_STREAM, struct.pack("<HHI", count, size, seed))
+
+
+def stream_pattern(state, size):
+    """(size bytes of the xorshift32 pattern of test_stream_cmd(), next state)."""
+    words = []
+    for _ in range(size // 4):
+        state ^= (state << 13) & 0xFFFFFFFF
+        state ^= state >> 17
+        state ^= (state << 5) & 0xFFFFFFFF
+        words.append(state)
+    return struct.pack("<%dI" % len(words), *words), state
+
+
+class LinkStats:
+    """Link error counters of the device from the final CMD_TEST_STREAM answer."""
+
+    def __init__(self, msg_data):
+        self.frames, self.crc_errors, self.hdr_errors, self.lost = struct.unpack_from("<4I", msg_data, 0)
+
+    def __sub__(self, other):
+        out = LinkStats(bytes(16))
+        for name in ("frames", "crc_errors", "hdr_errors", "lost"):
+            setattr(out, name, getattr(self, name) - getattr(other, name))
+        return out
+
+
+def frame_set_framing(framing):
+    return build_frame(CMD_SET_FRAMING, bytes([framing]))
+
+
+def frame_arq_write(seq, addr, data, nvr=False, erase=False, framing=FRAMING_SIGN):
+    if len(data) != FLASH_PAGE_SIZE_BYTES:
+        raise ValueError("page data must be %d bytes" % FLASH_PAGE_SIZE_BYTES)
+    payload = struct.pack("<I", addr_word(addr, nvr, erase)) + data + struct.pack("<H", seq & 0xFFFF)
+    return build_frame(CMD_ARQ_WRITE, payload, framing=framing)
+
+
+def frame_arq_poll(base, tag=0, reset=False, framing=FRAMING_SIGN):
+    opt = (tag & 0x7FFF) << 1
+    if reset:
+        opt |= CMD_ARQ_POLL_OPT_RESET_MSK
+    return build_frame(CMD_ARQ_POLL, struct.pack("<HH", base & 0xFFFF, opt), framing=framing)
+
+
+class Frame:
+    """A frame found on the wire."""
+
+    __slots__ = ("sign", "cmd", "data", "crc_ok", "raw", "addr")
+
+    def __init__(self, sign, cmd, data, crc_ok, raw, addr=None):
+        self.sign = sign
+        self.cmd = cmd
+        self.data = data
+        self.crc_ok = crc_ok
+        self.raw = raw
+        self.addr = addr
+
+    # CMD_MSG helpers
+    @property
+    def status(self):
+        return self.data[0] if self.data else MSG_NONE
+
+    @property
+    def msg_cmd(self):
+        return self.data[1] if len(self.data) > 1 else CMD_NONE
+
+    @property
+    def msg_data(self):
+        return self.data[4:]
+
+    def __repr__(self):
+        if self.cmd == CMD_MSG:
+            return "<MSG %s for %s, %d bytes%s>" % (
+                msg_name(self.status), cmd_name(self.msg_cmd), len(self.data),
+                "" if self.crc_ok else ", bad crc")
+        return "<%s %d bytes%s>" % (cmd_name(self.cmd), len(self.data),
+                                     "" if self.crc_ok else ", bad crc")
+
+
+class FrameParser:
+    """
+    Incremental parser for one direction of the link.
+
+    feed() accepts arbitrary chunks and returns the frames completed by them.
+    Like the RX interrupt of the bootloader it hunts for the signature byte by byte, so garbage
+    between frames (for example the auto-baud answer) is skipped. With
+    addressed set the node address follows the signature.
+    """
+
+    def __init__(self, sign=PACKET_DEVICE_SIGN, max_data=0xFFFF, addressed=False):
+        self.sign = struct.pack("<H", sign)
+        self.sign_value = sign
+        self.max_data = max_data
+        self.hdr = 8 if addressed else 6
+        self.buf = bytearray()
+        self.skipped = 0
+
+    def feed(self, chunk):
+        self.buf += chunk
+        frames = []
+        while True:
+            pos = self.buf.find(self.sign)
+            if pos < 0:
+                keep = 1 if self.buf[-1:] == self.sign[:1] else 0
+                self.skipped += len(self.buf) - keep
+                del self.buf[:len(self.buf) - keep]
+                return frames
+            if pos:
+                self.skipped += pos
+                del self.buf[:pos]
+            hdr = self.hdr
+            if len(self.buf) < hdr:
+                return frames
+            cmd, cmd_inv, data_n = struct.unpack_from("<BBH", self.buf, hdr - 4)
+            if cmd ^ cmd_inv != 0xFF or data_n > self.max_data:
+                # not a header, resume the hunt one byte further
+                self.skipped += 1
+                del self.buf[:1]
+                continue
+            total = hdr + data_n + 2
+            if len(self.buf) < total:
+                return frames
+            raw = bytes(self.buf[:total])
+            del self.buf[:total]
+            crc = struct.unpack_from("<H", raw, total - 2)[0]
+            addr = struct.unpack_from("<H", raw, 2)[0] if hdr == 8 else None
+            frames.append(Frame(self.sign_value, cmd, raw[hdr:hdr + data_n],
+                                crc == crc16(raw[2:total - 2]), raw, addr))
+
+
+class CobsFrameParser:
+    """
+    Incremental parser for COBS framed packets.
+
+    A damaged frame is dropped at the next delimiter; frames that decode but
+    fail the CRC are returned with crc_ok False.
+    """
+
+    def __init__(self, sign=PACKET_DEVICE_SIGN, max_data=0xFFFF, addressed=False):
+        self.sign_value = sign
+        self.max_data = max_data
+        self.addr_n = 2 if addressed else 0
+        self.buf = bytearray()
+        self.skipped = 0
+
+    def feed(self, chunk):
+        frames = []
+        self.buf += chunk
+        while True:
+            end = self.buf.find(b"\0")
+            if end < 0:
+                return frames
+            enc = bytes(self.buf[:end])
+            del self.buf[:end + 1]
+            if not enc:
+                continue
+            frame = self._decode(enc)
+            if frame is None:
+                self.skipped += len(enc) + 1
+            else:
+                frames.append(frame)
+
+    def _decode(self, enc):
+        body = cobs_decode(enc)
+        a = self.addr_n
+        if body is None or len(body) < a + 6:
+            return None
+        cmd, cmd_inv, data_n = struct.unpack_from("<BBH", body, a)
+        if cmd ^ cmd_inv != 0xFF or data_n > self.max_data or len(body) != a + data_n + 6:
+            return None
+        crc = struct.unpack_from("<H", body, len(body) - 2)[0]
+        addr = struct.unpack_from("<H", body, 0)[0] if a else None
+        return Frame(self.sign_value, cmd, body[a + 4:a + 4 + data_n],
+                     crc == crc16(body[:-2]), b"\0" + enc + b"\0", addr)
+
+
+def make_parser(framing, sign=PACKET_DEVICE_SIGN, addressed=False):
+    if framing == FRAMING_COBS:
+        return CobsFrameParser(sign, addressed=addressed)
+    return FrameParser(sign, addressed=addressed)
+
+
+# -- Serial ports -------------------------------------------------------------
+def _baud_const(baud):
+    name = "B%d" % baud
+    if not hasattr(termios, name):
+        raise ValueError("unsupported baudrate %d" % baud)
+    return getattr(termios, name)
+
+
+def open_port(path, baud, blocking=False, rtscts=False):
+    """Open a serial port (or pty) in raw 8N1 mode and return its fd."""
+    flags = os.O_RDWR | os.O_NOCTTY
+    if not blocking:
+        flags |= os.O_NONBLOCK
+    fd = os.open(path, flags)
+    try:
+        tty.setraw(fd)
+        attrs = termios.tcgetattr(fd)
+        attrs[2] &= ~(termios.CSTOPB | termios.PARENB | termios.CSIZE)
+        attrs[2] |= termios.CS8 | termios.CLOCAL | termios.CREAD
+        if rtscts:
+            attrs[2] |= termios.CRTSCTS
+        speed = _baud_const(baud)
+        attrs[4] = attrs[5] = speed
+        termios.tcsetattr(fd, termios.TCSANOW, attrs)
+        termios.tcflush(fd, termios.TCIOFLUSH)
+    except termios.error:
+        # ptys ignore line settings, that is fine
+        pass
+    except Exception:
+        os.close(fd)
+        raise
+    return fd
+
+
+# -- Blocking client ----------------------------------------------------------
+class LinkError(Exception):
+    pass
+
+
+class Link:
+    """Blocking request / answer exchange with one bootloader."""
+
+    def __init__(self, path, baud, timeout, retries):
+        self.fd = open_port(path, baud, blocking=True)
+        self.byte_time = 10.0 / baud
+        self.timeout = timeout
+        self.retries = retries
+        self.parser = FrameParser(PACKET_DEVICE_SIGN)
+
+    def close(self):
+        os.close(self.fd)
+
+    def _answer(self, cmd, timeout):
+        deadline = time.monotonic() + timeout
+        while True:
+            left = deadline - time.monotonic()
+            if left <= 0:
+                return None
+            r, _, _ = select.select([self.fd], [], [], left)
+            if not r:
+                continue
+            for answer in self.parser.feed(os.read(self.fd, 65536)):
+                if answer.crc_ok and answer.cmd == CMD_MSG and answer.msg_cmd == cmd:
+                    return answer
+
+    def sync(self):
+        for _ in range(self.retries + 1):
+            os.write(self.fd, bytes([SYNC_BYTE]))
+            if self._answer(CMD_NONE, self.timeout) is not None:
+                return
+        raise LinkError("no answer to auto-baud")
+
+    def request(self, frame, what, busy=0.0, accept=(MSG_OK,)):
+        """Send frame and return its answer with a status from accept."""
+        cmd = frame[2]
+        for _ in range(self.retries + 1):
+            os.write(self.fd, frame)
+            answer = self._answer(cmd, self.timeout + busy + len(frame) * self.byte_time)
+            # progress of a long command keeps the wait going without a resend
+            while answer is not None and answer.status == MSG_BUSY:
+                answer = self._answer(cmd, self.timeout + busy)
+            if answer is None or answer.status == MSG_ERR_CRC:
+                continue
+            if answer.status in accept:
+                return answer
+            raise LinkError("%s answered %s" % (what, msg_name(answer.status)))
+        raise LinkError("%s failed after %d tries" % (what, self.retries + 1))
@@ -0,0 +1,254 @@
+#!/usr/bin/env python3
+"""
+Flash every node of an RS-485 multidrop bus with one broadcast of the image.
+
+The nodes run bootloaders built with BOOT_USE_MULTIDROP. All pages go out
+once addressed to PACKET_ADDR_BROADCAST, which every node executes and none
+answers, paced so that no node FIFO overflows while its flash is busy. Then
+every node is asked for its CMD_PAGE_STATUS bitmap and only the pages it
+missed are sent again, addressed to that node alone. The time for the whole
+bus therefore stays close to the time for one board.
+
+    bus_flasher.py -b 460800 -i firmware.bin --nodes 1-16 /dev/ttyUSB0
+    bus_flasher.py -i firmware.bin --simulate 16 --ber 1e-6
+"""
+
+import argparse
+import collections
+import os
+import select
+import subprocess
+import sys
+import time
+
+import bootproto as bp
+import image_plan
+
+BROADCAST = bp.PACKET_ADDR_BROADCAST
+
+
+class BusError(Exception):
+    pass
+
+
+class Bus:
+    """Serial port of the bus with a model of what the nodes still have to do."""
+
+    def __init__(self, path, baud, margin):
+        self.fd = bp.open_port(path, baud, blocking=True)
+        self.byte_time = 10.0 / baud
+        self.margin = margin
+        self.parser = bp.FrameParser(bp.PACKET_DEVICE_SIGN)
+        # end of the last byte on the line and of the last broadcast on the nodes
+        self.line_free = 0.0
+        self.node_free = 0.0
+        # broadcast packets not yet read from the node FIFO: (read time, bytes)
+        self.fifo = collections.deque()
+
+    def close(self):
+        os.close(self.fd)
+
+    def write(self, data):
+        now = time.monotonic()
+        os.write(self.fd, data)
+        self.line_free = max(now, self.line_free) + len(data) * self.byte_time
+        return self.line_free
+
+    def sync(self):
+        # nodes measure the first byte and stay quiet, a few spare bytes are skipped as garbage
+        for _ in range(3):
+            self.write(bytes([bp.SYNC_BYTE]))
+            time.sleep(0.01)
+
+    def broadcast(self, frame, busy):
+        """Send frame to all nodes once the FIFO of a node has room for it."""
+        frame = bp.to_addressed(frame, BROADCAST)
+        while True:
+            now = time.monotonic()
+            arrive = max(now, self.line_free) + len(frame) * self.byte_time
+            while self.fifo and self.fifo[0][0] <= arrive:
+                self.fifo.popleft()
+            if sum(n for _, n in self.fifo) + len(frame) <= bp.PACKET_FIFO_BYTES:
+                break
+            time.sleep(max(self.fifo[0][0] - arrive, 0.0005))
+        arrive = self.write(frame)
+        start = max(arrive, self.node_free)
+        self.node_free = start + busy * self.margin
+        self.fifo.append((start, len(frame)))
+
+    def drain(self):
+        """Wait until every node has executed all broadcasts."""
+        delay = self.node_free - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+        self.fifo.clear()
+
+    def request(self, frame, node, timeout, retries, what):
+        """Send frame to one node and return its MSG_OK answer."""
+        frame = bp.to_addressed(frame, node)
+        cmd = frame[4]
+        for _ in range(retries + 1):
+            self.write(frame)
+            deadline = self.line_free + timeout
+            while True:
+                left = deadline - time.monotonic()
+                if left <= 0:
+                    break
+                r, _, _ = select.select([self.fd], [], [], left)
+                if not r:
+                    continue
+                for answer in self.parser.feed(os.read(self.fd, 65536)):
+                    if not answer.crc_ok or answer.cmd != bp.CMD_MSG or answer.msg_cmd != cmd:
+                        continue
+                    if answer.status == bp.MSG_OK:
+                        return answer
+                    if answer.status == bp.MSG_FAIL:
+                        raise BusError("%s refused by node %d" % (what, node))
+                    deadline = 0
+                    break
+        raise BusError("%s failed on node %d after %d tries" % (what, node, retries + 1))
+
+
+def write_busy(erase):
+    return (bp.FLASH_T_ERASE_PAGE if erase else 0.0) + \
+        bp.FLASH_PAGE_SIZE_BYTES // 8 * bp.FLASH_T_WRITE_DWORD
+
+
+def parse_nodes(text):
+    nodes = []
+    for part in text.split(","):
+        lo, _, hi = part.partition("-")
+        nodes += range(int(lo, 0), int(hi or lo, 0) + 1)
+    return nodes
+
+
+def flash(bus, pages, nodes, opts):
+    """Broadcast the image, repair every node, release them. Returns {node: error}."""
+    erase_pages = opts.erase == "page"
+    bus.sync()
+    bus.broadcast(bp.frame_page_status(clear=True), 0.0)
+    if not erase_pages:
+        # no answers to a broadcast, wait for the slower page by page erase of a BOOT_USE_KV node
+        bus.broadcast(bp.frame_erase_full(), max(bp.FLASH_T_ERASE_FULL, bp.FLASH_T_ERASE_FULL_KV))
+    frames = {}
+    for page in pages:
+        frame = bp.frame_write_page(page.addr, page.data, page.nvr, erase_pages)
+        frames[(page.nvr, page.index)] = frame
+        bus.broadcast(frame, write_busy(erase_pages))
+    bus.drain()
+
+    errors = {}
+    for node in nodes:
+        try:
+            for _ in range(opts.rounds):
+                answer = bus.request(bp.frame_page_status(), node, opts.timeout,
+                                     opts.retries, "page status")
+                _, main, nvr = bp.page_status_pages(answer.msg_data)
+                missing = [key for key in frames
+                           if key[1] not in (nvr if key[0] else main)]
+                if not missing:
+                    break
+                if opts.verbose:
+                    print("node %d: %d pages missing" % (node, len(missing)))
+                for key in missing:
+                    bus.request(frames[key], node, opts.timeout + write_busy(True),
+                                opts.retries, "write")
+            else:
+                raise BusError("pages still missing on node %d" % node)
+            if opts.exit:
+                bus.request(bp.frame_exit(), node, opts.timeout, opts.retries, "exit")
+        except BusError as e:
+            errors[node] = str(e)
+    return errors
+
+
+def start_simulator(count, baud, ber):
+    here = os.path.dirname(os.path.abspath(__file__))
+    cmd = [sys.executable, os.path.join(here, "boot_sim.py"), "--bus", str(count),
+           "--baud", str(baud), "--ber", str(ber)]
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, text=True)
+    path = None
+    for line in proc.stdout:
+        line = line.strip()
+        if line == "ready":
+            break
+        path = line
+    return proc, path
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("port", nargs="?", help="serial port of the RS-485 adapter")
+    ap.add_argument("-i", "--image", required=True,
+                    help="ELF, Intel HEX (.hex) or raw binary image")
+    ap.add_argument("-a", "--address", type=lambda s: int(s, 0), default=0,
+                    help="flash address of a raw binary (default 0)")
+    ap.add_argument("--nvr-base", type=lambda s: int(s, 0), default=None,
+                    help="image address mapped to the start of NVR")
+    ap.add_argument("--nvr", action="store_true", help="whole image goes to NVR flash")
+    ap.add_argument("-b", "--baud", type=int, default=460800)
+    ap.add_argument("--nodes", default="1", help="node addresses, e.g. 1-16,20")
+    ap.add_argument("--erase", choices=("page", "full"), default="page",
+                    help="erase each page while writing it, or full erase first")
+    ap.add_argument("--no-exit", dest="exit", action="store_false",
+                    help="leave the nodes in the bootloader")
+    ap.add_argument("--margin", type=float, default=1.2,
+                    help="factor on the flash timings used to pace broadcasts")
+    ap.add_argument("--timeout", type=float, default=0.1, help="unicast answer timeout, s")
+    ap.add_argument("--retries", type=int, default=3, help="retries per unicast frame")
+    ap.add_argument("--rounds", type=int, default=3, help="page status rounds per node")
+    ap.add_argument("--simulate", type=int, default=0, metavar="N",
+                    help="flash a simulated bus of N nodes instead of a real port")
+    ap.add_argument("--ber", type=float, default=0.0,
+                    help="bit error rate of the simulated bus")
+    ap.add_argument("-v", "--verbose", action="store_true")
+    opts = ap.parse_args()
+
+    try:
+        plan = image_plan.load(opts.image, opts.address, opts.nvr_base, opts.nvr)
+    except (image_plan.ImageError, OSError) as e:
+        print("%s: %s" % (opts.image, e), file=sys.stderr)
+        return 1
+    pages = list(plan.pages)
+    if opts.erase == "page":
+        # blank pages are written as erased pages so the page status covers them too
+        pages += [image_plan.Page(p.ftype, p.addr, b"\xFF" * bp.FLASH_PAGE_SIZE_BYTES)
+                  for p in plan.blank]
+
+    sim = None
+    path = opts.port
+    nodes = parse_nodes(opts.nodes)
+    if opts.simulate:
+        sim, path = start_simulator(opts.simulate, opts.baud, opts.ber)
+        nodes = list(range(1, opts.simulate + 1))
+    if path is None:
+        ap.error("no port given")
+
+    bus = None
+    try:
+        bus = Bus(path, opts.baud, opts.margin)
+        t0 = time.monotonic()
+        errors = flash(bus, pages, nodes, opts)
+        elapsed = time.monotonic() - t0
+    except OSError as e:
+        print("%s: %s" % (path, e), file=sys.stderr)
+        return 1
+    finally:
+        if bus is not None:
+            bus.close()
+        if sim is not None:
+            sim.terminate()
+            sim.wait()
+
+    for node in nodes:
+        print("node %5d  %s" % (node, "FAILED: " + errors[node] if node in errors else "ok"))
+    print("nodes %d, ok %d, failed %d, %d pages of %d bytes each" %
+          (len(nodes), len(nodes) - len(errors), len(errors), len(pages),
+           bp.FLASH_PAGE_SIZE_BYTES))
+    print("elapsed %.2f s, %.1f kB/s per node" %
+          (elapsed, len(pages) * bp.FLASH_PAGE_SIZE_BYTES / elapsed / 1024))
+    return 0 if not errors else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,240 @@
+#!/usr/bin/env python3
+"""
+Flash and RAM footprint of a bootloader build per feature.
+
+Symbols of the ELF are put into the features of boot_conf.h by their names,
+code inlined by LTO counts for the function it was inlined into (mostly
+boot_core). Flash is what the BFLASH image holds (code, constants and the
+initial values of .data with the ramfuncs), RAM is .data and .bss.
+
+    footprint.py .pio/build/generic_K1921VK035_size/firmware.elf
+
+The worst case stack is summed over the call graph of -fcallgraph-info=su
+(the .ci files next to the ELF, those of the LTO partitions when the link
+leaves them there): the deepest chain from main, the deepest chain of an
+interrupt handler (they share one priority and do not nest) and the
+exception frame with the lazily stacked FPU registers. -Wstack-usage only
+limits every frame on its own. Recursion, indirect calls and dynamic frames
+have no bound and fail the check.
+
+    footprint.py --stack 0x400 .pio/build/generic_K1921VK035/firmware.elf
+
+As a PlatformIO extra script (extra_scripts = post:tools/footprint.py) the
+table is printed after every link and the build fails when the image does
+not fit BFLASH or the worst case does not fit __STACK_SIZE.
+"""
+
+import argparse
+import glob
+import os
+import re
+import subprocess
+import sys
+
+BFLASH_BYTES = 3 * 1024
+RAM_BYTES = 16 * 1024
+RAM_BASE = 0x20000000
+STACK_BYTES = 0xc00  # default of startup_K1921VK035.S
+# basic exception frame, the FPU registers reserved by lazy stacking and the alignment word
+EXC_FRAME_BYTES = 26 * 4 + 4
+ISR_PATTERN = r"_IRQHandler$"
+
+# first match wins, the rest of the symbols is core
+FEATURES = (
+    ("ARQ", r"^arq"),
+    ("WRITE_SESSION", r"^(session|write_session_cmd)$"),
+    ("JOURNAL", r"^journal"),
+    ("KV", r"^kv"),
+    ("COBS", r"cobs"),
+    ("MULTIDROP", r"^node_"),
+    ("RAM_RUN", r"^(ram_|boot_ram_app)"),
+    ("APP_CHECK", r"^(app_|validate_cmd$|AppStart)"),
+    ("CFGWORD", r"_cfgword_cmd$"),
+    ("MULTI_PAGE", r"^write_pages_cmd$"),
+    ("PARTIAL_WRITE", r"^(write_range_cmd|flush_cmd)$"),
+    ("PAGE_STATUS", r"^page_status"),
+    ("ERASE_RANGE", r"^erase_range_cmd$"),
+    ("BATCH", r"^batch_cmd$"),
+    ("LINK_TEST", r"^(echo_cmd|test_stream_cmd)$"),
+    ("crc", r"^crc"),
+    ("transport", r"^(transport_|uart_|spis_|wait_uart|UART|SPI)"),
+    ("packet", r"^packet_"),
+    ("flash", r"^flash_"),
+    ("arena", r"^boot_arena$"),
+    ("vectors", r"^__isr_vector$"),
+)
+
+
+def feature_of(name):
+    # LTO and IPA clones: foo.lto_priv.0, foo.constprop.0, foo.part.0
+    name = name.split(".")[0]
+    for feature, pattern in FEATURES:
+        if re.search(pattern, name):
+            return feature
+    return "core"
+
+
+def readelf(elf, prefix, opt):
+    return subprocess.run([prefix + "readelf", opt, elf], check=True,
+                          stdout=subprocess.PIPE, text=True).stdout
+
+
+def symbols(elf, prefix):
+    """(name, address, size, loaded) of the sized symbols, loaded - the image holds its bytes."""
+    nobits = set()
+    for m in re.finditer(r"^\s*\[\s*(\d+)\]\s+\S+\s+(\S+)", readelf(elf, prefix, "-SW"), re.M):
+        if m.group(2) == "NOBITS":
+            nobits.add(m.group(1))
+    for line in readelf(elf, prefix, "-sW").splitlines():
+        fields = line.split()
+        if len(fields) != 8 or fields[3] not in ("FUNC", "OBJECT") or fields[2] == "0":
+            continue
+        _, addr, size, _, _, _, ndx, name = fields
+        if not ndx.isdigit():
+            continue
+        yield name, int(addr, 16), int(size, 0), ndx not in nobits
+
+
+def segments(elf, prefix):
+    """Flash and RAM of the LOAD program headers."""
+    flash = ram = 0
+    for line in readelf(elf, prefix, "-lW").splitlines():
+        fields = line.split()
+        if not fields or fields[0] != "LOAD":
+            continue
+        vaddr, paddr, filesz, memsz = (int(f, 16) for f in fields[2:6])
+        if paddr < RAM_BASE:
+            flash += filesz
+        if vaddr >= RAM_BASE:
+            ram += memsz
+    return flash, ram
+
+
+def footprint(elf, prefix, out=sys.stdout):
+    table = {}
+    for name, addr, size, loaded in symbols(elf, prefix):
+        row = table.setdefault(feature_of(name), [0, 0])
+        # .bss and .noinit take no flash, code and data placed in RAM take both
+        if loaded:
+            row[0] += size
+        if addr >= RAM_BASE:
+            row[1] += size
+    flash, ram = segments(elf, prefix)
+
+    print("%-16s %8s %8s" % ("feature", "flash", "RAM"), file=out)
+    for feature, (f, r) in sorted(table.items(), key=lambda kv: -kv[1][0]):
+        print("%-16s %8d %8d" % (feature, f, r), file=out)
+    print("%-16s %8d %8d" % ("total", flash, ram), file=out)
+    print("%-16s %8d %8d" % ("left", BFLASH_BYTES - flash, RAM_BYTES - ram), file=out)
+    if flash > BFLASH_BYTES:
+        print("image exceeds the %d bytes of BFLASH by %d" % (BFLASH_BYTES, flash - BFLASH_BYTES), file=out)
+    return flash <= BFLASH_BYTES
+
+
+def short(name):
+    # static functions are titled file:name
+    return name.rsplit(":", 1)[-1]
+
+
+def callgraph(paths):
+    """{function: frame bytes, None - dynamic}, {function: callees} of the -fcallgraph-info=su files."""
+    frame = {}
+    calls = {}
+    for path in paths:
+        with open(path) as f:
+            text = f.read()
+        for m in re.finditer(r'node: \{ title: "([^"]+)" label: "([^"]*)"', text):
+            su = re.search(r"\\n(\d+) bytes \(([^)]*)\)", m.group(2))
+            if not su:
+                continue  # declared only, defined in another file or in the libraries
+            size = int(su.group(1)) if su.group(2) in ("static", "dynamic,bounded") else None
+            old = frame.get(m.group(1), 0)
+            frame[m.group(1)] = None if size is None or old is None else max(old, size)
+        for m in re.finditer(r'edge: \{ sourcename: "([^"]+)" targetname: "([^"]+)"', text):
+            calls.setdefault(m.group(1), set()).add(m.group(2))
+    return frame, calls
+
+
+def deepest(name, frame, calls, memo, active=()):
+    """(bytes, chain) of the deepest call chain from a function, ValueError when it has no bound."""
+    if name in active:
+        raise ValueError("recursion through " + short(name))
+    if name == "__indirect_call":
+        raise ValueError("indirect call in " + short(active[-1]))
+    if name not in memo:
+        own = frame.get(name, 0)
+        if own is None:
+            raise ValueError("dynamic frame of " + short(name))
+        best = (0, [])
+        for callee in sorted(calls.get(name, ())):
+            best = max(best, deepest(callee, frame, calls, memo, active + (name,)))
+        memo[name] = (own + best[0], [name] + best[1])
+    return memo[name]
+
+
+def stack(paths, stack_bytes, out=sys.stdout):
+    """Worst case stack against __STACK_SIZE, True when it fits or there is no call graph."""
+    if not paths:
+        print("no -fcallgraph-info=su files, worst case stack not checked", file=out)
+        return True
+    ltrans = [p for p in paths if "ltrans" in os.path.basename(p)]
+    frame, calls = callgraph(ltrans or paths)
+    memo = {}
+    try:
+        main_chain = deepest("main", frame, calls, memo)
+        isr_chain = max([deepest(n, frame, calls, memo) for n in frame if re.search(ISR_PATTERN, short(n))] +
+                        [(0, [])])
+    except ValueError as e:
+        print("worst case stack has no bound: %s" % e, file=out)
+        return False
+    total = main_chain[0] + isr_chain[0] + EXC_FRAME_BYTES
+    missing = sorted({short(c) for n in memo for c in calls.get(n, ()) if c not in frame})
+
+    print("%-16s %8d  %s" % ("stack main", main_chain[0], " > ".join(short(n) for n in main_chain[1])), file=out)
+    print("%-16s %8d  %s" % ("stack irq", isr_chain[0], " > ".join(short(n) for n in isr_chain[1])), file=out)
+    print("%-16s %8d  exception frame with FPU state" % ("stack frame", EXC_FRAME_BYTES), file=out)
+    print("%-16s %8d  of %d" % ("stack total", total, stack_bytes), file=out)
+    if missing:
+        print("not counted, no frame in the call graph: %s" % " ".join(missing), file=out)
+    if total > stack_bytes:
+        print("worst case stack exceeds __STACK_SIZE by %d" % (total - stack_bytes), file=out)
+    return total <= stack_bytes
+
+
+def callgraph_files(build_dir):
+    return sorted(glob.glob(os.path.join(build_dir, "**", "*.ci"), recursive=True))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("elf")
+    ap.add_argument("--prefix", default="arm-none-eabi-", help="binutils prefix")
+    ap.add_argument("--stack", type=lambda v: int(v, 0), default=STACK_BYTES, help="__STACK_SIZE of the build")
+    ap.add_argument("--callgraph", metavar="DIR", help=".ci files of the build, default: the directory of the ELF")
+    opts = ap.parse_args()
+    fits = footprint(opts.elf, opts.prefix)
+    fits &= stack(callgraph_files(opts.callgraph or os.path.dirname(os.path.abspath(opts.elf))), opts.stack)
+    return 0 if fits else 1
+
+
+def pio_stack_bytes(env):
+    for define in env.get("CPPDEFINES", []):
+        if isinstance(define, (list, tuple)) and define[0] == "__STACK_SIZE":
+            return int(str(define[1]), 0)
+    return STACK_BYTES
+
+
+def pio_post_link(target, source, env):
+    cc = env.subst("$CC")
+    fits = footprint(target[0].get_abspath(), cc[:-len("gcc")] if cc.endswith("gcc") else "")
+    fits &= stack(callgraph_files(env.subst("$BUILD_DIR")), pio_stack_bytes(env))
+    # a non-zero result fails the build
+    return 0 if fits else 1
+
+
+try:
+    Import("env")  # noqa: F821, defined by SCons for PlatformIO extra scripts
+    env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", pio_post_link)  # noqa: F821
+except NameError:
+    if __name__ == "__main__":
+        sys.exit(main())
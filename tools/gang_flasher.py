@@ -0,0 +1,536 @@
+#!/usr/bin/env python3
+"""
+Gang programmer: flash many K1921VK035 boards at once from one process.
+
+Every serial port runs its own session (auto-baud, erase, write, verify,
+exit) as a small state machine, and all of them are driven by a single epoll
+loop. The image is parsed and framed once and the same frame buffers are sent
+to every port. A failing board only ends its own session. Boards that report
+multi-page packets in CMD_GET_INFO_EXT get up to PACKET_PAGES_MAX pages per
+round trip. With --erase session each run of pages is opened with
+CMD_WRITE_SESSION, so the board erases the next page while the current one
+arrives, and blank pages are cleared with one CMD_ERASE_RANGE per run.
+With --validate the length and CRC of the image go into its vector table and
+the verified image is marked with CMD_VALIDATE, so a BOOT_USE_APP_CHECK
+bootloader starts it from BOOTEN without a full digest. With --batch the
+erase commands go to the board up to BATCH_CMDS_MAX per CMD_BATCH round trip.
+
+    gang_flasher.py -b 460800 -i firmware.bin /dev/ttyUSB0 /dev/ttyUSB1 ...
+    gang_flasher.py -i firmware.bin --simulate 16 --cycles 4
+"""
+
+import argparse
+import os
+import select
+import subprocess
+import sys
+import time
+
+import bootproto as bp
+import image_plan
+from arq import ArqSender
+
+
+class Image:
+    """Page plan of the image with all frames built once and shared."""
+
+    def __init__(self, plan, erase="page", framing=bp.FRAMING_SIGN):
+        erase_pages = erase == "page"
+        self.framing = framing
+        self.pages = [(p.addr, p.data) for p in plan.pages]
+        self.write_frames = [self.frame(bp.frame_write_page(p.addr, p.data, p.nvr, erase_pages))
+                             for p in plan.pages]
+        self.arq_frames = [self.frame(bp.frame_arq_write(i, p.addr, p.data, p.nvr, erase_pages))
+                           for i, p in enumerate(plan.pages)]
+        self.read_frames = [self.frame(bp.frame_read_page(p.addr, p.nvr)) for p in plan.pages]
+        # blank pages of the image still have to be cleared when erasing per page
+        erase_frames = [bp.frame_erase_page(p.addr, p.nvr) for p in plan.blank] if erase_pages else []
+        # a write session per run of pages, keyed by the index of its first page
+        self.session_frames = {}
+        if erase == "session":
+            erase_frames = [bp.frame_erase_range(run[0].addr, len(run), run[0].nvr)
+                            for run in self.runs(plan.blank)]
+            first = 0
+            for run in self.runs(plan.pages):
+                self.session_frames[first] = \
+                    self.frame(bp.frame_write_session(run[0].addr, len(run), run[0].nvr))
+                first += len(run)
+        self.erase_frames = [self.frame(f) for f in erase_frames]
+        # sized for a build with one page per packet
+        self.erase_batches = [self.frame(bp.frame_batch(b))
+                              for b in bp.batches(erase_frames, bp.FLASH_PAGE_SIZE_BYTES + 8)]
+        self.blank = len(plan.blank)
+        self.bytes = plan.bytes
+        self.plan_pages = plan.pages
+        self.erase_pages = erase_pages
+        self.chunk_cache = {}
+
+    @staticmethod
+    def runs(pages):
+        """Pages split into runs of consecutive pages of one flash."""
+        runs = []
+        for p in pages:
+            last = runs[-1] if runs else None
+            if last and last[-1].nvr == p.nvr and last[-1].addr + bp.FLASH_PAGE_SIZE_BYTES == p.addr:
+                last.append(p)
+            else:
+                runs.append([p])
+        return runs
+
+    def chunks(self, pages_max):
+        """
+        Runs of up to pages_max consecutive pages as (addr, data, CMD_WRITE_PAGES frame,
+        CMD_READ_PAGES frame, page indexes), built once per size.
+        """
+        if pages_max not in self.chunk_cache:
+            runs = []
+            for i, p in enumerate(self.plan_pages):
+                last = runs[-1] if runs else None
+                if last and last[-1][1].nvr == p.nvr and len(last) < pages_max and \
+                        last[-1][1].addr + bp.FLASH_PAGE_SIZE_BYTES == p.addr:
+                    last.append((i, p))
+                else:
+                    runs.append([(i, p)])
+            chunks = []
+            for run in runs:
+                addr, nvr = run[0][1].addr, run[0][1].nvr
+                data = b"".join(p.data for _, p in run)
+                chunks.append((addr, data,
+                               self.frame(bp.frame_write_pages(addr, data, nvr, self.erase_pages)),
+                               self.frame(bp.frame_read_pages(addr, len(run), nvr)),
+                               [i for i, _ in run]))
+            self.chunk_cache[pages_max] = chunks
+        return self.chunk_cache[pages_max]
+
+    def journaled(self, pages):
+        """Indexes of the main flash pages a CMD_GET_JOURNAL answer reports written with this data."""
+        return {i for i, p in enumerate(self.plan_pages)
+                if not p.nvr and pages.get(p.index) == bp.crc16(p.data)}
+
+    def arq_resume_frames(self, skip):
+        """CMD_ARQ_WRITE frames of the pages not in skip, numbered from 0."""
+        left = [p for i, p in enumerate(self.plan_pages) if i not in skip]
+        return [self.frame(bp.frame_arq_write(n, p.addr, p.data, p.nvr, self.erase_pages))
+                for n, p in enumerate(left)]
+
+    def frame(self, frame):
+        """Frame for the session framing; frames are built with the signature."""
+        return bp.to_cobs(frame) if self.framing == bp.FRAMING_COBS else frame
+
+
+class Timeout(Exception):
+    pass
+
+
+class SessionError(Exception):
+    pass
+
+
+SYNC = object()
+# no frame to send, the answer to the last one is still awaited
+WAIT = object()
+
+
+def session(image, opts):
+    """
+    Flashing steps for one board.
+
+    Yields either SYNC or a frame to send; gets back the answer frame or has
+    Timeout thrown in. An ArqSender is yielded for the selective repeat
+    transfer and the session resumes when it has finished.
+    """
+    for attempt in range(opts.sync_retries):
+        try:
+            yield SYNC
+            break
+        except Timeout:
+            continue
+    else:
+        raise SessionError("no answer to auto-baud")
+
+    def request(frame, what, optional=False):
+        for _ in range(opts.retries + 1):
+            try:
+                answer = yield frame
+                # progress of a long command, the final answer follows
+                while answer.crc_ok and answer.status == bp.MSG_BUSY:
+                    answer = yield WAIT
+            except Timeout:
+                continue
+            if answer.cmd == bp.CMD_MSG and answer.crc_ok and answer.status == bp.MSG_OK:
+                return answer
+            if answer.crc_ok and answer.status == bp.MSG_FAIL:
+                raise SessionError("%s refused by device" % what)
+            # older bootloaders do not know the command
+            if optional and answer.crc_ok and answer.status == bp.MSG_ERR_CMD:
+                return None
+        raise SessionError("%s failed after %d tries" % (what, opts.retries + 1))
+
+    if image.framing != bp.FRAMING_SIGN:
+        yield from request(bp.frame_set_framing(image.framing), "set framing")
+    info = bp.InfoExt.legacy()
+    if opts.pages_max != 1 or image.session_frames or opts.validate or opts.batch:
+        answer = yield from request(image.frame(bp.frame_get_info_ext()), "info", optional=True)
+        if answer is not None:
+            info = bp.InfoExt(answer.msg_data)
+    pages_max = min(info.pages_max, opts.pages_max or info.pages_max)
+    if not info.supports(bp.CMD_WRITE_PAGES):
+        pages_max = 1
+    # pages that landed before the last session was interrupted
+    skip = set()
+    if opts.resume and info.supports(bp.CMD_GET_JOURNAL):
+        answer = yield from request(image.frame(bp.frame_get_journal()), "journal")
+        skip = image.journaled(bp.journal_pages(answer.msg_data))
+    if opts.erase == "session" and not info.supports(bp.CMD_WRITE_SESSION):
+        raise SessionError("bootloader has no CMD_WRITE_SESSION, use --erase page")
+    if opts.erase == "session" and image.erase_frames and not info.supports(bp.CMD_ERASE_RANGE):
+        raise SessionError("bootloader has no CMD_ERASE_RANGE for the blank pages, use --erase page")
+    if opts.validate and not info.supports(bp.CMD_VALIDATE):
+        raise SessionError("bootloader has no CMD_VALIDATE, it is not a BOOT_USE_APP_CHECK build")
+    if opts.erase == "full":
+        yield from request(image.frame(bp.frame_erase_full()), "full erase")
+    if opts.batch and info.supports(bp.CMD_BATCH):
+        for frame in image.erase_batches:
+            yield from request(frame, "erase batch")
+    else:
+        for frame in image.erase_frames:
+            yield from request(frame, "erase")
+    sessions = image.session_frames
+    if opts.arq:
+        if sessions:
+            yield from request(sessions[0], "write session")
+        frames = image.arq_resume_frames(skip) if skip else image.arq_frames
+        # with flow control the device holds the host back, only the window limits the stream
+        budget = bp.ARQ_WINDOW * (bp.FLASH_PAGE_SIZE_BYTES + 64) if opts.rtscts else info.fifo_bytes
+        sender = ArqSender(frames, image.framing, budget=budget,
+                           timeout=opts.timeout, retries=opts.retries)
+        yield sender
+        if sender.error is not None:
+            raise SessionError(sender.error)
+    elif pages_max > 1:
+        for addr, _, frame, _, pages in image.chunks(pages_max):
+            if pages[0] in sessions:
+                yield from request(sessions[pages[0]], "write session 0x%05X" % addr)
+            if not skip.issuperset(pages):
+                yield from request(frame, "write 0x%05X" % addr)
+    else:
+        for i, frame in enumerate(image.write_frames):
+            if i in sessions:
+                yield from request(sessions[i], "write session 0x%05X" % image.pages[i][0])
+            if i not in skip:
+                yield from request(frame, "write 0x%05X" % image.pages[i][0])
+    if opts.verify and pages_max > 1:
+        for addr, data, _, frame, _ in image.chunks(pages_max):
+            answer = yield from request(frame, "read 0x%05X" % addr)
+            if answer.msg_data[4:] != data:
+                raise SessionError("verify mismatch at 0x%05X" % addr)
+    elif opts.verify:
+        for i, frame in enumerate(image.read_frames):
+            addr, data = image.pages[i]
+            answer = yield from request(frame, "read 0x%05X" % addr)
+            if answer.msg_data[4:] != data:
+                raise SessionError("verify mismatch at 0x%05X" % addr)
+    if opts.validate:
+        yield from request(image.frame(bp.frame_validate()), "validate")
+    if opts.exit:
+        yield from request(image.frame(bp.frame_exit()), "exit")
+
+
+class Port:
+    """Serial port plus the session currently running on it."""
+
+    def __init__(self, path, opts):
+        self.path = path
+        self.opts = opts
+        self.fd = bp.open_port(path, opts.baud, rtscts=opts.rtscts)
+        self.out = memoryview(b"")
+        self.pending = []
+        self.parser = bp.FrameParser(bp.PACKET_DEVICE_SIGN)
+        self.gen = None
+        self.step = None
+        self.arq = None
+        self.deadline = None
+        self.done = 0
+        self.failed = 0
+        self.cycle_start = None
+        self.durations = []
+        self.errors = []
+
+    # -- I/O --------------------------------------------------------------
+    def queue(self, data):
+        self.pending.append(data)
+
+    def want_write(self):
+        return bool(self.out) or bool(self.pending)
+
+    def flush(self):
+        while True:
+            if not self.out:
+                if not self.pending:
+                    return
+                self.out = memoryview(self.pending.pop(0))
+            try:
+                n = os.write(self.fd, self.out)
+            except BlockingIOError:
+                return
+            self.out = self.out[n:]
+
+    def read(self):
+        try:
+            chunk = os.read(self.fd, 65536)
+        except BlockingIOError:
+            return []
+        return self.parser.feed(chunk)
+
+    # -- session handling -------------------------------------------------
+    def start(self, image, now):
+        self.gen = session(image, self.opts)
+        self.cycle_start = now
+        self.parser = bp.FrameParser(bp.PACKET_DEVICE_SIGN)
+        self.advance(now, None)
+
+    def advance(self, now, answer, exc=None):
+        try:
+            if exc is not None:
+                step = self.gen.throw(exc)
+            elif answer is None and self.step is None:
+                step = next(self.gen)
+            else:
+                step = self.gen.send(answer)
+        except StopIteration:
+            self.end(now, None)
+            return
+        except SessionError as e:
+            self.end(now, str(e))
+            return
+        self.step = step
+        if step is SYNC:
+            self.queue(bytes([bp.SYNC_BYTE]))
+            self.deadline = now + self.opts.sync_timeout
+        elif step is WAIT:
+            self.deadline = now + self.opts.timeout
+        elif isinstance(step, ArqSender):
+            self.arq = step
+            self.pump(now)
+        else:
+            self.queue(step)
+            self.deadline = now + self.opts.timeout
+
+    def pump(self, now):
+        for frame in self.arq.pump(now):
+            self.queue(frame)
+        self.deadline = self.arq.deadline
+        if self.arq.done or self.arq.error is not None:
+            self.arq = None
+            self.advance(now, None)
+
+    def on_frames(self, now, frames):
+        for frame in frames:
+            if self.gen is None:
+                return
+            if self.arq is not None:
+                self.arq.on_answer(frame, now)
+                self.pump(now)
+            elif self.step is SYNC:
+                if frame.cmd == bp.CMD_MSG and frame.status == bp.MSG_READY:
+                    self.advance(now, frame)
+            elif frame.cmd == bp.CMD_MSG:
+                if frame.msg_cmd == bp.CMD_SET_FRAMING and frame.status == bp.MSG_OK:
+                    self.parser = bp.make_parser(self.opts.framing_code)
+                self.advance(now, frame)
+
+    def on_timeout(self, now):
+        if self.arq is not None:
+            self.arq.on_timeout(now)
+            self.pump(now)
+        else:
+            self.advance(now, None, Timeout())
+
+    def end(self, now, error):
+        self.gen = None
+        self.step = None
+        self.arq = None
+        self.deadline = None
+        if error is None:
+            self.done += 1
+            self.durations.append(now - self.cycle_start)
+        else:
+            self.failed += 1
+            self.errors.append(error)
+
+    def close(self):
+        os.close(self.fd)
+
+
+def run(ports, image, opts):
+    ep = select.epoll()
+    by_fd = {}
+    for port in ports:
+        by_fd[port.fd] = port
+        ep.register(port.fd, select.EPOLLIN)
+
+    t0 = time.monotonic()
+    for port in ports:
+        port.start(image, t0)
+
+    def finished(port):
+        return port.gen is None and (port.failed or port.done >= opts.cycles)
+
+    while not all(finished(p) for p in ports):
+        now = time.monotonic()
+        deadlines = [p.deadline for p in ports if p.deadline is not None]
+        timeout = max(0.0, min(deadlines) - now) if deadlines else 0.1
+        for port in ports:
+            port.flush()
+            mask = select.EPOLLIN | (select.EPOLLOUT if port.want_write() else 0)
+            ep.modify(port.fd, mask)
+        for fd, ev in ep.poll(timeout):
+            port = by_fd[fd]
+            now = time.monotonic()
+            if ev & select.EPOLLOUT:
+                port.flush()
+            if ev & select.EPOLLIN:
+                port.on_frames(now, port.read())
+            if ev & (select.EPOLLERR | select.EPOLLHUP):
+                if port.gen is not None:
+                    port.end(now, "port closed")
+        now = time.monotonic()
+        for port in ports:
+            if port.deadline is not None and now >= port.deadline:
+                port.on_timeout(now)
+            if port.gen is None and not finished(port):
+                port.start(image, now)
+    elapsed = time.monotonic() - t0
+    ep.close()
+    return elapsed
+
+
+def report(ports, image, elapsed):
+    total = sum(p.done for p in ports)
+    failed = sum(p.failed for p in ports)
+    for p in ports:
+        avg = sum(p.durations) / len(p.durations) if p.durations else 0.0
+        state = "ok" if not p.failed else "FAILED: " + p.errors[-1]
+        print("%-24s boards %3d  avg %6.2f s  %s" % (p.path, p.done, avg, state))
+    print("ports %d, boards ok %d, failed %d, %d pages of %d bytes each, %d blank" %
+          (len(ports), total, failed, len(image.pages), bp.FLASH_PAGE_SIZE_BYTES,
+           image.blank))
+    if elapsed > 0:
+        print("elapsed %.2f s, %.1f boards/min, %.1f kB/s aggregate" %
+              (elapsed, total * 60.0 / elapsed, total * image.bytes / elapsed / 1024))
+    return 0 if failed == 0 else 1
+
+
+def start_simulator(count, baud, rearm, ber=0.0, rtscts=False, spi=0, app_check=False):
+    here = os.path.dirname(os.path.abspath(__file__))
+    cmd = [sys.executable, os.path.join(here, "boot_sim.py"), "-n", str(count),
+           "--baud", str(baud), "--ber", str(ber)]
+    if rearm is not None:
+        cmd += ["--rearm", str(rearm)]
+    if rtscts:
+        cmd += ["--rtscts"]
+    if spi:
+        cmd += ["--spi", str(spi)]
+    if app_check:
+        cmd += ["--app-check"]
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, text=True)
+    paths = []
+    for line in proc.stdout:
+        line = line.strip()
+        if line == "ready":
+            break
+        paths.append(line)
+    return proc, paths
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("ports", nargs="*", help="serial ports, one board each")
+    ap.add_argument("-i", "--image", required=True,
+                    help="ELF, Intel HEX (.hex) or raw binary image")
+    ap.add_argument("-a", "--address", type=lambda s: int(s, 0), default=0,
+                    help="flash address of a raw binary (default 0)")
+    ap.add_argument("--nvr-base", type=lambda s: int(s, 0), default=None,
+                    help="image address mapped to the start of NVR")
+    ap.add_argument("--nvr", action="store_true", help="whole image goes to NVR flash")
+    ap.add_argument("-b", "--baud", type=int, default=460800)
+    ap.add_argument("--erase", choices=("page", "full", "session"), default="page",
+                    help="erase each page while writing it, full erase first, or erase the next "
+                         "page while the current one arrives (CMD_WRITE_SESSION)")
+    ap.add_argument("--no-verify", dest="verify", action="store_false")
+    ap.add_argument("--no-exit", dest="exit", action="store_false",
+                    help="leave the boards in the bootloader")
+    ap.add_argument("--framing", choices=("sign", "cobs"), default="sign",
+                    help="packet framing after auto-baud")
+    ap.add_argument("--arq", action="store_true",
+                    help="stream pages with selective repeat instead of one page per round trip")
+    ap.add_argument("--pages-max", type=int, default=0, metavar="N",
+                    help="pages per packet, 0 - as many as the board reports, 1 - one page per packet")
+    ap.add_argument("--resume", action="store_true",
+                    help="skip pages the board journaled in an interrupted session (needs --erase page)")
+    ap.add_argument("--rtscts", action="store_true",
+                    help="RTS / CTS flow control (BOOT_USE_FLOW_CTRL), --arq then streams "
+                         "without waiting for the device FIFO to drain")
+    ap.add_argument("--batch", action="store_true",
+                    help="send the erase commands in CMD_BATCH packets when the board has it")
+    ap.add_argument("--validate", action="store_true",
+                    help="put the application header into the image and mark it with CMD_VALIDATE "
+                         "after the verify (BOOT_USE_APP_CHECK)")
+    ap.add_argument("--cycles", type=int, default=1,
+                    help="boards to flash per port (next board is awaited by auto-baud)")
+    ap.add_argument("--timeout", type=float, default=1.0, help="answer timeout, s")
+    ap.add_argument("--sync-timeout", type=float, default=0.2, help="auto-baud timeout, s")
+    ap.add_argument("--sync-retries", type=int, default=50)
+    ap.add_argument("--retries", type=int, default=3, help="retries per frame")
+    ap.add_argument("--simulate", type=int, default=0, metavar="N",
+                    help="flash N simulated boards on ptys instead of real ports")
+    ap.add_argument("--ber", type=float, default=0.0,
+                    help="bit error rate of the simulated links")
+    ap.add_argument("--sim-spi", type=float, default=0, metavar="HZ",
+                    help="simulated boards are BOOT_TRANSPORT_SPI builds clocked at HZ")
+    opts = ap.parse_args()
+
+    try:
+        plan = image_plan.load(opts.image, opts.address, opts.nvr_base, opts.nvr)
+        if opts.validate:
+            image_plan.add_app_header(plan)
+    except (image_plan.ImageError, OSError) as e:
+        print("%s: %s" % (opts.image, e), file=sys.stderr)
+        return 1
+    if opts.resume and opts.erase != "page":
+        ap.error("--resume keeps written pages, it needs --erase page")
+    opts.framing_code = bp.FRAMING_COBS if opts.framing == "cobs" else bp.FRAMING_SIGN
+    image = Image(plan, opts.erase, opts.framing_code)
+    if opts.arq and len(image.session_frames) > 1:
+        ap.error("--arq streams one write session, the image has %d runs of pages"
+                 % len(image.session_frames))
+
+    sim = None
+    paths = list(opts.ports)
+    if opts.simulate:
+        sim, sim_paths = start_simulator(opts.simulate, opts.baud,
+                                         0.05 if opts.cycles > 1 else None, opts.ber, opts.rtscts,
+                                         opts.sim_spi, opts.validate)
+        paths += sim_paths
+    if not paths:
+        ap.error("no ports given")
+
+    ports = []
+    try:
+        for path in paths:
+            try:
+                ports.append(Port(path, opts))
+            except OSError as e:
+                print("%s: %s" % (path, e), file=sys.stderr)
+        elapsed = run(ports, image, opts)
+        return report(ports, image, elapsed)
+    finally:
+        for port in ports:
+            port.close()
+        if sim is not None:
+            sim.terminate()
+            sim.wait()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
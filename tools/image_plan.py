@@ -0,0 +1,271 @@
+#!/usr/bin/env python3
+"""
+Image loader and page planner.
+
+Reads ELF, Intel HEX or raw binary images, merges all segments into
+FLASH_PAGE_SIZE_BYTES pages, pads partial pages with 0xFF and drops pages that
+are entirely blank. Every page is routed to main flash or NVR; the NVR pages
+holding the bootloader are refused. With --app-header the length and CRC16
+of the image are put into its vector table for BOOT_USE_APP_CHECK builds.
+
+    image_plan.py firmware.elf
+    image_plan.py --nvr-base 0x00100000 firmware.hex
+    image_plan.py --app-header firmware.bin
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+import bootproto as bp
+
+
+class ImageError(Exception):
+    pass
+
+
+class Page:
+    __slots__ = ("ftype", "addr", "data")
+
+    def __init__(self, ftype, addr, data):
+        self.ftype = ftype
+        self.addr = addr
+        self.data = data
+
+    @property
+    def nvr(self):
+        return self.ftype == bp.FLASH_NVR
+
+    @property
+    def index(self):
+        return self.addr // bp.FLASH_PAGE_SIZE_BYTES
+
+    def __repr__(self):
+        return "<Page %s 0x%05X>" % ("nvr" if self.nvr else "main", self.addr)
+
+
+class Plan:
+    """
+    Result of planning: pages to program and pages that are covered by the
+    image but blank, so they only need an erase when the target is not
+    erased already.
+    """
+
+    def __init__(self, pages, blank):
+        self.pages = pages
+        self.blank = blank
+
+    @property
+    def bytes(self):
+        return len(self.pages) * bp.FLASH_PAGE_SIZE_BYTES
+
+    def summary(self):
+        lines = []
+        for ftype, name in ((bp.FLASH_MAIN, "main"), (bp.FLASH_NVR, "nvr")):
+            prog = [p.index for p in self.pages if p.ftype == ftype]
+            blank = [p.index for p in self.blank if p.ftype == ftype]
+            if prog or blank:
+                lines.append("%-4s program %s" % (name, _ranges(prog) or "-"))
+                lines.append("%-4s blank   %s" % (name, _ranges(blank) or "-"))
+        lines.append("%d pages to program, %d blank pages skipped" %
+                     (len(self.pages), len(self.blank)))
+        return "\n".join(lines)
+
+
+def _ranges(idx):
+    out = []
+    for i in idx:
+        if out and out[-1][1] == i - 1:
+            out[-1][1] = i
+        else:
+            out.append([i, i])
+    return ",".join("%d" % a if a == b else "%d-%d" % (a, b) for a, b in out)
+
+
+# -- Readers ------------------------------------------------------------------
+def read_bin(data, base=0):
+    return [(base, bytes(data))]
+
+
+def read_ihex(text):
+    segments = []
+    upper = 0
+    cur_addr = None
+    cur = bytearray()
+    for lineno, line in enumerate(text.splitlines(), 1):
+        line = line.strip()
+        if not line:
+            continue
+        if not line.startswith(":"):
+            raise ImageError("hex line %d: missing ':'" % lineno)
+        try:
+            rec = bytes.fromhex(line[1:])
+        except ValueError:
+            raise ImageError("hex line %d: bad digits" % lineno)
+        if len(rec) < 5 or len(rec) != rec[0] + 5:
+            raise ImageError("hex line %d: bad length" % lineno)
+        if sum(rec) & 0xFF:
+            raise ImageError("hex line %d: bad checksum" % lineno)
+        n, off, rtype = rec[0], (rec[1] << 8) | rec[2], rec[3]
+        payload = rec[4:4 + n]
+        if rtype == 0x00:
+            addr = upper + off
+            if cur_addr is not None and addr == cur_addr + len(cur):
+                cur += payload
+            else:
+                if cur:
+                    segments.append((cur_addr, bytes(cur)))
+                cur_addr, cur = addr, bytearray(payload)
+        elif rtype == 0x01:
+            break
+        elif rtype == 0x02:
+            upper = struct.unpack(">H", payload)[0] << 4
+        elif rtype == 0x04:
+            upper = struct.unpack(">H", payload)[0] << 16
+        elif rtype in (0x03, 0x05):
+            pass  # start address records
+        else:
+            raise ImageError("hex line %d: unknown record type %d" % (lineno, rtype))
+    if cur:
+        segments.append((cur_addr, bytes(cur)))
+    return segments
+
+
+def read_elf(data):
+    if data[:4] != b"\x7fELF":
+        raise ImageError("not an ELF file")
+    if data[4] != 1 or data[5] != 1:
+        raise ImageError("only 32-bit little-endian ELF is supported")
+    e_phoff, = struct.unpack_from("<I", data, 28)
+    e_phentsize, e_phnum = struct.unpack_from("<HH", data, 42)
+    segments = []
+    for i in range(e_phnum):
+        p_type, p_offset, _vaddr, p_paddr, p_filesz = struct.unpack_from(
+            "<IIIII", data, e_phoff + i * e_phentsize)
+        # PT_LOAD only, and only what is stored in the file (no .bss)
+        if p_type != 1 or p_filesz == 0:
+            continue
+        segments.append((p_paddr, bytes(data[p_offset:p_offset + p_filesz])))
+    return segments
+
+
+def load_segments(path, base=0):
+    with open(path, "rb") as f:
+        data = f.read()
+    ext = os.path.splitext(path)[1].lower()
+    if data[:4] == b"\x7fELF":
+        return read_elf(data)
+    if ext in (".hex", ".ihex", ".ihx"):
+        return read_ihex(data.decode("ascii"))
+    return read_bin(data, base)
+
+
+# -- Planner ------------------------------------------------------------------
+def route(addr, nvr_base, nvr_only=False):
+    """Return (flash type, offset inside that flash) for an image address."""
+    if nvr_base is not None and nvr_base <= addr < nvr_base + bp.FLASH_NVR_TOTAL_BYTES:
+        return bp.FLASH_NVR, addr - nvr_base
+    if not nvr_only and 0 <= addr < bp.FLASH_TOTAL_BYTES:
+        return bp.FLASH_MAIN, addr
+    raise ImageError("address 0x%08X is outside of %s" % (addr, "NVR" if nvr_only else "flash"))
+
+
+def plan(segments, nvr_base=None, nvr_only=False):
+    """
+    Merge segments into pages.
+
+    nvr_base gives the image address where NVR starts, nvr_only routes the
+    whole image to NVR starting at address 0.
+    """
+    if nvr_only:
+        nvr_base = 0
+    page_size = bp.FLASH_PAGE_SIZE_BYTES
+    pages = {}
+    owner = {}
+    for seg_addr, seg in segments:
+        for i, b in enumerate(seg):
+            ftype, off = route(seg_addr + i, nvr_base, nvr_only)
+            if ftype == bp.FLASH_NVR and off < bp.FLASH_NVR_BOOT_PAGES * page_size:
+                raise ImageError("image touches bootloader NVR page %d" % (off // page_size))
+            key = (ftype, off & ~(page_size - 1))
+            buf = pages.get(key)
+            if buf is None:
+                buf = pages[key] = bytearray(b"\xFF" * page_size)
+            pos = off & (page_size - 1)
+            prev = owner.get((ftype, off))
+            if prev is not None and prev != b:
+                raise ImageError("overlapping data at 0x%08X" % (seg_addr + i))
+            owner[(ftype, off)] = b
+            buf[pos] = b
+
+    program, blank = [], []
+    for (ftype, addr) in sorted(pages):
+        data = bytes(pages[(ftype, addr)])
+        page = Page(ftype, addr, data)
+        if data.count(0xFF) == page_size:
+            blank.append(page)
+        else:
+            program.append(page)
+    return Plan(program, blank)
+
+
+def add_app_header(plan):
+    """
+    Put the header of boot_app.h into the reserved vectors 7 .. 9 of the image
+    and return (length, crc). The digest covers main flash from address 0 to
+    the end of the last page of the image; pages in between that the image
+    does not touch become blank pages, so they are erased like the others.
+    """
+    page_size = bp.FLASH_PAGE_SIZE_BYTES
+    main = {p.addr: p for p in plan.pages + plan.blank if p.ftype == bp.FLASH_MAIN}
+    first = main.get(0)
+    if first is None or first in plan.blank:
+        raise ImageError("no vector table at address 0 for the application header")
+    hdr = first.data[bp.APP_HDR_OFFSET:bp.APP_HDR_OFFSET + bp.APP_HDR_BYTES]
+    if hdr not in (b"\0" * bp.APP_HDR_BYTES, b"\xFF" * bp.APP_HDR_BYTES) and \
+            struct.unpack_from("<I", hdr)[0] != bp.APP_HDR_MAGIC:
+        raise ImageError("reserved vectors 7 .. 9 are in use, no room for the application header")
+    length = max(main) + page_size
+    for addr in range(0, length, page_size):
+        if addr not in main:
+            main[addr] = Page(bp.FLASH_MAIN, addr, b"\xFF" * page_size)
+            plan.blank.append(main[addr])
+    plan.blank.sort(key=lambda p: (p.ftype, p.addr))
+
+    image = bytearray(b"".join(main[addr].data for addr in range(0, length, page_size)))
+    crc = bp.app_digest(image)
+    image[bp.APP_HDR_OFFSET:bp.APP_HDR_OFFSET + bp.APP_HDR_BYTES] = bp.app_header(length, crc)
+    first.data = bytes(image[:page_size])
+    return length, crc
+
+
+def load(path, base=0, nvr_base=None, nvr_only=False):
+    return plan(load_segments(path, base), nvr_base, nvr_only)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("image", help="ELF, Intel HEX (.hex) or raw binary")
+    ap.add_argument("-a", "--address", type=lambda s: int(s, 0), default=0,
+                    help="load address of a raw binary")
+    ap.add_argument("--nvr-base", type=lambda s: int(s, 0), default=None,
+                    help="image address mapped to the start of NVR")
+    ap.add_argument("--nvr", action="store_true", help="whole image goes to NVR")
+    ap.add_argument("--app-header", action="store_true",
+                    help="put the length and CRC16 of the image into its vector table")
+    args = ap.parse_args()
+    try:
+        result = load(args.image, args.address, args.nvr_base, args.nvr)
+        header = add_app_header(result) if args.app_header else None
+    except (ImageError, OSError) as e:
+        print("%s: %s" % (args.image, e), file=sys.stderr)
+        return 1
+    print(result.summary())
+    if header:
+        print("application header: %d bytes, crc 0x%04X" % header)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
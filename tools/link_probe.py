@@ -0,0 +1,244 @@
+#!/usr/bin/env python3
+"""
+Measure the link to the bootloader and suggest the transfer settings for it.
+
+CMD_ECHO with a few bytes gives the round trip latency, with the largest
+packet the board takes the throughput of echoed data. CMD_TEST_STREAM sends
+frames of a known pattern back to back, so the host counts the throughput
+and the bit errors from device to host. The link counters of the device
+(correct frames, CRC errors, damaged headers, frames lost to a full FIFO)
+are read before and after and give the errors from host to device. The
+error rate and the latency then select multi-page packets or selective
+repeat (--arq) for gang_flasher.py.
+
+    link_probe.py -b 2000000 /dev/ttyUSB0
+    link_probe.py -b 2000000 --simulate --ber 1e-5
+"""
+
+import argparse
+import math
+import os
+import select
+import struct
+import subprocess
+import sys
+import time
+
+import bootproto as bp
+
+SEED = 0x2545F491
+# bytes of a page frame on the wire: signature, header, address word, page, crc
+PAGE_FRAME_BYTES = 2 + 4 + 4 + bp.FLASH_PAGE_SIZE_BYTES + 2
+
+
+def receive(link, cmd, timeout):
+    """Frames of the answers to cmd until the final one or timeout seconds of silence."""
+    frames = []
+    deadline = time.monotonic() + timeout
+    while True:
+        left = deadline - time.monotonic()
+        if left <= 0:
+            return frames, None
+        r, _, _ = select.select([link.fd], [], [], left)
+        if not r:
+            continue
+        for frame in link.parser.feed(os.read(link.fd, 65536)):
+            if frame.cmd != bp.CMD_MSG or frame.msg_cmd != cmd:
+                continue
+            if frame.crc_ok and frame.status != bp.MSG_BUSY:
+                return frames, frame
+            frames.append(frame)
+        deadline = time.monotonic() + timeout
+
+
+def link_stats(link):
+    answer = link.request(bp.frame_test_stream(0, 0, SEED), "link counters")
+    return bp.LinkStats(answer.msg_data)
+
+
+def ping(link, count):
+    """Round trip times of CMD_ECHO with 8 bytes, None for the lost ones."""
+    out = []
+    for i in range(count):
+        frame = bp.frame_echo(struct.pack("<Q", i))
+        t0 = time.monotonic()
+        os.write(link.fd, frame)
+        _, answer = receive(link, bp.CMD_ECHO, link.timeout)
+        ok = answer is not None and answer.status == bp.MSG_OK and answer.msg_data == frame[6:-2]
+        out.append(time.monotonic() - t0 if ok else None)
+    return out
+
+
+def echo(link, count, size):
+    """(echoed bytes, failed exchanges, seconds) of count CMD_ECHO with size bytes."""
+    data = os.urandom(size)
+    frame = bp.frame_echo(data)
+    wire = 2 * (len(frame) + 4) * link.byte_time
+    failed = 0
+    t0 = time.monotonic()
+    for _ in range(count):
+        os.write(link.fd, frame)
+        _, answer = receive(link, bp.CMD_ECHO, link.timeout + wire)
+        if answer is None or answer.status != bp.MSG_OK or answer.msg_data != data:
+            failed += 1
+    return (count - failed) * size, failed, time.monotonic() - t0
+
+
+def stream(link, count, size):
+    """
+    CMD_TEST_STREAM of count frames. Returns (correct bytes, bits compared,
+    bit errors, frames lost or damaged, seconds from the request to the final answer).
+    """
+    expected = []
+    state = SEED
+    for _ in range(count):
+        pattern, state = bp.stream_pattern(state, size)
+        expected.append(pattern)
+    t0 = time.monotonic()
+    os.write(link.fd, bp.frame_test_stream(count, size, SEED))
+    frames, answer = receive(link, bp.CMD_TEST_STREAM, link.timeout + count * (size + 16) * link.byte_time)
+    if answer is None:
+        raise bp.LinkError("test stream ended without its final answer")
+    elapsed = time.monotonic() - t0
+
+    good = bits = bit_errors = 0
+    for frame in frames:
+        data = frame.msg_data
+        if len(data) != 4 + size:
+            continue
+        seq = struct.unpack_from("<I", data, 0)[0]
+        if seq >= count:
+            continue
+        # a damaged frame is compared bit by bit, its header survived
+        diff = int.from_bytes(data[4:], "little") ^ int.from_bytes(expected[seq], "little")
+        bits += size * 8
+        bit_errors += bin(diff).count("1")
+        if frame.crc_ok and not diff:
+            good += size
+    return good, bits, bit_errors, count - good // size, elapsed
+
+
+def error_rate(errors, bits):
+    """(bit error rate, 95 % upper bound 3 / bits when no error was seen)."""
+    if not bits:
+        return 0.0, 1.0
+    return errors / bits, (errors or 3.0) / bits
+
+
+def suggest(opts, info, rtt, ber):
+    """Options of gang_flasher.py for the measured link and the reasons."""
+    page_time = PAGE_FRAME_BYTES * 10.0 / opts.baud
+    page_loss = 1.0 - (1.0 - ber) ** (PAGE_FRAME_BYTES * 10)
+    if page_loss > 0.1:
+        return None, "a page frame is damaged with p = %.2f, use a lower baudrate" % page_loss
+    if page_loss > 0.01:
+        return "--arq --pages-max 1", \
+            "a page frame is damaged with p = %.3f, selective repeat resends only those" % page_loss
+    if rtt > page_time:
+        # pages in flight that keep the link busy over a round trip
+        window = min(bp.ARQ_WINDOW, info.fifo_bytes // PAGE_FRAME_BYTES, math.ceil(rtt / page_time) + 1)
+        return "--arq", "round trip %.2f ms is longer than a page (%.2f ms), " \
+            "selective repeat keeps %d pages in flight" % (rtt * 1e3, page_time * 1e3, window)
+    return "--pages-max %d" % info.pages_max, \
+        "clean link with a short round trip, %d pages per packet" % info.pages_max
+
+
+def run(link, opts):
+    link.sync()
+    answer = link.request(bp.frame_get_info_ext(), "info")
+    info = bp.InfoExt(answer.msg_data)
+    if not info.supports(bp.CMD_ECHO) or not info.supports(bp.CMD_TEST_STREAM):
+        raise bp.LinkError("bootloader is built without BOOT_USE_LINK_TEST")
+    before = link_stats(link)
+
+    rtts = ping(link, opts.pings)
+    ok = sorted(t for t in rtts if t is not None)
+    if not ok:
+        raise bp.LinkError("no answer to CMD_ECHO")
+    rtt = ok[len(ok) // 2]
+    print("round trip   min %.2f ms, median %.2f ms, max %.2f ms, %d of %d lost"
+          % (ok[0] * 1e3, rtt * 1e3, ok[-1] * 1e3, len(rtts) - len(ok), len(rtts)))
+
+    size = info.data_max - 4
+    echoed, failed, elapsed = echo(link, opts.echoes, size)
+    print("echo         %d x %d bytes, %.1f kB/s each way, %d failed"
+          % (opts.echoes, size, echoed / elapsed / 1e3 if elapsed else 0.0, failed))
+
+    size = (info.data_max - 8) & ~3
+    good, bits, bit_errors, bad, elapsed = stream(link, opts.frames, size)
+    print("stream       %d x %d bytes, %.1f kB/s, %d damaged or lost, %d bit errors"
+          % (opts.frames, size, good / elapsed / 1e3 if elapsed else 0.0, bad, bit_errors))
+
+    delta = link_stats(link) - before
+    # each read counts its own request, the difference covers the requests since the first one
+    host_errors = delta.crc_errors + delta.hdr_errors + delta.lost
+    print("device       %d frames, %d CRC errors, %d damaged headers, %d lost"
+          % (delta.frames, delta.crc_errors, delta.hdr_errors, delta.lost))
+
+    # a damaged host frame is counted once, whatever number of its bits were flipped
+    tx_bits = 10 * (opts.pings * len(bp.frame_echo(bytes(8))) +
+                    opts.echoes * len(bp.frame_echo(bytes(info.data_max - 4))) +
+                    2 * len(bp.frame_test_stream(0, 0, SEED)))
+    ber_rx, bound_rx = error_rate(bit_errors, bits)
+    ber_tx, bound_tx = error_rate(host_errors, tx_bits)
+    print("bit errors   device to host %s %.1e, host to device %s %.1e"
+          % ("=" if bit_errors else "<", bound_rx, "~" if host_errors else "<", bound_tx))
+
+    options, reason = suggest(opts, info, rtt, max(ber_rx, ber_tx))
+    print("suggested    %s" % (options if options is not None else "-"))
+    print("             %s" % reason)
+
+
+def start_simulator(baud, ber):
+    here = os.path.dirname(os.path.abspath(__file__))
+    cmd = [sys.executable, os.path.join(here, "boot_sim.py"), "--baud", str(baud), "--ber", str(ber)]
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, text=True)
+    path = None
+    for line in proc.stdout:
+        line = line.strip()
+        if line == "ready":
+            break
+        path = line
+    return proc, path
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("port", nargs="?", help="serial port of the board")
+    ap.add_argument("-b", "--baud", type=int, default=460800)
+    ap.add_argument("--pings", type=int, default=20, help="CMD_ECHO exchanges for the round trip")
+    ap.add_argument("--echoes", type=int, default=10, help="CMD_ECHO exchanges of the largest packet")
+    ap.add_argument("--frames", type=int, default=64, help="frames of CMD_TEST_STREAM")
+    ap.add_argument("--timeout", type=float, default=0.1, help="answer timeout, s")
+    ap.add_argument("--retries", type=int, default=3, help="retries per frame")
+    ap.add_argument("--simulate", action="store_true",
+                    help="run on a simulated board instead of a real port")
+    ap.add_argument("--ber", type=float, default=0.0,
+                    help="bit error rate of the simulated link")
+    opts = ap.parse_args()
+
+    sim = None
+    path = opts.port
+    if opts.simulate:
+        sim, path = start_simulator(opts.baud, opts.ber)
+    if path is None:
+        ap.error("no port given")
+
+    link = None
+    try:
+        link = bp.Link(path, opts.baud, opts.timeout, opts.retries)
+        run(link, opts)
+    except (bp.LinkError, OSError) as e:
+        print("%s: %s" % (path, e), file=sys.stderr)
+        return 1
+    finally:
+        if link is not None:
+            link.close()
+        if sim is not None:
+            sim.terminate()
+            sim.wait()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
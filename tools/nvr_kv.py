@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""
+Read and write the key-value log of the bootloader, kept in the last two pages
+of main flash since NVR page 3 holds CFGWORD.
+
+Settings such as calibration constants are kept as 32-bit values under keys
+0 .. KV_KEY_TOTAL - 1 (see include/boot_kv.h). CMD_KV_SET appends one record
+without erasing the page, so a value can be changed many times per erase.
+
+    nvr_kv.py -p /dev/ttyUSB0 list
+    nvr_kv.py -p /dev/ttyUSB0 get 3
+    nvr_kv.py -p /dev/ttyUSB0 set 3 0x1234
+    nvr_kv.py --simulate set 3 7
+"""
+
+import argparse
+import os
+import struct
+import subprocess
+import sys
+
+import bootproto as bp
+
+
+def kv_get(link, key):
+    """Value of a key, None when it was never written."""
+    answer = link.request(bp.frame_kv_get(key), "get %d" % key, accept=(bp.MSG_OK, bp.MSG_FAIL))
+    if answer.status != bp.MSG_OK:
+        return None
+    return struct.unpack_from("<I", answer.msg_data, 4)[0]
+
+
+def kv_set(link, key, value):
+    link.request(bp.frame_kv_set(key, value), "set %d" % key, 
+                 busy=bp.FLASH_T_ERASE_PAGE + (bp.KV_KEY_TOTAL + 2) * bp.FLASH_T_WRITE_DWORD)
+
+
+def start_simulator(baud):
+    here = os.path.dirname(os.path.abspath(__file__))
+    cmd = [sys.executable, os.path.join(here, "boot_sim.py"), "--baud", str(baud)]
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, text=True)
+    path = None
+    for line in proc.stdout:
+        line = line.strip()
+        if line == "ready":
+            break
+        path = line
+    return proc, path
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("-p", "--port", help="serial port of the board")
+    ap.add_argument("action", choices=("list", "get", "set"))
+    ap.add_argument("key", nargs="?", type=lambda s: int(s, 0))
+    ap.add_argument("value", nargs="?", type=lambda s: int(s, 0))
+    ap.add_argument("-b", "--baud", type=int, default=115200)
+    ap.add_argument("--timeout", type=float, default=0.1, help="answer timeout, s")
+    ap.add_argument("--retries", type=int, default=3, help="retries per frame")
+    ap.add_argument("--simulate", action="store_true",
+                    help="run on a simulated board instead of a real port")
+    opts = ap.parse_args()
+    if opts.action != "list" and opts.key is None:
+        ap.error("no key given")
+    if opts.action == "set" and opts.value is None:
+        ap.error("no value given")
+
+    sim = None
+    path = opts.port
+    if opts.simulate:
+        sim, path = start_simulator(opts.baud)
+    if path is None:
+        ap.error("no port given")
+
+    link = None
+    try:
+        link = bp.Link(path, opts.baud, opts.timeout, opts.retries)
+        link.sync()
+        answer = link.request(bp.frame_get_info_ext(), "info")
+        if not bp.InfoExt(answer.msg_data).supports(bp.CMD_KV_GET):
+            raise bp.LinkError("bootloader is built without BOOT_USE_KV")
+        if opts.action == "set":
+            kv_set(link, opts.key, opts.value & 0xFFFFFFFF)
+        keys = range(bp.KV_KEY_TOTAL) if opts.action == "list" else [opts.key]
+        for key in keys:
+            value = kv_get(link, key)
+            if value is not None:
+                print("%2d 0x%08X" % (key, value))
+            elif opts.action != "list":
+                print("%2d -" % key)
+    except (bp.LinkError, OSError) as e:
+        print("%s: %s" % (path, e), file=sys.stderr)
+        return 1
+    finally:
+        if link is not None:
+            link.close()
+        if sim is not None:
+            sim.terminate()
+            sim.wait()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
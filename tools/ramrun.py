@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""
+Upload an application image to RAM and start it without touching flash.
+
+The board runs a bootloader built with BOOT_USE_RAM_RUN. The image is linked
+for the RAM application region at RAM_APP_BASE (see
+test/test_firmware/K1921VK035_ram.ld), sent with CMD_RAM_WRITE and started
+with CMD_RAM_RUN, which checks its CRC16 and vector table, sets VTOR and MSP
+from it and jumps to its reset handler. A reset brings back the application
+in flash, so a debug build can be tried many times without wearing flash.
+
+    ramrun.py -b 460800 -i firmware_ram.elf /dev/ttyUSB0
+    ramrun.py -i firmware_ram.bin --simulate
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import time
+
+import bootproto as bp
+import image_plan
+
+
+def ram_image(path, base):
+    """Flatten the image into bytes starting at RAM_APP_BASE."""
+    segments = image_plan.load_segments(path, base)
+    if not segments:
+        raise image_plan.ImageError("image is empty")
+    end = max(addr + len(data) for addr, data in segments)
+    lo = min(addr for addr, _ in segments)
+    if lo < bp.RAM_APP_BASE or end > bp.RAM_APP_BASE + bp.RAM_APP_BYTES:
+        raise image_plan.ImageError("image 0x%08X..0x%08X is outside the RAM application region "
+                                    "0x%08X..0x%08X" % (lo, end, bp.RAM_APP_BASE,
+                                                        bp.RAM_APP_BASE + bp.RAM_APP_BYTES))
+    out = bytearray(b"\xFF" * (end - bp.RAM_APP_BASE))
+    for addr, data in segments:
+        off = addr - bp.RAM_APP_BASE
+        out[off:off + len(data)] = data
+    return bytes(out)
+
+
+def run(link, image):
+    link.sync()
+    answer = link.request(bp.frame_get_info_ext(), "info")
+    info = bp.InfoExt(answer.msg_data)
+    if not info.supports(bp.CMD_RAM_RUN):
+        raise bp.LinkError("bootloader is built without BOOT_USE_RAM_RUN")
+    chunk = info.data_max - 4
+    for off in range(0, len(image), chunk):
+        link.request(bp.frame_ram_write(off, image[off:off + chunk]), "write 0x%04X" % off)
+    link.request(bp.frame_ram_run(len(image), bp.crc16(image)), "run",
+                 busy=len(image) * 0.4e-6)
+
+
+def start_simulator(baud):
+    here = os.path.dirname(os.path.abspath(__file__))
+    cmd = [sys.executable, os.path.join(here, "boot_sim.py"), "--ram-run", "--baud", str(baud)]
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, text=True)
+    path = None
+    for line in proc.stdout:
+        line = line.strip()
+        if line == "ready":
+            break
+        path = line
+    return proc, path
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("port", nargs="?", help="serial port of the board")
+    ap.add_argument("-i", "--image", required=True,
+                    help="ELF, Intel HEX (.hex) or raw binary image linked for RAM")
+    ap.add_argument("-a", "--address", type=lambda s: int(s, 0), default=bp.RAM_APP_BASE,
+                    help="address of a raw binary (default 0x%08X)" % bp.RAM_APP_BASE)
+    ap.add_argument("-b", "--baud", type=int, default=460800)
+    ap.add_argument("--timeout", type=float, default=0.1, help="answer timeout, s")
+    ap.add_argument("--retries", type=int, default=3, help="retries per frame")
+    ap.add_argument("--simulate", action="store_true",
+                    help="run on a simulated board instead of a real port")
+    opts = ap.parse_args()
+
+    try:
+        image = ram_image(opts.image, opts.address)
+    except (image_plan.ImageError, OSError) as e:
+        print("%s: %s" % (opts.image, e), file=sys.stderr)
+        return 1
+
+    sim = None
+    path = opts.port
+    if opts.simulate:
+        sim, path = start_simulator(opts.baud)
+    if path is None:
+        ap.error("no port given")
+
+    link = None
+    try:
+        link = bp.Link(path, opts.baud, opts.timeout, opts.retries)
+        t0 = time.monotonic()
+        run(link, image)
+        elapsed = time.monotonic() - t0
+    except (bp.LinkError, OSError) as e:
+        print("%s: %s" % (path, e), file=sys.stderr)
+        return 1
+    finally:
+        if link is not None:
+            link.close()
+        if sim is not None:
+            sim.terminate()
+            sim.wait()
+
+    print("started %d bytes at 0x%08X, crc 0x%04X" % (len(image), bp.RAM_APP_BASE, bp.crc16(image)))
+    print("elapsed %.3f s" % elapsed)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())